@@ -0,0 +1,291 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#define ALLOC_INTERNAL
+#include "allocprof.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// Live blocks by address, in shards with a lock each
+#define SHARDS        64
+#define SHARD_BUCKETS 1024
+
+// Call sites, file and line. Sites beyond the table count in slot 0.
+#define SITES         2048
+
+typedef struct block_s {
+  void *ptr;
+  size_t size;
+  short tag;
+  short site;
+  struct block_s *next;
+} block_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  block_t *buckets[SHARD_BUCKETS];
+} shard_t;
+
+typedef struct {
+  unsigned long live_bytes;
+  unsigned long live_blocks;
+  unsigned long allocs;
+  unsigned long bytes;
+} counters_t;
+
+static shard_t *SHARD = NULL;
+static pthread_once_t ONCE = PTHREAD_ONCE_INIT;
+
+static alloc_site_t SITE[SITES];
+static pthread_mutex_t SITE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+static counters_t COUNT[ALLOC_TAGS];
+
+static pthread_mutex_t RATE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static counters_t LAST[ALLOC_TAGS];
+static double LAST_MS = 0.0;
+
+static const char *NAMES[ALLOC_TAGS] = { "other", "cue", "path", "data", "segment", "size", "log" };
+
+/**********************************************************************/
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void init(void)
+{
+  int i;
+  SHARD = (shard_t *) calloc(SHARDS, sizeof(shard_t));
+  for (i = 0; i < SHARDS; i++) {
+    pthread_mutex_init(&SHARD[i].mutex, NULL);
+  }
+  SITE[0].file = "(other sites)";
+  LAST_MS = now_ms();
+}
+
+static unsigned long hash_ptr(void *p)
+{
+  uintptr_t h = (uintptr_t) p >> 4;
+  return (unsigned long) (h ^ (h >> 11) ^ (h >> 23));
+}
+
+static int site_of(int tag, const char *file, int line)
+{
+  unsigned long h = ((uintptr_t) file >> 3) * 31 + line;
+  int i, n;
+  for (n = 0, i = h % (SITES - 1) + 1; n < SITES - 1; n++, i = i % (SITES - 1) + 1) {
+    const char *f = __atomic_load_n(&SITE[i].file, __ATOMIC_ACQUIRE);
+    if (f == file && SITE[i].line == line) {
+      return i;
+    }
+    if (f == NULL) {
+      pthread_mutex_lock(&SITE_MUTEX);
+      if (SITE[i].file == NULL) {
+        SITE[i].line = line;
+        SITE[i].tag = tag;
+        __atomic_store_n(&SITE[i].file, file, __ATOMIC_RELEASE);
+      }
+      pthread_mutex_unlock(&SITE_MUTEX);
+      if (SITE[i].file == file && SITE[i].line == line) {
+        return i;
+      }
+    }
+  }
+  return 0;
+}
+
+static void count(int tag, long bytes, long blocks)
+{
+  __atomic_fetch_add(&COUNT[tag].live_bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&COUNT[tag].live_blocks, blocks, __ATOMIC_RELAXED);
+}
+
+static void track(void *p, size_t size, int tag, const char *file, int line)
+{
+  int site = site_of(tag, file, line);
+  __atomic_fetch_add(&SITE[site].allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&SITE[site].bytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&COUNT[tag].allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&COUNT[tag].bytes, size, __ATOMIC_RELAXED);
+
+  block_t *b = (block_t *) malloc(sizeof(block_t));
+  if (b == NULL) {
+    return;
+  }
+  b->ptr = p;
+  b->size = size;
+  b->tag = tag;
+  b->site = site;
+
+  unsigned long h = hash_ptr(p);
+  shard_t *s = &SHARD[h % SHARDS];
+  pthread_mutex_lock(&s->mutex);
+  b->next = s->buckets[(h / SHARDS) % SHARD_BUCKETS];
+  s->buckets[(h / SHARDS) % SHARD_BUCKETS] = b;
+  pthread_mutex_unlock(&s->mutex);
+  count(tag, size, 1);
+}
+
+// Forgets p. Memory that wasn't allocated here isn't found, that's fine.
+static void untrack(void *p)
+{
+  unsigned long h = hash_ptr(p);
+  shard_t *s = &SHARD[h % SHARDS];
+  pthread_mutex_lock(&s->mutex);
+  block_t **bp = &s->buckets[(h / SHARDS) % SHARD_BUCKETS];
+  while (*bp != NULL && (*bp)->ptr != p) {
+    bp = &(*bp)->next;
+  }
+  block_t *b = *bp;
+  if (b != NULL) {
+    *bp = b->next;
+  }
+  pthread_mutex_unlock(&s->mutex);
+  if (b != NULL) {
+    count(b->tag, -(long) b->size, -1);
+    free(b);
+  }
+}
+
+/**********************************************************************/
+
+int alloc_profiling(void)
+{
+#ifdef ALLOC_PROFILE
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+const char *alloc_tag_name(int tag)
+{
+  return NAMES[tag];
+}
+
+void *alloc_malloc(int tag, size_t size, const char *file, int line)
+{
+  pthread_once(&ONCE, init);
+  void *p = malloc(size);
+  if (p != NULL) {
+    track(p, size, tag, file, line);
+  }
+  return p;
+}
+
+void *alloc_realloc(int tag, void *p, size_t size, const char *file, int line)
+{
+  pthread_once(&ONCE, init);
+  if (p != NULL) {
+    untrack(p);
+  }
+  void *q = realloc(p, size);
+  if (q != NULL) {
+    track(q, size, tag, file, line);
+  }
+  return q;
+}
+
+char *alloc_strdup(int tag, const char *s, const char *file, int line)
+{
+  size_t l = strlen(s) + 1;
+  char *d = (char *)alloc_malloc(tag, l, file, line);
+  if (d != NULL) {
+    memcpy(d, s, l);
+  }
+  return d;
+}
+
+void alloc_free(void *p)
+{
+  if (p == NULL) {
+    return;
+  }
+  pthread_once(&ONCE, init);
+  untrack(p);
+  free(p);
+}
+
+/**********************************************************************/
+
+void alloc_stats_all(alloc_stats_t * out)
+{
+  int t;
+  pthread_once(&ONCE, init);
+  pthread_mutex_lock(&RATE_MUTEX);
+  double now = now_ms();
+  double secs = (now - LAST_MS) / 1000.0;
+  for (t = 0; t < ALLOC_TAGS; t++) {
+    counters_t c;
+    c.live_bytes = __atomic_load_n(&COUNT[t].live_bytes, __ATOMIC_RELAXED);
+    c.live_blocks = __atomic_load_n(&COUNT[t].live_blocks, __ATOMIC_RELAXED);
+    c.allocs = __atomic_load_n(&COUNT[t].allocs, __ATOMIC_RELAXED);
+    c.bytes = __atomic_load_n(&COUNT[t].bytes, __ATOMIC_RELAXED);
+    out[t].live_bytes = c.live_bytes;
+    out[t].live_blocks = c.live_blocks;
+    out[t].allocs = c.allocs;
+    out[t].bytes = c.bytes;
+    out[t].allocs_per_s = (secs > 0.0) ? (c.allocs - LAST[t].allocs) / secs : 0.0;
+    out[t].bytes_per_s = (secs > 0.0) ? (c.bytes - LAST[t].bytes) / secs : 0.0;
+    LAST[t] = c;
+  }
+  LAST_MS = now;
+  pthread_mutex_unlock(&RATE_MUTEX);
+}
+
+static int by_allocs(const void *a, const void *b)
+{
+  const alloc_site_t *x = (const alloc_site_t *)a, *y = (const alloc_site_t *)b;
+  return (x->allocs < y->allocs) ? 1 : (x->allocs > y->allocs) ? -1 : 0;
+}
+
+int alloc_hot_sites(alloc_site_t * out, int n)
+{
+  alloc_site_t *all = (alloc_site_t *) malloc(sizeof(alloc_site_t) * SITES);
+  int i, k = 0;
+  if (all == NULL) {
+    return 0;
+  }
+  for (i = 0; i < SITES; i++) {
+    const char *f = __atomic_load_n(&SITE[i].file, __ATOMIC_ACQUIRE);
+    unsigned long allocs = __atomic_load_n(&SITE[i].allocs, __ATOMIC_RELAXED);
+    if (f != NULL && allocs > 0) {
+      all[k] = SITE[i];
+      all[k].allocs = allocs;
+      all[k].bytes = __atomic_load_n(&SITE[i].bytes, __ATOMIC_RELAXED);
+      k += 1;
+    }
+  }
+  qsort(all, k, sizeof(alloc_site_t), by_allocs);
+  if (k > n) {
+    k = n;
+  }
+  memcpy(out, all, sizeof(alloc_site_t) * k);
+  free(all);
+  return k;
+}
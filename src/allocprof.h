@@ -0,0 +1,97 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __ALLOCPROF__HOD
+#define __ALLOCPROF__HOD
+
+#include <stddef.h>
+#include <elementals/memcheck.h>
+
+/*
+ * Allocation accounting by subsystem, in builds made with ALLOC_PROFILE
+ * defined (make ALLOC_PROFILE=1). A source file tags its allocations
+ * by defining ALLOC_TAG before it includes this header, and may
+ * redefine it further down for a part of the file. mc_malloc(),
+ * mc_realloc(), mc_strdup() and mc_free() then keep count of the live
+ * bytes per tag and of the allocations per call site. Blocks are
+ * looked up by address when freed, so memory that came from elsewhere
+ * may still go to mc_free().
+ *
+ * Without ALLOC_PROFILE this header adds nothing to the allocators.
+ */
+
+enum {
+  ALLOC_OTHER = 0,
+  ALLOC_CUE,        // cue parser and cue sheet cache
+  ALLOC_PATH,       // path helpers
+  ALLOC_DATA,       // data table, interned keys, directory listings
+  ALLOC_SEGMENT,    // segment cache
+  ALLOC_SIZE,       // size cache
+  ALLOC_LOG,        // logger and tracer
+  ALLOC_TAGS
+};
+
+typedef struct {
+  unsigned long live_bytes;
+  unsigned long live_blocks;
+  unsigned long allocs;       // since start
+  unsigned long bytes;
+  double allocs_per_s;        // since the previous alloc_stats_all()
+  double bytes_per_s;
+} alloc_stats_t;
+
+typedef struct {
+  const char *file;
+  int line;
+  int tag;
+  unsigned long allocs;
+  unsigned long bytes;
+} alloc_site_t;
+
+int alloc_profiling(void);
+const char *alloc_tag_name(int tag);
+void alloc_stats_all(alloc_stats_t * out);     // ALLOC_TAGS values
+int alloc_hot_sites(alloc_site_t * out, int n);   // most allocations first
+
+void *alloc_malloc(int tag, size_t size, const char *file, int line);
+void *alloc_realloc(int tag, void *p, size_t size, const char *file, int line);
+char *alloc_strdup(int tag, const char *s, const char *file, int line);
+void alloc_free(void *p);
+
+#endif
+
+#if defined(ALLOC_PROFILE) && !defined(ALLOC_INTERNAL) && !defined(__ALLOCPROF__MACROS)
+#define __ALLOCPROF__MACROS
+
+#ifndef ALLOC_TAG
+#define ALLOC_TAG ALLOC_OTHER
+#endif
+
+#undef mc_malloc
+#undef mc_realloc
+#undef mc_strdup
+#undef mc_free
+#undef mc_take_over
+#define mc_malloc(size)     alloc_malloc(ALLOC_TAG, size, __FILE__, __LINE__)
+#define mc_realloc(p, size) alloc_realloc(ALLOC_TAG, p, size, __FILE__, __LINE__)
+#define mc_strdup(s)        alloc_strdup(ALLOC_TAG, s, __FILE__, __LINE__)
+#define mc_free(p)          alloc_free(p)
+#define mc_take_over(p)     (p)
+
+#endif
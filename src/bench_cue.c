@@ -0,0 +1,126 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+/*
+ * Measures cue sheet parsing in cues per second.
+ *
+ *   bench_cue [-n iterations] [cuefile ...]
+ *
+ * Without cue files a 30 track sheet is written to /tmp and parsed.
+ */
+
+#include "cue.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <elementals.h>
+
+FILE *log_handle()
+{
+  return stderr;
+}
+
+int log_this_severity(int severity)
+{
+  return severity > LOG_INFO;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *synthetic_cue(void)
+{
+  static char path[] = "/tmp/bench_cue.cue";
+  FILE *f = fopen(path, "wt");
+  if (f == NULL) {
+    return NULL;
+  }
+  fprintf(f, "REM GENRE \"Classical\"\r\n");
+  fprintf(f, "REM DATE 1985\r\n");
+  fprintf(f, "REM COMPOSER \"Johann Sebastian Bach\"\r\n");
+  fprintf(f, "PERFORMER \"The Bench Ensemble\"\r\n");
+  fprintf(f, "TITLE \"Synthetic Album With A Reasonably Long Title\"\r\n");
+  fprintf(f, "FILE \"bench_cue.flac\" WAVE\r\n");
+  int t;
+  for (t = 1; t <= 30; t++) {
+    fprintf(f, "  TRACK %02d AUDIO\r\n", t);
+    fprintf(f, "    TITLE \"Movement %d: Allegro ma non troppo\"\r\n", t);
+    fprintf(f, "    PERFORMER \"The Bench Ensemble\"\r\n");
+    fprintf(f, "    REM PIECE \"Suite No. %d\"\r\n", (t + 5) / 6);
+    if (t > 1) {
+      fprintf(f, "    INDEX 00 %02d:%02d:%02d\r\n", (t - 1) * 4, 58, 10);
+    }
+    fprintf(f, "    INDEX 01 %02d:%02d:%02d\r\n", t * 4, 0, 0);
+  }
+  fclose(f);
+  return path;
+}
+
+int main(int argc, char *argv[])
+{
+  int iterations = 10000;
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    iterations = atoi(argv[2]);
+    first = 3;
+  }
+
+  const char *def[1];
+  const char **files = (const char **)&argv[first];
+  int nfiles = argc - first;
+  if (nfiles == 0) {
+    def[0] = synthetic_cue();
+    if (def[0] == NULL) {
+      fprintf(stderr, "cannot write synthetic cue sheet\n");
+      return 1;
+    }
+    files = def;
+    nfiles = 1;
+  }
+
+  int f;
+  for (f = 0; f < nfiles; f++) {
+    cue_t *c = cue_new(files[f]);
+    if (!cue_valid(c)) {
+      fprintf(stderr, "cannot read %s\n", files[f]);
+      cue_destroy(c);
+      return 1;
+    }
+    int tracks = cue_count(c);
+    size_t bytes = cue_bytes(c);
+    cue_destroy(c);
+
+    double t0 = now_s();
+    int i;
+    for (i = 0; i < iterations; i++) {
+      cue_destroy(cue_new(files[f]));
+    }
+    double dt = now_s() - t0;
+
+    printf("%s: %d tracks, %d parses in %.3fs, %.0f cues/s, %.1f us/cue, %d bytes\n",
+           files[f], tracks, iterations, dt, iterations / dt, dt * 1e6 / iterations, (int)bytes);
+  }
+  return 0;
+}
@@ -0,0 +1,362 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+/*
+ * Runs the file system operations in-process against a synthetic
+ * library, without mounting anything.
+ *
+ *   bench_mp3cue [-d dir] [-a artists] [-b albums] [-t tracks]
+ *                [-s seconds] [-o] [-k] [-c] [-j workers] [-p tracks]
+ *                [-r reads]
+ *
+ * -o makes Ogg Vorbis albums (needs oggenc), -k keeps an existing
+ * library in dir, -c restarts the engine before every workload so
+ * each starts cold. Workloads:
+ *
+ *   browse    Finder: readdir and getattr of everything, plus the
+ *             ._name and .DS_Store probes that come with it
+ *   import    iTunes: per track getattr, open, read the head and the
+ *             ID3v1 tail, release
+ *   playback  reads -p tracks from start to end in 128KB chunks
+ *   seek      -r reads of 4KB at random places in random tracks
+ *
+ * Every workload reports operations per second, p50 and p99 per
+ * operation, and the peak RSS so far, one line each.
+ */
+
+#define MP3CUEFUSE_NO_MAIN
+#include "mp3cuefuse.c"
+#include "synth.h"
+#include <sys/resource.h>
+
+typedef struct {
+  char **names;
+  int count;
+  int size;
+} names_t;
+
+static void names_add(names_t * n, const char* name)
+{
+  if (n->count == n->size) {
+    n->size = (n->size == 0) ? 64 : n->size * 2;
+    n->names = (char**) realloc(n->names, sizeof(char*) * n->size);
+  }
+  n->names[n->count++] = strdup(name);
+}
+
+static void names_clear(names_t * n)
+{
+  int i;
+  for (i = 0; i < n->count; i++) {
+    free(n->names[i]);
+  }
+  free(n->names);
+  memset(n, 0, sizeof(names_t));
+}
+
+static int filler(void *buf, const char* name, const struct stat *st, off_t off)
+{
+  if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    names_add((names_t *) buf, name);
+  }
+  return 0;
+}
+
+static names_t TRACKS;
+static unsigned long OPS = 0;
+static unsigned long long BYTES = 0;
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**********************************************************************/
+
+static void engine_start(const char* dir)
+{
+  mp3cue_setup();
+  mp3cue_configure(NULL);
+  mp3cue_set_basedir(dir);
+  mp3cue_oper.init(NULL);
+}
+
+static void engine_stop(void)
+{
+  mp3cue_oper.destroy(NULL);
+  mp3cue_teardown();
+}
+
+static int op_getattr(const char* path, struct stat *st)
+{
+  OPS += 1;
+  return mp3cue_oper.getattr(path, st);
+}
+
+static int read_track(const char* path, off_t offset, size_t size, char* buf)
+{
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_RDONLY;
+  OPS += 1;
+  if (mp3cue_oper.open(path, &fi) != 0) {
+    return -1;
+  }
+  OPS += 1;
+  int n = mp3cue_oper.read(path, buf, size, offset, &fi);
+  if (n > 0) {
+    BYTES += n;
+  }
+  OPS += 1;
+  mp3cue_oper.release(path, &fi);
+  return n;
+}
+
+// Cue sheets show up as directories that aren't there
+static int is_track_dir(const char* path)
+{
+  struct stat st;
+  char* full = make_path(path);
+  int virtual = (stat(full, &st) != 0 || !S_ISDIR(st.st_mode));
+  mc_free(full);
+  return virtual;
+}
+
+static void browse(const char* path)
+{
+  names_t names;
+  char sub[4096];
+  struct stat st;
+  int i;
+
+  memset(&names, 0, sizeof(names));
+  OPS += 1;
+  mp3cue_oper.readdir(path, &names, filler, 0, NULL);
+  const char* sep = (strcmp(path, "/") == 0) ? "" : "/";
+
+  snprintf(sub, sizeof(sub), "%s/.DS_Store", sep[0] ? path : "");
+  op_getattr(sub, &st);
+
+  for (i = 0; i < names.count; i++) {
+    snprintf(sub, sizeof(sub), "%s%s._%s", path, sep, names.names[i]);
+    op_getattr(sub, &st);
+    snprintf(sub, sizeof(sub), "%s%s%s", path, sep, names.names[i]);
+    if (op_getattr(sub, &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      browse(sub);
+    } else if (is_track_dir(path)) {
+      names_add(&TRACKS, sub);
+    }
+  }
+  names_clear(&names);
+}
+
+/**********************************************************************/
+
+static void w_browse(void)
+{
+  names_clear(&TRACKS);
+  browse("/");
+}
+
+static void w_import(void)
+{
+  char buf[64 * 1024];
+  int i;
+  for (i = 0; i < TRACKS.count; i++) {
+    struct stat st;
+    const char* path = TRACKS.names[i];
+    if (op_getattr(path, &st) != 0) {
+      continue;
+    }
+    read_track(path, 0, sizeof(buf), buf);
+    if (st.st_size > 128) {
+      read_track(path, st.st_size - 128, 128, buf);
+    }
+  }
+}
+
+static int PLAY_TRACKS = 10;
+static int SEEK_READS = 1000;
+
+static void w_playback(void)
+{
+  static char buf[128 * 1024];
+  int i;
+  for (i = 0; i < TRACKS.count && i < PLAY_TRACKS; i++) {
+    const char* path = TRACKS.names[i];
+    struct fuse_file_info fi;
+    struct stat st;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    // the kernel looks a path up before opening it
+    if (op_getattr(path, &st) != 0) {
+      continue;
+    }
+    OPS += 1;
+    if (mp3cue_oper.open(path, &fi) != 0) {
+      continue;
+    }
+    off_t offset = 0;
+    int n;
+    do {
+      OPS += 1;
+      n = mp3cue_oper.read(path, buf, sizeof(buf), offset, &fi);
+      if (n > 0) {
+        offset += n;
+        BYTES += n;
+      }
+    } while (n > 0);
+    OPS += 1;
+    mp3cue_oper.release(path, &fi);
+  }
+}
+
+static void w_seek(void)
+{
+  char buf[4096];
+  unsigned int seed = 1;
+  int i;
+  if (TRACKS.count == 0) {
+    return;
+  }
+  for (i = 0; i < SEEK_READS; i++) {
+    struct stat st;
+    const char* path = TRACKS.names[rand_r(&seed) % TRACKS.count];
+    if (op_getattr(path, &st) != 0 || st.st_size <= 0) {
+      continue;
+    }
+    read_track(path, rand_r(&seed) % st.st_size, sizeof(buf), buf);
+  }
+}
+
+typedef struct {
+  const char* name;
+  void (*run)(void);
+} workload_t;
+
+static const workload_t WORKLOADS[] = {
+  { "browse", w_browse },
+  { "import", w_import },
+  { "playback", w_playback },
+  { "seek", w_seek },
+  { NULL, NULL }
+};
+
+/**********************************************************************/
+
+static void report(const char* name, double secs, latency_hist_t *before, latency_hist_t *after)
+{
+  struct rusage ru;
+  int op, b;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-9s ops=%lu secs=%.3f ops/s=%.0f MB=%.1f peak_rss_kb=%ld",
+         name, OPS, secs, (secs > 0.0) ? OPS / secs : 0.0,
+         BYTES / (1024.0 * 1024.0), ru.ru_maxrss);
+  for (op = 0; op < LAT_FIRST_PHASE; op++) {
+    latency_hist_t *h = &after[op];
+    // Only what this workload added
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      h->counts[b] -= before[op].counts[b];
+    }
+    h->count -= before[op].count;
+    if (h->count > 0) {
+      printf(" %s_p50_us=%llu %s_p99_us=%llu",
+             latency_name(op), latency_quantile(h, 0.50),
+             latency_name(op), latency_quantile(h, 0.99));
+    }
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+  synth_config_t cfg;
+  const char* dir = "/tmp/mp3cue_bench";
+  int keep = false, cold = false, i, c;
+
+  synth_defaults(&cfg);
+  while ((c = getopt(argc, argv, "d:a:b:t:s:okcj:p:r:")) != -1) {
+    switch (c) {
+      case 'd': dir = optarg; break;
+      case 'a': cfg.artists = atoi(optarg); break;
+      case 'b': cfg.albums = atoi(optarg); break;
+      case 't': cfg.tracks = atoi(optarg); break;
+      case 's': cfg.track_s = atoi(optarg); break;
+      case 'o': cfg.ogg = true; break;
+      case 'k': keep = true; break;
+      case 'c': cold = true; break;
+      case 'j': WORKERS = atoi(optarg); break;
+      case 'p': PLAY_TRACKS = atoi(optarg); break;
+      case 'r': SEEK_READS = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-d dir] [-a artists] [-b albums] [-t tracks] [-s seconds] "
+                "[-o] [-k] [-c] [-j workers] [-p tracks] [-r reads]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  struct stat st;
+  if (!keep || stat(dir, &st) != 0) {
+    double t0 = now_s();
+    int n = synth_library(dir, &cfg);
+    if (n < 0) {
+      fprintf(stderr, "cannot make a library in %s\n", dir);
+      return 1;
+    }
+    printf("library   dir=%s tracks=%d secs=%.3f\n", dir, n, now_s() - t0);
+  }
+
+  mc_init();
+  LOG_FILE = "/tmp/bench_mp3cue.log";
+  engine_start(dir);
+
+  latency_hist_t *before = (latency_hist_t *) mc_malloc(sizeof(latency_hist_t) * LAT_FIRST_PHASE);
+  latency_hist_t *after = (latency_hist_t *) mc_malloc(sizeof(latency_hist_t) * LAT_FIRST_PHASE);
+  for (i = 0; WORKLOADS[i].name != NULL; i++) {
+    int op;
+    if (cold && i > 0) {
+      engine_stop();
+      engine_start(dir);
+    }
+    for (op = 0; op < LAT_FIRST_PHASE; op++) {
+      latency_snapshot(op, &before[op]);
+    }
+    OPS = 0;
+    BYTES = 0;
+    double t0 = now_s();
+    WORKLOADS[i].run();
+    double secs = now_s() - t0;
+    for (op = 0; op < LAT_FIRST_PHASE; op++) {
+      latency_snapshot(op, &after[op]);
+    }
+    report(WORKLOADS[i].name, secs, before, after);
+  }
+  mc_free(before);
+  mc_free(after);
+
+  engine_stop();
+  names_clear(&TRACKS);
+  return 0;
+}
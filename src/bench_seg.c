@@ -0,0 +1,344 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+/*
+ * Benchmarks the segmenter alone: prepare, create, open, read and seek
+ * on synthetic albums of every supported format and a range of track
+ * lengths.
+ *
+ *   bench_seg [-d dir] [-l seconds,...] [-j threads,...] [-n runs]
+ *
+ * Prints CSV on stdout, with comment lines describing the build and
+ * the machine, so runs can be compared. Per format and length there is
+ * one row per number of threads splitting at the same time; times are
+ * medians over the runs.
+ *
+ *   split_ms     prepare and create; for threads > 1 the wall time of
+ *                all splits together
+ *   split_mb_s   segment bytes made per second, over all threads
+ *   ttfb_ms      prepare until the first 4KB is read
+ *   read_mb_s    reading the segment from start to end in 64KB
+ *   seek_us      one seek and a 4KB read at a random place
+ *   retag_ms     an existing segment copied with new tags, mp3 only
+ *   segment_kb   size of the segment
+ *   rss_kb       resident memory a created segment adds
+ */
+
+#include "segmenter.h"
+#include "latency.h"
+#include "synth.h"
+#include "../version.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <elementals.h>
+
+FILE *log_handle()
+{
+  return stderr;
+}
+
+int log_this_severity(int severity)
+{
+  return severity > LOG_INFO;
+}
+
+#define MAX_LIST   16
+#define PAD_MS     10000      // audio before and after the segment
+#define SEEKS      200
+
+typedef struct {
+  int n;
+  int v[MAX_LIST];
+} int_list_t;
+
+typedef struct {
+  const char *file;
+  int ms;
+  double split_s;
+  double ttfb_s;
+  size_t size;
+  int result;
+} job_t;
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rss_kb(void)
+{
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int parse_list(const char *s, int_list_t * l)
+{
+  l->n = 0;
+  while (*s && l->n < MAX_LIST) {
+    l->v[l->n++] = atoi(s);
+    s = strchr(s, ',');
+    if (s == NULL) {
+      break;
+    }
+    s++;
+  }
+  return l->n;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x < y) ? -1 : (x > y);
+}
+
+static double median(double *v, int n)
+{
+  qsort(v, n, sizeof(double), cmp_double);
+  return v[n / 2];
+}
+
+/**********************************************************************/
+
+static void prepare(segmenter_t * s, const char *file, int ms, const char *title)
+{
+  segmenter_prepare(s, file, 1, title, "Artist", "Album", "Artist", "", "Synthetic",
+                    2013, "", PAD_MS, PAD_MS + ms);
+}
+
+// Split and read the first 4KB, as an open followed by a read does
+static segmenter_t *split(job_t * j)
+{
+  char buf[4096];
+  segmenter_t *s = segmenter_new();
+  double t0 = now_s();
+  prepare(s, j->file, j->ms, "Title");
+  j->result = segmenter_create(s);
+  j->split_s = now_s() - t0;
+  if (j->result == SEGMENTER_OK && segmenter_open(s) == SEGMENTER_OK) {
+    segmenter_seek(s, 0);
+    segmenter_read(s, buf, sizeof(buf));
+    segmenter_close(s);
+  }
+  j->ttfb_s = now_s() - t0;
+  j->size = segmenter_size(s);
+  return s;
+}
+
+static void *split_thread(void *data)
+{
+  segmenter_destroy(split((job_t *) data));
+  return NULL;
+}
+
+static void print_row(const char *fmt, int secs, int threads, double split_s, double mb, double ttfb_s,
+                      double read_s, double seek_s, double retag_s, size_t size, long rss)
+{
+  printf("%s,%d,%d,%.1f,%.1f,%.2f,", fmt, secs, threads, split_s * 1e3,
+         (split_s > 0.0) ? mb / split_s : 0.0, ttfb_s * 1e3);
+  if (read_s >= 0.0) {
+    printf("%.1f,%.1f,", (read_s > 0.0) ? size / (1024.0 * 1024.0) / read_s : 0.0, seek_s * 1e6);
+  } else {
+    printf(",,");
+  }
+  if (retag_s >= 0.0) {
+    printf("%.2f,", retag_s * 1e3);
+  } else {
+    printf(",");
+  }
+  printf("%lu,", (unsigned long)(size / 1024));
+  if (rss >= 0) {
+    printf("%ld", rss);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+static void bench_single(const char *fmt, const char *file, int secs, int runs)
+{
+  double split_s[runs], ttfb_s[runs], read_s[runs], seek_s[runs], retag_s[runs], rss[runs];
+  static char buf[64 * 1024];
+  size_t size = 0;
+  int r, i;
+
+  for (r = 0; r < runs; r++) {
+    job_t j = { file, secs * 1000, 0.0, 0.0, 0, 0 };
+    long rss0 = rss_kb();
+    segmenter_t *s = split(&j);
+    rss[r] = rss_kb() - rss0;
+    if (j.result != SEGMENTER_OK) {
+      fprintf(stderr, "bench_seg: %s: split failed (%d)\n", file, j.result);
+      segmenter_destroy(s);
+      return;
+    }
+    split_s[r] = j.split_s;
+    ttfb_s[r] = j.ttfb_s;
+    size = j.size;
+
+    segmenter_open(s);
+    double t0 = now_s();
+    segmenter_seek(s, 0);
+    while (segmenter_read(s, buf, sizeof(buf)) > 0) ;
+    read_s[r] = now_s() - t0;
+
+    unsigned int seed = r + 1;
+    t0 = now_s();
+    for (i = 0; i < SEEKS; i++) {
+      segmenter_seek(s, rand_r(&seed) % size);
+      segmenter_read(s, buf, 4096);
+    }
+    seek_s[r] = (now_s() - t0) / SEEKS;
+    segmenter_close(s);
+
+    retag_s[r] = -1.0;
+    if (strcmp(fmt, "mp3") == 0) {
+      segmenter_t *t = segmenter_new();
+      prepare(t, file, secs * 1000, "Another title");
+      t0 = now_s();
+      if (segmenter_retag_from(t, s) == SEGMENTER_OK) {
+        retag_s[r] = now_s() - t0;
+      }
+      segmenter_destroy(t);
+    }
+    segmenter_destroy(s);
+  }
+
+  double split_m = median(split_s, runs);
+  print_row(fmt, secs, 1, split_m, size / (1024.0 * 1024.0), median(ttfb_s, runs),
+            median(read_s, runs), median(seek_s, runs), median(retag_s, runs), size,
+            (long)median(rss, runs));
+}
+
+static void bench_concurrent(const char *fmt, const char *file, int secs, int threads, int runs)
+{
+  double wall_s[runs], ttfb_s[runs];
+  pthread_t tid[threads];
+  job_t jobs[threads];
+  size_t bytes = 0, size = 0;
+  int r, t;
+
+  for (r = 0; r < runs; r++) {
+    double t0 = now_s();
+    for (t = 0; t < threads; t++) {
+      job_t j = { file, secs * 1000, 0.0, 0.0, 0, 0 };
+      jobs[t] = j;
+      pthread_create(&tid[t], NULL, split_thread, &jobs[t]);
+    }
+    double ttfb = 0.0;
+    bytes = 0;
+    for (t = 0; t < threads; t++) {
+      pthread_join(tid[t], NULL);
+      ttfb += jobs[t].ttfb_s;
+      bytes += jobs[t].size;
+      size = jobs[t].size;
+    }
+    wall_s[r] = now_s() - t0;
+    ttfb_s[r] = ttfb / threads;
+  }
+
+  print_row(fmt, secs, threads, median(wall_s, runs), bytes / (1024.0 * 1024.0),
+            median(ttfb_s, runs), -1.0, 0.0, -1.0, size, -1);
+}
+
+/**********************************************************************/
+
+int main(int argc, char *argv[])
+{
+  const char *dir = "/tmp/mp3cue_bench_seg";
+  const char *formats[] = { "mp3", "ogg" };
+  int_list_t lengths, threads;
+  int runs = 3, f, l, t, c;
+
+  parse_list("30,240,1200", &lengths);
+  parse_list("1,2,4,8", &threads);
+  while ((c = getopt(argc, argv, "d:l:j:n:")) != -1) {
+    switch (c) {
+      case 'd': dir = optarg; break;
+      case 'l': parse_list(optarg, &lengths); break;
+      case 'j': parse_list(optarg, &threads); break;
+      case 'n': runs = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-d dir] [-l seconds,...] [-j threads,...] [-n runs]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (runs < 1) {
+    runs = 1;
+  }
+
+  mc_init();
+  latency_init();
+  mkdir(dir, 0755);
+
+  struct utsname u;
+  time_t now = time(NULL);
+  char when[64];
+  uname(&u);
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+  printf("# bench_seg mp3cuefuse %d.%d, %s\n", MP3CUEFUSE_VERSION_MAJOR, MP3CUEFUSE_VERSION_MINOR, when);
+  printf("# host %s, %s %s %s, %ld cpus, %d runs\n", u.nodename, u.sysname, u.release, u.machine,
+         sysconf(_SC_NPROCESSORS_ONLN), runs);
+  printf("format,track_s,threads,split_ms,split_mb_s,ttfb_ms,read_mb_s,seek_us,retag_ms,segment_kb,rss_kb\n");
+
+  for (f = 0; f < 2; f++) {
+    if (strcmp(formats[f], "ogg") == 0 && !synth_have_ogg()) {
+      printf("# ogg skipped, oggenc is not installed\n");
+      continue;
+    }
+    for (l = 0; l < lengths.n; l++) {
+      char file[4096];
+      struct stat st;
+      int secs = lengths.v[l];
+      snprintf(file, sizeof(file), "%s/%ds.%s", dir, secs, formats[f]);
+      if (stat(file, &st) != 0) {
+        int ms = secs * 1000 + 2 * PAD_MS;
+        int r = (f == 0) ? synth_mp3(file, ms) : synth_ogg(file, ms);
+        if (r != 0) {
+          fprintf(stderr, "bench_seg: cannot make %s\n", file);
+          continue;
+        }
+      }
+      for (t = 0; t < threads.n; t++) {
+        if (threads.v[t] <= 1) {
+          bench_single(formats[f], file, secs, runs);
+        } else {
+          bench_concurrent(formats[f], file, secs, threads.v[t], runs);
+        }
+      }
+    }
+  }
+
+  latency_destroy();
+  return 0;
+}
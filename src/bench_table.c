@@ -0,0 +1,135 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+/*
+ * Measures strtable lookups at 10k, 100k and 1M entries.
+ *
+ *   bench_table [-n lookups]
+ *
+ * Keys look like the paths in a mount. Hits are looked up in random
+ * order, misses are keys that were never put.
+ */
+
+#include "strtable.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <elementals.h>
+
+FILE *log_handle()
+{
+  return stderr;
+}
+
+int log_this_severity(int severity)
+{
+  return severity > LOG_INFO;
+}
+
+typedef struct {
+  const intern_t *key;
+  int value;
+} item_t;
+
+static const intern_t *item_key(const void *item)
+{
+  return ((const item_t *) item)->key;
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_key(char *buf, int size, int i)
+{
+  snprintf(buf, size, "/Artist %d/Album %d.cue/%02d - Track title %d.flac",
+           i / 1000, i / 12, i % 12 + 1, i);
+}
+
+static void bench(int entries, int lookups)
+{
+  char buf[256];
+  strtable_t *t = strtable_new(16, item_key, NULL);
+  item_t *items = (item_t *) malloc(sizeof(item_t) * entries);
+  char **keys = (char **) malloc(sizeof(char *) * lookups);
+  int i;
+
+  double t0 = now_s();
+  for (i = 0; i < entries; i++) {
+    make_key(buf, sizeof(buf), i);
+    items[i].key = intern(buf);
+    items[i].value = i;
+    strtable_put(t, &items[i]);
+  }
+  double put_s = now_s() - t0;
+
+  srand(entries);
+  for (i = 0; i < lookups; i++) {
+    make_key(buf, sizeof(buf), rand() % entries);
+    keys[i] = strdup(buf);
+  }
+  int found = 0;
+  t0 = now_s();
+  for (i = 0; i < lookups; i++) {
+    found += (strtable_get(t, keys[i]) != NULL);
+  }
+  double hit_s = now_s() - t0;
+
+  for (i = 0; i < lookups; i++) {
+    make_key(buf, sizeof(buf), entries + rand() % entries);
+    free(keys[i]);
+    keys[i] = strdup(buf);
+  }
+  t0 = now_s();
+  for (i = 0; i < lookups; i++) {
+    found -= (strtable_get(t, keys[i]) != NULL);
+  }
+  double miss_s = now_s() - t0;
+
+  printf("%8d entries, %8d slots: put %.0f ns, hit %.0f ns, miss %.0f ns%s\n",
+         entries, strtable_slots(t), put_s * 1e9 / entries,
+         hit_s * 1e9 / lookups, miss_s * 1e9 / lookups,
+         (found == lookups) ? "" : " (wrong results!)");
+
+  for (i = 0; i < lookups; i++) {
+    free(keys[i]);
+  }
+  free(keys);
+  strtable_destroy(t);
+  free(items);
+}
+
+int main(int argc, char *argv[])
+{
+  int lookups = 1000000;
+  if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+    lookups = atoi(argv[2]);
+  }
+  intern_init();
+  bench(10000, lookups);
+  bench(100000, lookups);
+  bench(1000000, lookups);
+  intern_destroy();
+  return 0;
+}
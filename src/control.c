@@ -0,0 +1,225 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "control.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+#define CONTROL_MAX_FILES 8
+#define CONTROL_MAX_LINE  4096
+
+typedef struct {
+  char *name;
+  control_fill_fn fill;
+  control_command_fn command;   // NULL for read only files
+} control_file_t;
+
+// Registered before fuse_main(), read only afterwards
+static control_file_t FILES[CONTROL_MAX_FILES];
+static int COUNT = 0;
+static time_t STARTED = 0;
+
+/**********************************************************************/
+
+static control_file_t *find(const char *path)
+{
+  int l = strlen(CONTROL_DIR);
+  if (strncmp(path, CONTROL_DIR, l) != 0 || path[l] != '/') {
+    return NULL;
+  }
+  int i;
+  for (i = 0; i < COUNT; i++) {
+    if (strcmp(path + l + 1, FILES[i].name) == 0) {
+      return &FILES[i];
+    }
+  }
+  return NULL;
+}
+
+/**********************************************************************/
+
+void control_register(const char *name, control_fill_fn fill)
+{
+  control_register_command(name, fill, NULL);
+}
+
+void control_register_command(const char *name, control_fill_fn fill, control_command_fn command)
+{
+  if (COUNT == CONTROL_MAX_FILES) {
+    log_error2("control: no room for %s", name);
+    return;
+  }
+  if (STARTED == 0) {
+    STARTED = time(NULL);
+  }
+  FILES[COUNT].name = mc_strdup(name);
+  FILES[COUNT].fill = fill;
+  FILES[COUNT].command = command;
+  COUNT += 1;
+}
+
+void control_destroy(void)
+{
+  int i;
+  for (i = 0; i < COUNT; i++) {
+    mc_free(FILES[i].name);
+  }
+  COUNT = 0;
+}
+
+int control_kind(const char *path)
+{
+  if (strcmp(path, CONTROL_DIR) == 0) {
+    return CONTROL_ROOT;
+  } else if (find(path) != NULL) {
+    return CONTROL_FILE;
+  } else {
+    return CONTROL_NONE;
+  }
+}
+
+void control_stat(const char *path, struct stat *st)
+{
+  memset(st, 0, sizeof(struct stat));
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  st->st_atime = st->st_mtime = st->st_ctime = STARTED;
+  if (control_kind(path) == CONTROL_ROOT) {
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+  } else if (control_writable(path)) {
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_size = 0;
+  } else {
+    st->st_mode = S_IFREG | 0444;
+    st->st_nlink = 1;
+    st->st_size = 0;
+  }
+}
+
+const char *control_name(int index)
+{
+  return (index < COUNT) ? FILES[index].name : NULL;
+}
+
+control_buf_t *control_open(const char *path)
+{
+  control_file_t *f = find(path);
+  if (f == NULL) {
+    return NULL;
+  }
+  control_buf_t *b = (control_buf_t *) mc_malloc(sizeof(control_buf_t));
+  b->size = 4096;
+  b->len = 0;
+  b->text = (char *)mc_malloc(b->size);
+  b->text[0] = '\0';
+  f->fill(b);
+  return b;
+}
+
+int control_read(control_buf_t * b, char *buf, size_t size, off_t offset)
+{
+  if (offset >= b->len) {
+    return 0;
+  }
+  if (offset + size > b->len) {
+    size = b->len - offset;
+  }
+  memcpy(buf, b->text + offset, size);
+  return size;
+}
+
+int control_writable(const char *path)
+{
+  control_file_t *f = find(path);
+  return f != NULL && f->command != NULL;
+}
+
+// Runs the commands in buf, one per line. Blank lines and lines
+// starting with # are skipped. Stops at the first command that fails.
+int control_write(const char *path, control_buf_t * b, const char *buf, size_t size)
+{
+  control_file_t *f = find(path);
+  if (f == NULL || f->command == NULL) {
+    return -EACCES;
+  }
+  char line[CONTROL_MAX_LINE];
+  size_t i = 0;
+  b->len = 0;
+  b->text[0] = '\0';
+  while (i < size) {
+    size_t j = i;
+    while (j < size && buf[j] != '\n') {
+      j++;
+    }
+    size_t l = j - i;
+    if (l >= sizeof(line)) {
+      return -EINVAL;
+    }
+    memcpy(line, buf + i, l);
+    while (l > 0 && (line[l - 1] == '\r' || line[l - 1] == ' ' || line[l - 1] == '\t')) {
+      l--;
+    }
+    line[l] = '\0';
+    if (l > 0 && line[0] != '#') {
+      log_info2("control: %s", line);
+      int r = f->command(line, b);
+      if (r < 0) {
+        return r;
+      }
+    }
+    i = j + 1;
+  }
+  return size;
+}
+
+void control_release(control_buf_t * b)
+{
+  if (b != NULL) {
+    mc_free(b->text);
+    mc_free(b);
+  }
+}
+
+void control_printf(control_buf_t * b, const char *fmt, ...)
+{
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    int n = vsnprintf(b->text + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      return;
+    } else if (b->len + n < b->size) {
+      b->len += n;
+      return;
+    }
+    b->size = (b->len + n + 1) * 2;
+    b->text = (char *)mc_realloc(b->text, b->size);
+  }
+}
@@ -0,0 +1,72 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __CONTROL__HOD
+#define __CONTROL__HOD
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Files in /.mp3cuefuse, a directory that isn't listed in the root of
+ * the mount. The contents of a file are made by its fill function when
+ * it is opened, and the handle reads from that snapshot, so a reader
+ * sees one consistent state. The files report size 0 and must be
+ * opened with direct_io.
+ *
+ * A file registered with a command function can be written as well.
+ * Every line written is a command; what the commands reply replaces
+ * the contents of the handle, so a reader of the same handle sees it.
+ */
+
+#define CONTROL_DIR "/.mp3cuefuse"
+
+#define CONTROL_NONE  0
+#define CONTROL_ROOT  1   // CONTROL_DIR itself
+#define CONTROL_FILE  2
+
+typedef struct {
+  char *text;
+  int len;
+  int size;
+} control_buf_t;
+
+typedef void (*control_fill_fn)(control_buf_t * b);
+
+// Returns 0 or a negative errno, which the write fails with
+typedef int (*control_command_fn)(const char *line, control_buf_t * reply);
+
+void control_register(const char *name, control_fill_fn fill);
+void control_register_command(const char *name, control_fill_fn fill, control_command_fn command);
+void control_destroy(void);
+
+int control_kind(const char *path);
+void control_stat(const char *path, struct stat *st);
+const char *control_name(int index);    // NULL after the last one
+
+control_buf_t *control_open(const char *path);
+int control_read(control_buf_t * b, char *buf, size_t size, off_t offset);
+int control_writable(const char *path);
+int control_write(const char *path, control_buf_t * b, const char *buf, size_t size);
+void control_release(control_buf_t * b);
+
+void control_printf(control_buf_t * b, const char *fmt, ...)
+    __attribute__ ((format(printf, 2, 3)));
+
+#endif
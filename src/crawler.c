@@ -0,0 +1,261 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "crawler.h"
+#include "dircache.h"
+#include "scheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+#define MAX_THREADS 16
+
+typedef struct dir_item_s {
+  char *path;       // in the mount, "" is the root
+  struct dir_item_s *next;
+} dir_item_t;
+
+static pthread_mutex_t CRAWL_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t CRAWL_COND = PTHREAD_COND_INITIALIZER;
+static dir_item_t *QUEUE = NULL;
+static int ACTIVE = 0;
+static volatile int STOP = 0;
+
+static int THREADS = 2;
+static int STARTED = 0;
+static pthread_t TIDS[MAX_THREADS];
+
+static char *BASE = NULL;
+static crawler_cue_fn ON_CUE = NULL;
+static void *ON_CUE_DATA = NULL;
+
+static crawler_progress_t PROGRESS;
+static double T0 = 0.0;
+
+/**********************************************************************/
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *join(const char *a, const char *b)
+{
+  char *p = (char *)mc_malloc(strlen(a) + 1 + strlen(b) + 1);
+  sprintf(p, "%s/%s", a, b);
+  return p;
+}
+
+// Must be called with CRAWL_MUTEX held
+static void push(char *path)
+{
+  dir_item_t *it = (dir_item_t *) mc_malloc(sizeof(dir_item_t));
+  it->path = path;
+  it->next = QUEUE;
+  QUEUE = it;
+  pthread_cond_signal(&CRAWL_COND);
+}
+
+static void report(const char *what)
+{
+  crawler_progress_t p;
+  crawler_progress(&p);
+  log_info5("crawler: %lu dirs, %lu cue sheets, %lu tracks, %lu sized",
+            p.dirs, p.cues, p.tracks, p.sized);
+  log_info4("crawler: %s, %lu failed, %.1fs", what, p.failed, p.elapsed_s);
+}
+
+static void crawl_dir(const char *path)
+{
+  char *full = (char *)mc_malloc(strlen(BASE) + strlen(path) + 1);
+  sprintf(full, "%s%s", BASE, path);
+  dircache_listing_t *l = dircache_get(full, full, dircache_read_dir, NULL);
+
+  if (l != NULL) {
+    int i, N;
+    for (i = 0, N = dircache_count(l); i < N && !STOP; i++) {
+      dircache_entry_t *e = dircache_entry(l, i);
+      if (e->kind == DIRCACHE_DIR) {
+        char *sub = join(path, e->name);
+        pthread_mutex_lock(&CRAWL_MUTEX);
+        push(sub);
+        pthread_mutex_unlock(&CRAWL_MUTEX);
+      } else if (e->kind == DIRCACHE_CUE) {
+        crawler_yield();
+        char *dir = join(path, e->name);
+        char *cuefile = join(full, e->actual);
+        crawler_progress_t counts;
+        memset(&counts, 0, sizeof(counts));
+        ON_CUE(dir, cuefile, &counts, ON_CUE_DATA);
+        mc_free(cuefile);
+        mc_free(dir);
+
+        pthread_mutex_lock(&CRAWL_MUTEX);
+        PROGRESS.cues += 1;
+        PROGRESS.tracks += counts.tracks;
+        PROGRESS.sized += counts.sized;
+        PROGRESS.failed += counts.failed;
+        int n = PROGRESS.cues;
+        pthread_mutex_unlock(&CRAWL_MUTEX);
+        if (n % 500 == 0) {
+          report("running");
+        }
+      }
+    }
+    dircache_release(l);
+  }
+  mc_free(full);
+
+  pthread_mutex_lock(&CRAWL_MUTEX);
+  PROGRESS.dirs += 1;
+  pthread_mutex_unlock(&CRAWL_MUTEX);
+}
+
+static void *crawler_thread(void *arg)
+{
+  pthread_mutex_lock(&CRAWL_MUTEX);
+  for (;;) {
+    while (QUEUE == NULL && ACTIVE > 0 && !STOP) {
+      pthread_cond_wait(&CRAWL_COND, &CRAWL_MUTEX);
+    }
+    if (STOP || QUEUE == NULL) {
+      break;
+    }
+    dir_item_t *it = QUEUE;
+    QUEUE = it->next;
+    ACTIVE += 1;
+    pthread_mutex_unlock(&CRAWL_MUTEX);
+
+    crawler_yield();
+    crawl_dir(it->path);
+    mc_free(it->path);
+    mc_free(it);
+
+    pthread_mutex_lock(&CRAWL_MUTEX);
+    ACTIVE -= 1;
+    if (QUEUE == NULL && ACTIVE == 0) {
+      // all done, wake up the others so they can leave
+      pthread_cond_broadcast(&CRAWL_COND);
+    }
+  }
+  int last = (--PROGRESS.running == 0);
+  if (last) {
+    PROGRESS.elapsed_s = now_s() - T0;
+  }
+  pthread_mutex_unlock(&CRAWL_MUTEX);
+
+  if (last) {
+    report(STOP ? "stopped" : "done");
+  }
+  return NULL;
+}
+
+/**********************************************************************/
+
+void crawler_configure(int threads)
+{
+  THREADS = (threads < 1) ? 1 : (threads > MAX_THREADS) ? MAX_THREADS : threads;
+}
+
+int crawler_start(const char *basedir, crawler_cue_fn on_cue, void *data)
+{
+  BASE = mc_strdup(basedir);
+  ON_CUE = on_cue;
+  ON_CUE_DATA = data;
+  STOP = 0;
+  memset(&PROGRESS, 0, sizeof(PROGRESS));
+  T0 = now_s();
+
+  pthread_mutex_lock(&CRAWL_MUTEX);
+  push(mc_strdup(""));
+  // Counts as active until the threads are up, so none leaves early
+  ACTIVE = 1;
+  int i;
+  for (i = 0; i < THREADS; i++) {
+    if (pthread_create(&TIDS[i], NULL, crawler_thread, NULL) != 0) {
+      log_error2("crawler: cannot start thread %d", i);
+      break;
+    }
+  }
+  STARTED = i;
+  PROGRESS.running = i;
+  ACTIVE = 0;
+  pthread_cond_broadcast(&CRAWL_COND);
+  pthread_mutex_unlock(&CRAWL_MUTEX);
+
+  log_info3("crawler: walking %s with %d threads", BASE, STARTED);
+  return STARTED;
+}
+
+void crawler_stop(void)
+{
+  if (STARTED == 0) {
+    return;
+  }
+  pthread_mutex_lock(&CRAWL_MUTEX);
+  STOP = 1;
+  pthread_cond_broadcast(&CRAWL_COND);
+  pthread_mutex_unlock(&CRAWL_MUTEX);
+
+  int i;
+  for (i = 0; i < STARTED; i++) {
+    pthread_join(TIDS[i], NULL);
+  }
+  STARTED = 0;
+
+  while (QUEUE != NULL) {
+    dir_item_t *it = QUEUE;
+    QUEUE = it->next;
+    mc_free(it->path);
+    mc_free(it);
+  }
+  mc_free(BASE);
+  BASE = NULL;
+}
+
+int crawler_stopping(void *unused)
+{
+  return STOP;
+}
+
+// Foreground split requests go first
+void crawler_yield(void)
+{
+  while (!STOP && sched_foreground_waiting(SCHED_CRAWL)) {
+    usleep(20 * 1000);
+  }
+}
+
+void crawler_progress(crawler_progress_t * p)
+{
+  pthread_mutex_lock(&CRAWL_MUTEX);
+  memcpy(p, &PROGRESS, sizeof(crawler_progress_t));
+  if (p->running > 0) {
+    p->elapsed_s = now_s() - T0;
+  }
+  pthread_mutex_unlock(&CRAWL_MUTEX);
+}
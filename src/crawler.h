@@ -0,0 +1,55 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __CRAWLER__HOD
+#define __CRAWLER__HOD
+
+/*
+ * Background walk of the library at mount time. A small pool of
+ * threads lists every directory (through the directory cache, so the
+ * listings stay warm) and hands each cue sheet to a callback, which
+ * loads it and may compute the track sizes. The crawler gives way to
+ * foreground split requests and stops early on crawler_stop().
+ */
+
+typedef struct {
+  unsigned long dirs;
+  unsigned long cues;
+  unsigned long tracks;
+  unsigned long sized;
+  unsigned long failed;
+  int running;
+  double elapsed_s;
+} crawler_progress_t;
+
+// dir is the path of the cue directory in the mount. The callback adds
+// what it did to counts.
+typedef void (*crawler_cue_fn)(const char *dir, const char *cuefile,
+                               crawler_progress_t * counts, void *data);
+
+void crawler_configure(int threads);
+int crawler_start(const char *basedir, crawler_cue_fn on_cue, void *data);
+void crawler_stop(void);
+
+int crawler_stopping(void *unused);
+// Waits while foreground requests wait for the scheduler
+void crawler_yield(void);
+void crawler_progress(crawler_progress_t * p);
+
+#endif
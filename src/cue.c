@@ -24,156 +24,295 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <elementals.h>
+#define ALLOC_TAG ALLOC_CUE
+#include "allocprof.h"
 
-#define T(a)  (a==NULL) ? "" : a
+/**************************************************************/
+/* Tokenizer                                                  */
+/**************************************************************/
 
-#define mystrdup(s) (s == NULL) ? NULL : mc_strdup(s)
+// The cue sheet is read into one buffer, lines and fields are cut
+// out of it in place. Only values that end up in the cue are copied.
+
+enum {
+  KW_UNKNOWN = 0,
+  KW_PERFORMER,
+  KW_TITLE,
+  KW_FILE,
+  KW_TRACK,
+  KW_INDEX,
+  KW_REM,
+  KW_DATE,
+  KW_YEAR,
+  KW_IMAGE,
+  KW_COMPOSER,
+  KW_GENRE,
+  KW_PIECE
+};
+
+typedef struct {
+  const char *word;
+  int len;
+  int kw;
+} keyword_t;
+
+static const keyword_t KEYWORDS[] = {
+  { "PERFORMER", 9, KW_PERFORMER },
+  { "TITLE", 5, KW_TITLE },
+  { "FILE", 4, KW_FILE },
+  { "TRACK", 5, KW_TRACK },
+  { "INDEX", 5, KW_INDEX },
+  { "REM", 3, KW_REM },
+  { "DATE", 4, KW_DATE },
+  { "YEAR", 4, KW_YEAR },
+  { "IMAGE", 5, KW_IMAGE },
+  { "COMPOSER", 8, KW_COMPOSER },
+  { "GENRE", 5, KW_GENRE },
+  { "PIECE", 5, KW_PIECE },
+  { NULL, 0, KW_UNKNOWN }
+};
+
+static char* skip_space(char* p)
+{
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  return p;
+}
 
-static char* readline(FILE* f)
+// Cuts the keyword at *p, returns its code and moves *p past it and
+// the whitespace that follows.
+static int keyword(char** p)
 {
-  char* line = mystrdup("");
-  char buf[10240];
-  int readsome = 0;
-
-  while (fgets(buf, 10240, f) != NULL) {
-    readsome = 1;
-    {
-      int i, ret = 0;
-      for (i = 0; buf[i] != '\0' && buf[i] != '\n'; i++) ;
-      if (buf[i] == '\n') {
-        buf[i] = '\0';
-        ret = 1;
-      }
-      line = (char* )mc_realloc(line, strlen(line) + 1 + i + 1);
-      strcat(line, buf);
-      if (ret) {
-        return line;
-      }
-    }
+  char* w = *p;
+  char* e = w;
+  while (*e != '\0' && !isspace((unsigned char)*e)) {
+    e++;
   }
+  int l = e - w;
+  *p = skip_space(e);
 
-  if (readsome) {
-    return line;
-  } else {
-    mc_free(line);
-    return NULL;
+  const keyword_t* k;
+  for (k = KEYWORDS; k->word != NULL; k++) {
+    if (k->len == l && strncasecmp(w, k->word, l) == 0) {
+      return k->kw;
+    }
   }
+  return KW_UNKNOWN;
 }
 
-static char* mytrim(const char* line)
+// Strips surrounding quotes and whitespace in place.
+static char* value(char* p)
 {
-  return hre_trim_copy(line);
-  /*
-  int i, j;
-  for (i = 0; line[i] != '\0' && isspace(line[i]); i++) ;
-  char* k = mystrdup(&line[i]);
-  for (j = strlen(k) - 1; j >= 0 && isspace(k[j]); j--) ;
-  if (j >= 0) {
-    k[j + 1] = '\0';
+  p = skip_space(p);
+  int l = strlen(p);
+  if (p[0] == '"') {
+    p += 1;
+    l -= 1;
+    if (l > 0 && p[l - 1] == '"') {
+      l -= 1;
+    }
+    p[l] = '\0';
+    p = skip_space(p);
+    l = strlen(p);
+  }
+  while (l > 0 && isspace((unsigned char)p[l - 1])) {
+    l -= 1;
   }
-  return k;*/
+  p[l] = '\0';
+  return p;
 }
 
-#define trim(a) (char* ) mc_take_over(mytrim(a))
-
-static void mytrim_replace(char** line)
+// FILE "name" TYPE or FILE name TYPE
+static char* file_value(char* p)
 {
-  char* rl = trim(*line);
-  mc_free(*line);
-  *line = rl;
+  p = skip_space(p);
+  if (p[0] == '"') {
+    char* q = strrchr(p + 1, '"');
+    if (q != NULL) {
+      *q = '\0';
+    }
+    return p + 1;
+  } else {
+    int l = strlen(p);
+    while (l > 0 && isspace((unsigned char)p[l - 1])) {
+      l -= 1;
+    }
+    int e = l;
+    while (e > 0 && !isspace((unsigned char)p[e - 1])) {
+      e -= 1;
+    }
+    if (e > 0) {
+      l = e;
+      while (l > 0 && isspace((unsigned char)p[l - 1])) {
+        l -= 1;
+      }
+    }
+    p[l] = '\0';
+    return p;
+  }
 }
 
-#ifdef MEMCHECK
-#define trim_replace(q) mytrim_replace(q),mc_take_over(*q)
-#else
-#define trim_replace(q) mytrim_replace(q)
-#endif
-
-static int eq(const char* s, const char* e)
+// Next line of the buffer, trimmed, NUL terminated in place. NULL at
+// the end.
+static char* next_line(char** pos)
 {
-  char* r = trim(s);
-  
-  int lr = strlen(r);
-  int le = strlen(e);
-  
-  if (lr < le) {
-    mc_free(r);
-    return 0;
+  char* p = *pos;
+  if (*p == '\0') {
+    return NULL;
   }
-  
-  //log_debug6("%-15s %s, %d, %d %d", r, e, lr, le, strncasecmp(r, e, le));
-  //log_debug3("%d, %d", r[0], e[0]);
-  
-  if (strncasecmp(r, e, le) == 0) {
-    mc_free(r);
-    return 1;
-  } else {
-    mc_free(r);
-    return 0;
+  char* e = p;
+  while (*e != '\0' && *e != '\n' && *e != '\r') {
+    e++;
   }
+  char* next = e;
+  while (*next == '\n' || *next == '\r') {
+    next++;
+  }
+  *pos = next;
+
+  while (e > p && isspace((unsigned char)e[-1])) {
+    e--;
+  }
+  *e = '\0';
+  while (*p != '\0' && isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p;
 }
 
-static char* myunquote(const char* s, const char* e)
+static char* read_file(const char* file)
 {
-  char* r = trim(s);
-  char* p = &r[strlen(e)];
-  while (isspace(p[0]) && p[0] != '\0') {
-    p++;
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
   }
-  if (p[0] == '\0') {
-    return mystrdup("");
-  } else {
-    if (p[0] == '"') {
-      p += 1;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  char* buf = (char* ) mc_malloc(size + 1);
+  size_t n = 0;
+  while (n < size) {
+    ssize_t r = read(fd, buf + n, size - n);
+    if (r <= 0) {
+      break;
     }
-    if (p[strlen(p) - 1] == '"') {
-      p[strlen(p) - 1] = '\0';
+    n += r;
+  }
+  close(fd);
+  buf[n] = '\0';
+  return buf;
+}
+
+/**************************************************************/
+/* String pool                                                */
+/**************************************************************/
+
+#define S(c, off) ((c)->pool + (off))
+
+// Room for len more bytes at the end of the pool. Returns the offset
+// of the room; pointers into the pool are invalid afterwards.
+static int pool_reserve(cue_t* c, int len)
+{
+  if (c->pool_used + len > c->pool_size) {
+    int size = c->pool_size;
+    while (c->pool_used + len > size) {
+      size *= 2;
     }
-    char* k = mystrdup(p);
-    trim_replace(&k);
-    mc_free(r);
-    return k;
+    c->pool = (char* ) mc_realloc(c->pool, size);
+    c->pool_size = size;
   }
+  int off = c->pool_used;
+  c->pool_used += len;
+  return off;
 }
 
-#define unquote(s,e)  (char* ) mc_take_over(myunquote(s,e))
+static int pool_add(cue_t* c, const char* s)
+{
+  if (s == NULL || s[0] == '\0') {
+    return 0;
+  }
+  int l = strlen(s) + 1;
+  int off = pool_reserve(c, l);
+  memcpy(S(c, off), s, l);
+  return off;
+}
 
-static char* getFilePart(const char* s)
+static void replace(cue_t* c, int* field, const char* v)
 {
-  int i;
-  for (i = 0; s[i] != '"' && s[i] != '\0'; i++) ;
-  char* fl = mc_strdup(&s[i]);
-  for (i = strlen(fl) - 1; i >= 0 && fl[i] != '"'; i--) ;
-  fl[i + 1] = '\0';
-  return fl;
+  if (strcmp(S(c, *field), v) != 0) {
+    *field = pool_add(c, v);
+  }
 }
 
-static cue_entry_t* cue_entry_new(cue_t* s)
+// Full path of an audio file named in the cue sheet
+static int audio_path(cue_t* c, const char* af)
 {
-  cue_entry_t* r = (cue_entry_t* ) mc_malloc(sizeof(cue_entry_t));
-  if (r == NULL) {
-    return NULL;
+  const char* cuefile = S(c, c->cuefile);
+  const char* slash = strrchr(cuefile, '/');
+  if (af[0] == '\0' || af[0] == '/' || slash == NULL) {
+    return pool_add(c, af);
   }
-  r->title = NULL;
-  r->performer = NULL;
-  r->year = NULL;
-  r->composer = NULL;
-  r->tracknr = -1;
-  r->begin_offset_in_ms = -1;
-  r->end_offset_in_ms = -1;
-  r->sheet = (void* )s;
-  r->vfile = NULL;
-  r->audio_file = NULL;
-  return r;
+  int dl = slash - cuefile;
+  int al = strlen(af);
+  int off = pool_reserve(c, dl + 1 + al + 1);
+  char* aaf = S(c, off);
+  memcpy(aaf, S(c, c->cuefile), dl);
+  aaf[dl] = '/';
+  memcpy(aaf + dl + 1, af, al + 1);
+  return off;
+}
+
+// "NN - title.ext", with slashes made spaces
+static int vfile(cue_t* c, cue_entry_t* ce)
+{
+  const char* af = S(c, c->entries[0].audio_file);
+  const char* dot = strrchr(af, '.');
+  int el = (dot == NULL) ? 0 : strlen(dot + 1);
+  int ext = (dot == NULL) ? 0 : dot + 1 - c->pool;
+  int tl = strlen(S(c, ce->title));
+  char nr[16];
+  int nl = snprintf(nr, sizeof(nr), "%02d - ", ce->tracknr);
+  int n = nl + tl + 1 + el;
+
+  // title and extension are in the pool too, copy them once it has room
+  int off = pool_reserve(c, n + 1);
+  char* name = S(c, off);
+  memcpy(name, nr, nl);
+  memcpy(name + nl, S(c, ce->title), tl);
+  name[nl + tl] = '.';
+  memcpy(name + nl + tl + 1, S(c, ext), el + 1);
+  int i;
+  for (i = 0; i < n; i++) {
+    if (name[i] == '/') {
+      name[i] = ' ';
+    }
+  }
+  return off;
 }
 
-static void addEntry(cue_t* r, cue_entry_t* entry)
+/**************************************************************/
+
+static int addEntry(cue_t* r, int* capacity)
 {
+  if (r->count == *capacity) {
+    *capacity = (*capacity == 0) ? 32 : *capacity * 2;
+    r->entries = (cue_entry_t* ) mc_realloc(r->entries, sizeof(cue_entry_t) * *capacity);
+  }
+  cue_entry_t* e = &r->entries[r->count];
+  memset(e, 0, sizeof(cue_entry_t));
+  e->tracknr = -1;
+  e->begin_offset_in_ms = -1;
+  e->end_offset_in_ms = -1;
+  e->sheet = (void* ) r;
   r->count += 1;
-  r->entries = (cue_entry_t** ) mc_realloc(r->entries, sizeof(cue_entry_t* ) * r->count);
-  r->entries[r->count - 1] = entry;
+  return r->count - 1;
 }
 
 static int calculateOffset(const char* in)
@@ -217,245 +356,160 @@ static int calculateOffset(const char* in)
   }
 }
 
-static char* getExt(const char* filename)
-{
-  int i = strlen(filename) - 1;
-  for (; i >= 0 && filename[i] != '.'; i--) ;
-  if (i < 0) {
-    return mystrdup("");
-  } else {
-    return mystrdup(&filename[i + 1]);
-  }
-}
-
 /**************************************************************/
 
 cue_t* cue_new(const char* file)
 {
   cue_t* r = (cue_t* ) mc_malloc(sizeof(cue_t));
+  memset(r, 0, sizeof(cue_t));
+
+  char* buf = read_file(file);
 
-  r->album_title = NULL;
-  r->album_performer = NULL;
-  r->album_composer = NULL;
-  r->image_file = NULL;
-  r->genre = NULL;
-  r->cuefile = mystrdup(file);
-  r->count = 0;
-  r->entries = NULL;
-  r->_errno = 0;
-
-  FILE*f = fopen(file, "rt");
-  time_t _audio_mtime=0;
-  char* audio_file = NULL;
-
-  if (f == NULL) {
+  // Most of the sheet ends up in the pool, start at its size
+  r->pool_size = (buf == NULL) ? 256 : strlen(buf) + 256;
+  r->pool = (char* ) mc_malloc(r->pool_size);
+  r->pool[0] = '\0';
+  r->pool_used = 1;
+  r->cuefile = pool_add(r, file);
+
+  if (buf == NULL) {
     r->_errno = ENOFILECUE;
   } else {
+    char* pos = buf;
     char* line;
-    //char* image = NULL;
-    char* year = NULL;
-    cue_entry_t* entry = NULL;
-    int in_tracks = 0;
-    
-    while ((line = readline(f)) != NULL) {
-      trim_replace(&line);
-      if (strcmp(line, "") != 0) {
-        if (!in_tracks) {
-          if (eq(line, "performer")) {
-            mc_free(r->album_performer);
-            r->album_performer = unquote(line, "performer");
-          } else if (eq(line, "title")) {
-            mc_free(r->album_title);
-            r->album_title = unquote(line, "title");
-          } else if (eq(line, "file")) {
-            mc_free(audio_file);
-            char* fl = getFilePart(line);
-            char* af = unquote(fl, "");
-            if (strlen(af) > 0) {
-              if (af[0] == '/') {
-                audio_file = af;
-              } else {
-                char* cf = mc_strdup(r->cuefile);
-                int ii;
-                for (ii = strlen(cf) - 1; ii >= 0 && cf[ii] != '/'; ii--) ;
-                if (ii >= 0) {
-                  cf[ii] = '\0';
-                  char* aaf = (char* )mc_malloc(strlen(cf) + strlen(af) + strlen("/") + 1);
-                  sprintf(aaf, "%s/%s", cf, af);
-                  audio_file = aaf;
-                  mc_free(cf);
-                  mc_free(af);
-                } else {
-                  audio_file = af;
-                }
-              }
-            } else {
-              audio_file = af;
-            }
-            // We have a full path audio file now.
-            // get the mtime.
-            {
-              struct stat st;
-              stat(audio_file,&st);
-              _audio_mtime=st.st_mtime;
-            }
-
-            mc_free(fl);
-          } else if (eq(line, "rem")) {
-            if (eq(&line[3], "date")) {
-              mc_free(year);
-              year = unquote(&line[3], "date");
-            } else if (eq(&line[3], "year")) {
-              mc_free(year);
-              year = unquote(&line[3], "year");
-            } else if (eq(&line[3], "image")) {
-              mc_free(r->image_file);
-              r->image_file = unquote(&line[3], "image");
-            } else if (eq(&line[3], "composer")) {
-              mc_free(r->album_composer);
-              r->album_performer = unquote(&line[3], "composer");
-            } else if (eq(&line[3], "genre")) {
-              mc_free(r->genre);
-              r->genre = unquote(&line[3], "genre");
-            }
-          } else if (eq(line, "track")) {
-            in_tracks = 1;
-          } else {
-            log_debug2("Skipping line '%s'", line);
-          }
-        }
+    time_t _audio_mtime = 0;
+    int audio_file = 0;
+    int year = 0;
+    int entry = -1;
+    int capacity = 0;
+
+    // UTF-8 byte order mark
+    if ((unsigned char)pos[0] == 0xef && (unsigned char)pos[1] == 0xbb && (unsigned char)pos[2] == 0xbf) {
+      pos += 3;
+    }
+
+    while ((line = next_line(&pos)) != NULL) {
+      if (line[0] == '\0') {
+        continue;
+      }
+      char* p = line;
+      int kw = keyword(&p);
+      int sub = KW_UNKNOWN;
+      if (kw == KW_REM) {
+        sub = keyword(&p);
+      }
 
-        if (in_tracks) {
-          if (eq(line, "track")) {
-            if (entry != NULL) {
-              addEntry(r, entry);
-            }
-            entry = cue_entry_new(r);
-            entry->audio_mtime=_audio_mtime;
-            entry->audio_file = mystrdup(audio_file);
-            entry->year = mystrdup(year);
-            entry->performer = mystrdup(r->album_performer);
-            entry->composer = mystrdup(r->album_composer);
-            entry->piece = NULL;
-          } else if (eq(line, "title")) {
-            mc_free(entry->title);
-            entry->title = unquote(line, "title");
-          } else if (eq(line, "performer")) {
-            mc_free(entry->performer);
-            entry->performer = unquote(line, "performer");
-          } else if (eq(line, "index")) {
-            char* index = unquote(line, "index");
-            entry->begin_offset_in_ms = calculateOffset(index);
-            mc_free(index);
-          } else if (eq(line, "rem")) {
-            if (eq(&line[3], "composer")) {
-              mc_free(entry->composer);
-              entry->composer = unquote(&line[3], "composer");
-            } else if (eq(&line[3], "piece")) {
-              mc_free(entry->piece);
-              entry->piece = unquote(&line[3], "piece");
-            } else if (eq(&line[3], "year")) {
-              mc_free(year);
-              year = unquote(&line[3], "year");
-              mc_free(entry->year);
-              entry->year = mystrdup(year);
-            } else if (eq(&line[3], "date")) {
-              mc_free(year);
-              year = unquote(&line[3], "date");
-              mc_free(entry->year);
-              entry->year = mystrdup(year);
-            }
-          } else if (eq(line, "file")) {
-            mc_free(audio_file);
-            char* fl = getFilePart(line);
-            char* af = unquote(fl, "");
-            if (strlen(af) > 0) {
-              if (af[0] == '/') {
-                audio_file = af;
-              } else {
-                char* cf = mc_strdup(r->cuefile);
-                int ii;
-                for (ii = strlen(cf) - 1; ii >= 0 && cf[ii] != '/'; ii--) ;
-                if (ii >= 0) {
-                  cf[ii] = '\0';
-                  char* aaf = (char* )mc_malloc(strlen(cf) + strlen(af) + strlen("/") + 1);
-                  sprintf(aaf, "%s/%s", cf, af);
-                  audio_file = aaf;
-                  mc_free(cf);
-                  mc_free(af);
-                } else {
-                  audio_file = af;
-                }
-              }
-            } else {
-              audio_file = af;
-            }
-            // We have a full path audio file now.
-            // get the mtime.
-            {
-              struct stat st;
-              stat(audio_file,&st);
-              _audio_mtime=st.st_mtime;
-            }
-
-            mc_free(fl);
+      if (kw == KW_TRACK) {
+        entry = addEntry(r, &capacity);
+        cue_entry_t* e = &r->entries[entry];
+        e->audio_mtime = _audio_mtime;
+        e->audio_file = audio_file;
+        e->year = year;
+        e->performer = r->album_performer;
+        e->composer = r->album_composer;
+      } else if (kw == KW_FILE) {
+        audio_file = audio_path(r, file_value(p));
+        // We have a full path audio file now.
+        // get the mtime.
+        {
+          struct stat st;
+          if (stat(S(r, audio_file), &st) == 0) {
+            _audio_mtime=st.st_mtime;
           }
         }
+      } else if (entry < 0) {
+        // Album part, before the first track
+        if (kw == KW_PERFORMER) {
+          replace(r, &r->album_performer, value(p));
+        } else if (kw == KW_TITLE) {
+          replace(r, &r->album_title, value(p));
+        } else if (sub == KW_DATE || sub == KW_YEAR) {
+          replace(r, &year, value(p));
+        } else if (sub == KW_IMAGE) {
+          replace(r, &r->image_file, value(p));
+        } else if (sub == KW_COMPOSER) {
+          replace(r, &r->album_composer, value(p));
+        } else if (sub == KW_GENRE) {
+          replace(r, &r->genre, value(p));
+        } else {
+          log_debug2("Skipping line '%s'", line);
+        }
+      } else {
+        cue_entry_t* e = &r->entries[entry];
+        if (kw == KW_TITLE) {
+          replace(r, &e->title, value(p));
+        } else if (kw == KW_PERFORMER) {
+          replace(r, &e->performer, value(p));
+        } else if (kw == KW_INDEX) {
+          e->begin_offset_in_ms = calculateOffset(p);
+        } else if (sub == KW_COMPOSER) {
+          replace(r, &e->composer, value(p));
+        } else if (sub == KW_PIECE) {
+          replace(r, &e->piece, value(p));
+        } else if (sub == KW_DATE || sub == KW_YEAR) {
+          replace(r, &year, value(p));
+          e->year = year;
+        }
       }
-      mc_free(line);
-    }
-    
-    if (entry != NULL) {
-      addEntry(r, entry);
     }
-    
-    mc_free(year);
-    //mc_free(image);
+
+    mc_free(buf);
 
     if (r->count > 0) {
       int i, N;
       for (i = 0, N = r->count-1; i < N; i++) {
-        if (strcmp(r->entries[i+1]->audio_file, r->entries[i]->audio_file) == 0) {
-          r->entries[i]->end_offset_in_ms = r->entries[i + 1]->begin_offset_in_ms;
+        cue_entry_t* e = &r->entries[i];
+        if (e[1].audio_file == e->audio_file ||
+            strcmp(S(r, e[1].audio_file), S(r, e->audio_file)) == 0) {
+          e->end_offset_in_ms = e[1].begin_offset_in_ms;
         }
-        r->entries[i]->tracknr = i + 1;
+        e->tracknr = i + 1;
+      }
+      r->entries[i].tracknr = i + 1;
+
+      // Names are made now, so a parsed sheet can be shared read only
+      for (i = 0, N = r->count; i < N; i++) {
+        cue_entry_t* e = &r->entries[i];
+        e->vfile = vfile(r, e);
+        char* id = cue_entry_alloc_id(e);
+        e->id = intern(id);
+        *strrchr(id, '#') = '\0';
+        e->source = intern(id);
+        mc_free(id);
+      }
+
+      // Nothing gets added from here on
+      if (capacity > r->count) {
+        r->entries = (cue_entry_t* ) mc_realloc(r->entries, sizeof(cue_entry_t) * r->count);
       }
-      r->entries[i]->tracknr = i + 1;
     }
-    
-    fclose(f);
-    
   }
-  
-  mc_free(audio_file);
-  
+
+  if (r->pool_size > r->pool_used) {
+    r->pool = (char* ) mc_realloc(r->pool, r->pool_used);
+    r->pool_size = r->pool_used;
+  }
+
   return r;
 }
 
-static void cue_destroy1(cue_t* c)
+void cue_destroy(cue_t* c)
 {
-  mc_free(c->album_title);
-  mc_free(c->album_performer);
-  mc_free(c->album_composer);
-  mc_free(c->genre);
-  mc_free(c->cuefile);
+  int i;
+  for (i = 0; i < c->count; i++) {
+    intern_release(c->entries[i].id);
+    intern_release(c->entries[i].source);
+  }
   mc_free(c->entries);
-  mc_free(c->image_file);
+  mc_free(c->pool);
   mc_free(c);
 }
 
-void cue_destroy(cue_t* c)
+size_t cue_bytes(cue_t* c)
 {
-  int i, N;
-  for (i = 0, N = c->count; i < N; i++) {
-    cue_entry_destroy(c->entries[0]);
-  }
-  if (N == 0) {
-    cue_destroy1(c);
-  }
+  return sizeof(cue_t) + sizeof(cue_entry_t) * c->count + c->pool_size;
 }
 
-
 int cue_valid(cue_t* c)
 {
   return c->_errno == 0;
@@ -468,32 +522,32 @@ int cue__errno(cue_t* c)
 
 const char* cue_file(cue_t* cue)
 {
-  return T(cue->cuefile);
+  return S(cue, cue->cuefile);
 }
 
 const char* cue_album_title(cue_t* cue)
 {
-  return T(cue->album_title);
+  return S(cue, cue->album_title);
 }
 
 const char* cue_image_file(cue_t* cue)
 {
-  return T(cue->image_file);
+  return S(cue, cue->image_file);
 }
 
 const char* cue_album_performer(cue_t* cue)
 {
-  return T(cue->album_performer);
+  return S(cue, cue->album_performer);
 }
 
 const char* cue_album_composer(cue_t* cue)
 {
-  return T(cue->album_composer);
+  return S(cue, cue->album_composer);
 }
 
 const char* cue_genre(cue_t* cue)
 {
-  return T(cue->genre);
+  return S(cue, cue->genre);
 }
 
 const char* cue_audio_file(cue_t* cue)
@@ -501,7 +555,7 @@ const char* cue_audio_file(cue_t* cue)
   if (cue->count > 0) {
     return cue_entry_audio_file(cue_entry(cue, 0));
   } else {
-    return T(NULL);
+    return "";
   }
 }
 
@@ -522,38 +576,40 @@ cue_entry_t* cue_entry(cue_t* cue, int index)
   } else if (index >= cue->count) {
     return NULL;
   } else {
-    return cue->entries[index];
+    return &cue->entries[index];
   }
 }
 
+#define E(ce, field) S((cue_t* ) (ce)->sheet, (ce)->field)
+
 const char* cue_entry_title(cue_entry_t* ce)
 {
-  return T(ce->title);
+  return E(ce, title);
 }
 
 const char* cue_entry_performer(cue_entry_t* ce)
 {
-  return T(ce->performer);
+  return E(ce, performer);
 }
 
 const char* cue_entry_composer(cue_entry_t* ce)
 {
-  return T(ce->composer);
+  return E(ce, composer);
 }
 
 const char* cue_entry_audio_file(cue_entry_t* ce)
 {
-  return T(ce->audio_file);
+  return E(ce, audio_file);
 }
 
 const char* cue_entry_piece(cue_entry_t* ce)
 {
-  return T(ce->piece);
+  return E(ce, piece);
 }
 
 const char* cue_entry_year(cue_entry_t* ce)
 {
-  return T(ce->year);
+  return E(ce, year);
 }
 
 int cue_entry_tracknr(cue_entry_t* ce)
@@ -578,56 +634,85 @@ cue_t* cue_entry_sheet(cue_entry_t* ce)
 
 const char* cue_entry_vfile(cue_entry_t* ce)
 {
-  if (ce->vfile == NULL) {
-    cue_t* c = (cue_t* ) ce->sheet;
-    char* ext = getExt(cue_audio_file(c));
-    char* name = (char* )mc_malloc(10 + strlen(cue_entry_title(ce)) + strlen(ext)+1);
-    sprintf(name, "%02d - %s.%s", ce->tracknr, ce->title, ext);
-    int i,N;
-    for(i=0,N=strlen(name);i<N;i++) {
-      if (name[i]=='/') { name[i]=' '; }
-    }
+  return E(ce, vfile);
+}
 
-    mc_free(ext);
-    ce->vfile = name;
+// Hash of everything that ends up in the tags of the track, see
+// cue_entry_same_tags()
+static unsigned long long tags_hash(cue_entry_t* ce)
+{
+  cue_t* c = cue_entry_sheet(ce);
+  const char* fields[] = {
+    E(ce, title), E(ce, performer), E(ce, composer), E(ce, year), E(ce, piece),
+    cue_album_title(c), cue_album_performer(c), cue_genre(c)
+  };
+  int i, N = sizeof(fields) / sizeof(fields[0]);
+  int l = 12;
+  for (i = 0; i < N; i++) {
+    l += strlen(fields[i]) + 1;
   }
-  return ce->vfile;
+  char* s = (char* )mc_malloc(l);
+  int k = snprintf(s, l, "%d", ce->tracknr);
+  for (i = 0; i < N; i++) {
+    int fl = strlen(fields[i]);
+    s[k++] = '\x1f';
+    memcpy(&s[k], fields[i], fl);
+    k += fl;
+  }
+  unsigned long long h = intern_hash(s, k);
+  mc_free(s);
+  return h;
 }
 
+// The id names the segment of a track: the audio it is cut from and its
+// tags. Tracks with the same audio and tags, in any cue sheet, share a
+// segment; a segment never changes tags under its readers.
 char* cue_entry_alloc_id(cue_entry_t* ce)
 {
-  int l = strlen(cue_entry_vfile(ce)) + strlen(cue_entry_audio_file(ce)) + 1;
+  int l = strlen(cue_entry_audio_file(ce)) + 2 * 12 + 20;
   char* s = (char* )mc_malloc(l);
-  strcpy(s, cue_entry_vfile(ce));
-  strcat(s, cue_entry_audio_file(ce));;
+  snprintf(s, l, "%s@%d-%d#%016llx", cue_entry_audio_file(ce),
+           ce->begin_offset_in_ms, ce->end_offset_in_ms, tags_hash(ce));
   return s;
 }
 
-void cue_entry_destroy(cue_entry_t* ce)
+const intern_t* cue_entry_id(cue_entry_t* ce)
 {
-  cue_t* c = cue_entry_sheet(ce);
-  int i, N;
-  for (i = 0, N = cue_entries(c); i < N && cue_entry(c, i) != ce; i++) ;
-  log_assert(i != N);
-
-  cue_entry_t* e = ce;
-  mc_free(e->audio_file);
-  mc_free(e->title);
-  mc_free(e->performer);
-  mc_free(e->year);
-  mc_free(e->composer);
-  mc_free(e->piece);
-  mc_free(e->vfile);
-  mc_free(e);
-
-  for (; i < N - 1; i++) {
-    c->entries[i] = c->entries[i + 1];
-  }
-  c->count = N - 1;
+  return ce->id;
+}
+
+// The id without the tags, the audio a track is cut from
+const intern_t* cue_entry_source(cue_entry_t* ce)
+{
+  return ce->source;
+}
 
-  if (c->count <= 0) {
-    cue_destroy1(c);
+int cue_entry_same_source(cue_entry_t* a, cue_entry_t* b)
+{
+  if (a->source != NULL && b->source != NULL) {
+    return a->source == b->source;
   }
+  return a->begin_offset_in_ms == b->begin_offset_in_ms &&
+         a->end_offset_in_ms == b->end_offset_in_ms &&
+         strcmp(E(a, audio_file), E(b, audio_file)) == 0;
+}
+
+#define SAME(a, b, field) (strcmp(E(a, field), E(b, field)) == 0)
+
+// Everything that ends up in the tags of the track
+int cue_entry_same_tags(cue_entry_t* a, cue_entry_t* b)
+{
+  cue_t* ca = cue_entry_sheet(a);
+  cue_t* cb = cue_entry_sheet(b);
+  return a->tracknr == b->tracknr &&
+         SAME(a, b, title) &&
+         SAME(a, b, performer) &&
+         SAME(a, b, composer) &&
+         SAME(a, b, year) &&
+         SAME(a, b, piece) &&
+         strcmp(cue_album_title(ca), cue_album_title(cb)) == 0 &&
+         strcmp(cue_album_performer(ca), cue_album_performer(cb)) == 0 &&
+         strcmp(cue_genre(ca), cue_genre(cb)) == 0;
 }
 
 int cue_entry_audio_changed(cue_entry_t* ce) {
@@ -648,4 +733,3 @@ void cue_entry_audio_update_mtime(cue_entry_t* ce) {
   stat(af,&st);
   ce->audio_mtime=st.st_mtime;
 }
-
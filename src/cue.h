@@ -26,32 +26,47 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include "intern.h"
+
+/*
+ * A parsed sheet is one arena: the entries sit in a single array and
+ * all strings live in one pool owned by the sheet. Entries hold offsets
+ * into the pool; album level values are shared by offset, not copied.
+ * Offset 0 is the empty string. Entry pointers stay valid as long as
+ * the sheet lives.
+ */
 
 typedef struct {
-  char *title;
-  char *performer;
-  char *year;
-  char *composer;
-  char *piece;
-  char *audio_file;
+  int title;
+  int performer;
+  int year;
+  int composer;
+  int piece;
+  int audio_file;
+  int vfile;
   int tracknr;
   int begin_offset_in_ms;
   int end_offset_in_ms;
   void *sheet;
-  char *vfile;
+  const intern_t *id;   // interned cue_entry_alloc_id()
+  const intern_t *source;  // the id without the tags
   time_t audio_mtime;
 } cue_entry_t;
 
 typedef struct {
   int _errno;
-  char *album_title;
-  char *album_performer;
-  char *album_composer;
-  char *genre;
-  char *image_file;
-  char *cuefile;
+  int refs;     // users of a shared sheet, see cuecache.h
+  int album_title;
+  int album_performer;
+  int album_composer;
+  int genre;
+  int image_file;
+  int cuefile;
   int count;
-  cue_entry_t **entries;
+  cue_entry_t *entries;
+  char *pool;
+  int pool_used;
+  int pool_size;
 } cue_t;
 
 #define ENOCUE    -1
@@ -64,6 +79,7 @@ void cue_destroy(cue_t *);
 int cue_valid(cue_t *);
 int cue_errno(cue_t *);
 int cue_count(cue_t *);
+size_t cue_bytes(cue_t *);
 
 const char *cue_file(cue_t * cue);
 const char *cue_album_title(cue_t * cue);
@@ -76,9 +92,6 @@ const char *cue_image_file(cue_t* cue);
 int cue_entries(cue_t * cue);
 cue_entry_t *cue_entry(cue_t * cue, int index);
 
-void cue_entry_destroy(cue_entry_t * ce); // destroys entry and removes it from cue
-               // if it is the last one, destroys cue
-
 const char *cue_entry_title(cue_entry_t * ce);
 const char *cue_entry_performer(cue_entry_t * ce);
 const char *cue_entry_composer(cue_entry_t * ce);
@@ -89,8 +102,12 @@ int cue_entry_tracknr(cue_entry_t * ce);
 int cue_entry_begin_offset_in_ms(cue_entry_t * ce);
 int cue_entry_end_offset_in_ms(cue_entry_t * ce);
 cue_t *cue_entry_sheet(cue_entry_t * ce);
-const char *cue_entry_vfile(cue_entry_t * ce);
-char *cue_entry_alloc_id(cue_entry_t * ce);
+const char *cue_entry_vfile(cue_entry_t * ce);   // computed by cue_new()
+char *cue_entry_alloc_id(cue_entry_t * ce);    // audio file, offsets and tags
+const intern_t *cue_entry_id(cue_entry_t * ce);
+const intern_t *cue_entry_source(cue_entry_t * ce);
+int cue_entry_same_source(cue_entry_t * a, cue_entry_t * b);
+int cue_entry_same_tags(cue_entry_t * a, cue_entry_t * b);
 
 int cue_entry_audio_changed(cue_entry_t * ce);
 void cue_entry_audio_update_mtime(cue_entry_t * ce);
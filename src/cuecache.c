@@ -0,0 +1,251 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "cuecache.h"
+#include "latency.h"
+#include "watcher.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <elementals/hash.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#define ALLOC_TAG ALLOC_CUE
+#include "allocprof.h"
+
+/**********************************************************************/
+
+typedef struct {
+  cue_t *cue;
+  struct stat st;
+  int stat_ok;
+  unsigned long stamp;
+  int parsing;          // cue is being replaced, wait on CUE_COND
+} cached_cue_t;
+
+static hash_data_t cached_cue_copy(cached_cue_t * e)
+{
+  cached_cue_t *n = (cached_cue_t *) mc_malloc(sizeof(cached_cue_t));
+  memcpy(n, e, sizeof(cached_cue_t));
+  return (hash_data_t) n;
+}
+
+static void cached_cue_destroy(hash_data_t d)
+{
+  mc_free(d);
+}
+
+DECLARE_HASH(cuehash, cached_cue_t);
+IMPLEMENT_HASH(cuehash, cached_cue_t, cached_cue_copy, cached_cue_destroy);
+
+static cuehash *CUES = NULL;
+static pthread_mutex_t CUE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t CUE_COND = PTHREAD_COND_INITIALIZER;
+static int COUNT = 0;
+static unsigned long HITS = 0;
+static unsigned long PARSES = 0;
+
+/**********************************************************************/
+
+static int same_file(struct stat *a, struct stat *b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_mtime == b->st_mtime && a->st_size == b->st_size;
+}
+
+// Must be called with CUE_MUTEX held
+static void release_locked(cue_t * cue)
+{
+  cue->refs -= 1;
+  if (cue->refs == 0) {
+    log_debug2("cuecache: destroying %s", cue_file(cue));
+    cue_destroy(cue);
+  }
+}
+
+/**********************************************************************/
+
+void cuecache_init(void)
+{
+  CUES = cuehash_new(100, HASH_CASE_SENSITIVE);
+}
+
+void cuecache_destroy(void)
+{
+  pthread_mutex_lock(&CUE_MUTEX);
+  hash_iter_t it = cuehash_iter(CUES);
+  while (!cuehash_iter_end(it)) {
+    cached_cue_t *e = cuehash_get(CUES, cuehash_iter_key(it));
+    if (e->cue != NULL) {
+      release_locked(e->cue);
+      e->cue = NULL;
+    }
+    it = cuehash_iter_next(it);
+  }
+  cuehash_destroy(CUES);
+  CUES = NULL;
+  COUNT = 0;
+  pthread_mutex_unlock(&CUE_MUTEX);
+}
+
+// Returns the parsed cue sheet, referenced, and when st != NULL, the
+// stat() of the cue file as recorded when it was parsed. stat() and the
+// parse run without CUE_MUTEX; who asks for a sheet that is being parsed
+// waits for it.
+cue_t *cuecache_get(const char *cuefile, struct stat *st, unsigned long *stamp_out)
+{
+  unsigned long stamp = watcher_stamp(cuefile);
+  struct stat now;
+  int now_ok = -1;      // not stat()ed yet
+
+  pthread_mutex_lock(&CUE_MUTEX);
+  cached_cue_t *e;
+  int valid = 0;
+  for (;;) {
+    e = cuehash_get(CUES, cuefile);
+    if (e != NULL && e->parsing) {
+      pthread_cond_wait(&CUE_COND, &CUE_MUTEX);
+    } else if (e == NULL || e->cue == NULL) {
+      break;
+    } else if (stamp != 0 && stamp == e->stamp) {
+      valid = 1;
+      break;
+    } else if (now_ok < 0) {
+      // the sheet may have changed meanwhile, so look again after
+      pthread_mutex_unlock(&CUE_MUTEX);
+      now_ok = (stat(cuefile, &now) == 0);
+      pthread_mutex_lock(&CUE_MUTEX);
+    } else {
+      valid = now_ok && e->stat_ok && same_file(&now, &e->st);
+      if (valid) {
+        e->stamp = stamp;
+      }
+      break;
+    }
+  }
+
+  if (valid) {
+    HITS += 1;
+  } else {
+    if (e == NULL) {
+      cached_cue_t n;
+      memset(&n, 0, sizeof(n));
+      cuehash_put(CUES, cuefile, &n);
+      e = cuehash_get(CUES, cuefile);
+      COUNT += 1;
+    }
+    e->parsing = 1;
+    pthread_mutex_unlock(&CUE_MUTEX);
+
+    // stat before parsing, a change while parsing gets noticed next time
+    struct stat pst;
+    int pst_ok = (stat(cuefile, &pst) == 0);
+    unsigned long long t0 = latency_start();
+    cue_t *cue = cue_new(cuefile);
+    latency_phase(LAT_CUE_PARSE, t0);
+    log_debug3("cuecache: parsed %s, %d tracks", cuefile, cue_count(cue));
+
+    pthread_mutex_lock(&CUE_MUTEX);
+    if (e->cue != NULL) {
+      // users of the old sheet keep it alive
+      release_locked(e->cue);
+    }
+    e->cue = cue;
+    e->cue->refs = 1;
+    e->st = pst;
+    e->stat_ok = pst_ok;
+    e->stamp = stamp;
+    e->parsing = 0;
+    PARSES += 1;
+    pthread_cond_broadcast(&CUE_COND);
+  }
+
+  cue_t *cue = e->cue;
+  cue->refs += 1;
+  if (stamp_out != NULL) {
+    *stamp_out = e->stamp;
+  }
+  if (st != NULL) {
+    if (e->stat_ok) {
+      memcpy(st, &e->st, sizeof(struct stat));
+    } else {
+      memset(st, 0, sizeof(struct stat));
+    }
+  }
+  pthread_mutex_unlock(&CUE_MUTEX);
+
+  return cue;
+}
+
+cue_t *cuecache_ref(cue_t * cue)
+{
+  pthread_mutex_lock(&CUE_MUTEX);
+  cue->refs += 1;
+  pthread_mutex_unlock(&CUE_MUTEX);
+  return cue;
+}
+
+void cuecache_release(cue_t * cue)
+{
+  if (cue == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&CUE_MUTEX);
+  release_locked(cue);
+  pthread_mutex_unlock(&CUE_MUTEX);
+}
+
+// Drops the sheets only the cache holds; they are parsed again when
+// they are asked for. Returns how many went.
+int cuecache_trim(void)
+{
+  int n = 0;
+  if (CUES == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&CUE_MUTEX);
+  hash_iter_t it = cuehash_iter(CUES);
+  while (!cuehash_iter_end(it)) {
+    cached_cue_t *e = cuehash_get(CUES, cuehash_iter_key(it));
+    if (e->cue != NULL && e->cue->refs == 1) {
+      release_locked(e->cue);
+      e->cue = NULL;
+      n += 1;
+    }
+    it = cuehash_iter_next(it);
+  }
+  pthread_mutex_unlock(&CUE_MUTEX);
+  return n;
+}
+
+int cuecache_count(void)
+{
+  return COUNT;
+}
+
+unsigned long cuecache_hits(void)
+{
+  return HITS;
+}
+
+unsigned long cuecache_parses(void)
+{
+  return PARSES;
+}
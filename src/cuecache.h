@@ -0,0 +1,53 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __CUECACHE__HOD
+#define __CUECACHE__HOD
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "cue.h"
+
+/*
+ * Parsed cue sheets, keyed by path and validated against the file's
+ * identity (device, inode, mtime and size). When the watcher is on,
+ * an unchanged watcher stamp saves the stat(). A cue sheet is parsed
+ * once per change and shared by all users, which must treat it as
+ * read only. Parsing does not hold up users of other sheets; users of
+ * the same sheet wait for it.
+ *
+ * cuecache_get() returns a referenced sheet, and the watcher stamp
+ * taken before it was parsed. Every reference, from cuecache_get() or
+ * cuecache_ref(), is given back with cuecache_release(); a sheet that
+ * has been replaced is destroyed when its last user lets go.
+ */
+
+void cuecache_init(void);
+void cuecache_destroy(void);
+
+cue_t *cuecache_get(const char *cuefile, struct stat *st, unsigned long *stamp);
+cue_t *cuecache_ref(cue_t * cue);
+void cuecache_release(cue_t * cue);
+int cuecache_trim(void);
+
+int cuecache_count(void);
+unsigned long cuecache_hits(void);
+unsigned long cuecache_parses(void);
+
+#endif
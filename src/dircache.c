@@ -0,0 +1,348 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "dircache.h"
+#include "watcher.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <elementals/hash.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#define ALLOC_TAG ALLOC_DATA
+#include "allocprof.h"
+
+#define MKR(st,A) if (st.st_mode&A) { st.st_mode-=A; }
+#define MK_READONLY(st) MKR(st,S_IWUSR);MKR(st,S_IWGRP);MKR(st,S_IWOTH);
+
+/**********************************************************************/
+
+// Slots are never removed from the hash; the listing in a slot is
+// swapped when it's rebuilt, so readers holding a reference are safe.
+typedef struct {
+  dircache_listing_t *listing;
+} dircache_slot_t;
+
+static hash_data_t dircache_slot_copy(dircache_slot_t * e)
+{
+  return (hash_data_t) e;
+}
+
+static void listing_destroy(dircache_listing_t * l)
+{
+  int i;
+  for (i = 0; i < l->count; i++) {
+    mc_free(l->entries[i].name);
+    mc_free(l->entries[i].actual);
+  }
+  mc_free(l->entries);
+  mc_free(l);
+}
+
+static void dircache_slot_destroy(hash_data_t d)
+{
+  dircache_slot_t *slot = (dircache_slot_t *) d;
+  if (slot->listing != NULL) {
+    dircache_release(slot->listing);
+  }
+  mc_free(slot);
+}
+
+DECLARE_HASH(dircachehash, dircache_slot_t);
+IMPLEMENT_HASH(dircachehash, dircache_slot_t, dircache_slot_copy, dircache_slot_destroy);
+
+static dircachehash *LISTINGS = NULL;
+static pthread_mutex_t DIRCACHE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+/**********************************************************************/
+
+static void stamp_listing(dircache_listing_t * l, const char *validate_path)
+{
+  struct stat st;
+  l->stamp = watcher_stamp(validate_path);
+  if (stat(validate_path, &st) == 0) {
+    l->mtime = st.st_mtime;
+    l->st_size = st.st_size;
+    l->ino = st.st_ino;
+  } else {
+    l->mtime = 0;
+    l->st_size = -1;
+    l->ino = 0;
+  }
+}
+
+static int listing_valid(dircache_listing_t * l, const char *validate_path)
+{
+  if (watcher_active()) {
+    return l->stamp != 0 && watcher_stamp(validate_path) == l->stamp;
+  } else {
+    struct stat st;
+    if (stat(validate_path, &st) != 0) {
+      return 0;
+    }
+    return st.st_mtime == l->mtime && st.st_size == l->st_size && st.st_ino == l->ino;
+  }
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+  const dircache_entry_t *ea = (const dircache_entry_t *)a;
+  const dircache_entry_t *eb = (const dircache_entry_t *)b;
+  int c = strcmp(ea->name, eb->name);
+  if (c == 0) {
+    // a cue sheet shadows a directory with the same name
+    c = (ea->kind == DIRCACHE_CUE) ? -1 : ((eb->kind == DIRCACHE_CUE) ? 1 : 0);
+  }
+  return c;
+}
+
+/**********************************************************************/
+
+void dircache_init(void)
+{
+  LISTINGS = dircachehash_new(1000, HASH_CASE_SENSITIVE);
+}
+
+void dircache_destroy(void)
+{
+  if (LISTINGS != NULL) {
+    dircachehash_destroy(LISTINGS);
+    LISTINGS = NULL;
+  }
+}
+
+dircache_listing_t *dircache_get(const char *full_path, const char *validate_path,
+                                 dircache_builder_t build, void *data)
+{
+  pthread_mutex_lock(&DIRCACHE_MUTEX);
+  dircache_slot_t *slot = dircachehash_get(LISTINGS, full_path);
+  dircache_listing_t *l = (slot == NULL) ? NULL : slot->listing;
+  if (l != NULL) {
+    l->refs += 1;
+  }
+  pthread_mutex_unlock(&DIRCACHE_MUTEX);
+
+  if (l != NULL) {
+    if (listing_valid(l, validate_path)) {
+      log_debug2("dircache: hit for %s", full_path);
+      return l;
+    }
+    dircache_release(l);
+  }
+
+  log_debug2("dircache: building listing for %s", full_path);
+  l = (dircache_listing_t *) mc_malloc(sizeof(dircache_listing_t));
+  memset(l, 0, sizeof(dircache_listing_t));
+  l->refs = 2;    // one for the cache, one for the caller
+  // Stamp first, so changes made while building invalidate the listing
+  stamp_listing(l, validate_path);
+  if (build(l, full_path, data) != 0) {
+    listing_destroy(l);
+    return NULL;
+  }
+  if (l->count > 1) {
+    qsort(l->entries, l->count, sizeof(dircache_entry_t), entry_cmp);
+  }
+
+  pthread_mutex_lock(&DIRCACHE_MUTEX);
+  slot = dircachehash_get(LISTINGS, full_path);
+  if (slot == NULL) {
+    slot = (dircache_slot_t *) mc_malloc(sizeof(dircache_slot_t));
+    slot->listing = l;
+    dircachehash_put(LISTINGS, full_path, slot);
+  } else {
+    dircache_listing_t *old = slot->listing;
+    slot->listing = l;
+    if (old != NULL && --old->refs == 0) {
+      listing_destroy(old);
+    }
+  }
+  pthread_mutex_unlock(&DIRCACHE_MUTEX);
+
+  return l;
+}
+
+void dircache_release(dircache_listing_t * l)
+{
+  pthread_mutex_lock(&DIRCACHE_MUTEX);
+  int destroy = (--l->refs == 0);
+  pthread_mutex_unlock(&DIRCACHE_MUTEX);
+  if (destroy) {
+    listing_destroy(l);
+  }
+}
+
+void dircache_invalidate(const char *full_path)
+{
+  pthread_mutex_lock(&DIRCACHE_MUTEX);
+  dircache_slot_t *slot = dircachehash_get(LISTINGS, full_path);
+  dircache_listing_t *old = NULL;
+  if (slot != NULL) {
+    old = slot->listing;
+    slot->listing = NULL;
+  }
+  int destroy = (old != NULL && --old->refs == 0);
+  pthread_mutex_unlock(&DIRCACHE_MUTEX);
+  if (destroy) {
+    listing_destroy(old);
+  }
+}
+
+// Drops the listings nobody holds, they are built again when they are
+// asked for. Returns how many went.
+int dircache_trim(void)
+{
+  int n = 0;
+  if (LISTINGS == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&DIRCACHE_MUTEX);
+  hash_iter_t it = dircachehash_iter(LISTINGS);
+  while (!dircachehash_iter_end(it)) {
+    dircache_slot_t *slot = dircachehash_get(LISTINGS, dircachehash_iter_key(it));
+    if (slot->listing != NULL && slot->listing->refs == 1) {
+      listing_destroy(slot->listing);
+      slot->listing = NULL;
+      n += 1;
+    }
+    it = dircachehash_iter_next(it);
+  }
+  pthread_mutex_unlock(&DIRCACHE_MUTEX);
+  return n;
+}
+
+/**********************************************************************/
+
+void dircache_add(dircache_listing_t * l, const char *name, const char *actual,
+                  const struct stat *st, int kind, int listed)
+{
+  if (l->count == l->size) {
+    l->size = (l->size == 0) ? 32 : l->size * 2;
+    l->entries = (dircache_entry_t *) mc_realloc(l->entries, sizeof(dircache_entry_t) * l->size);
+  }
+  dircache_entry_t *e = &l->entries[l->count++];
+  e->name = mc_strdup(name);
+  e->actual = mc_strdup(actual);
+  if (st != NULL) {
+    memcpy(&e->st, st, sizeof(struct stat));
+  } else {
+    memset(&e->st, 0, sizeof(struct stat));
+  }
+  e->kind = kind;
+  e->listed = listed;
+}
+
+static int is_cue_name(const char *name, int len)
+{
+  return len > 4 && strcasecmp(name + len - 4, ".cue") == 0;
+}
+
+// Default builder for a real directory: sub directories are listed as
+// they are, cue sheets as directories without the .cue extension. Other
+// files are kept (unlisted) so lookups can find them. Only listed
+// entries are stat()ed, relative to the directory handle.
+int dircache_read_dir(dircache_listing_t * l, const char *full_path, void *data)
+{
+  DIR *dh = opendir(full_path);
+  if (dh == NULL) {
+    log_debug2("dircache: opendir %s returns NULL!", full_path);
+    return -1;
+  }
+
+  int dfd = dirfd(dh);
+  struct dirent *de;
+  while ((de = readdir(dh)) != NULL) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    int len = strlen(de->d_name);
+    int cue = is_cue_name(de->d_name, len);
+    int type = de->d_type;
+    if (type != DT_DIR && type != DT_REG && !cue) {
+      // DT_UNKNOWN or symlink, we need to look
+      struct stat st;
+      if (fstatat(dfd, de->d_name, &st, 0) == 0) {
+        type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : type);
+      }
+    }
+
+    if (type == DT_DIR || cue) {
+      struct stat st;
+      if (fstatat(dfd, de->d_name, &st, 0) != 0) {
+        continue;
+      }
+      MK_READONLY(st);
+      if (S_ISDIR(st.st_mode)) {
+        dircache_add(l, de->d_name, de->d_name, &st, DIRCACHE_DIR, 1);
+      } else if (S_ISREG(st.st_mode)) {
+        char *dr = mc_strdup(de->d_name);
+        dr[len - 4] = '\0';
+        st.st_mode -= S_IFREG;
+        st.st_mode += S_IFDIR;
+        dircache_add(l, dr, de->d_name, &st, DIRCACHE_CUE, 1);
+        mc_free(dr);
+      }
+    } else {
+      dircache_add(l, de->d_name, de->d_name, NULL, DIRCACHE_FILE, 0);
+    }
+  }
+  closedir(dh);
+
+  return 0;
+}
+
+dircache_entry_t *dircache_find(dircache_listing_t * l, const char *name)
+{
+  int lo = 0, hi = l->count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    int c = strcmp(name, l->entries[mid].name);
+    if (c == 0) {
+      // first of equal names, that's the cue sheet if there is one
+      while (mid > 0 && strcmp(name, l->entries[mid - 1].name) == 0) {
+        mid -= 1;
+      }
+      return &l->entries[mid];
+    } else if (c < 0) {
+      hi = mid - 1;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+int dircache_count(dircache_listing_t * l)
+{
+  return l->count;
+}
+
+dircache_entry_t *dircache_entry(dircache_listing_t * l, int index)
+{
+  if (index < 0 || index >= l->count) {
+    return NULL;
+  } else {
+    return &l->entries[index];
+  }
+}
@@ -0,0 +1,81 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __DIRCACHE__HOD
+#define __DIRCACHE__HOD
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Cache of directory listings. A listing holds the names as they are
+ * shown in the mount with their attributes, so readdir can be served
+ * without touching the disk. Listings are validated against the watcher
+ * stamp of a path (the directory itself or the cue sheet it was made
+ * from), or, when the watcher is off, against that path's stat().
+ *
+ * Listings are sorted by name, so they double as a name index for
+ * classifying paths without probing the disk.
+ */
+
+#define DIRCACHE_DIR    1   // sub directory
+#define DIRCACHE_CUE    2   // cue sheet, shown as directory
+#define DIRCACHE_FILE   3   // other file, not listed
+#define DIRCACHE_TRACK  4   // virtual track in a cue directory
+
+typedef struct {
+  char *name;         // name in the mount
+  char *actual;       // name on disk
+  struct stat st;
+  int kind;
+  int listed;
+} dircache_entry_t;
+
+typedef struct {
+  int refs;
+  int count;
+  int size;
+  dircache_entry_t *entries;
+  unsigned long stamp;
+  time_t mtime;
+  off_t st_size;
+  ino_t ino;
+} dircache_listing_t;
+
+typedef int (*dircache_builder_t)(dircache_listing_t * l, const char *full_path, void *data);
+
+void dircache_init(void);
+void dircache_destroy(void);
+
+dircache_listing_t *dircache_get(const char *full_path, const char *validate_path,
+                                 dircache_builder_t build, void *data);
+void dircache_release(dircache_listing_t * l);
+void dircache_invalidate(const char *full_path);
+int dircache_trim(void);
+
+int dircache_read_dir(dircache_listing_t * l, const char *full_path, void *data);
+void dircache_add(dircache_listing_t * l, const char *name, const char *actual,
+                  const struct stat *st, int kind, int listed);
+
+dircache_entry_t *dircache_find(dircache_listing_t * l, const char *name);
+int dircache_count(dircache_listing_t * l);
+dircache_entry_t *dircache_entry(dircache_listing_t * l, int index);
+
+#endif
@@ -0,0 +1,213 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "failcache.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <elementals/hash.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+/**********************************************************************/
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  off_t size;
+  int failures;
+  int err;
+  time_t retry_at;
+} fail_entry_t;
+
+static hash_data_t fail_entry_copy(fail_entry_t * e)
+{
+  fail_entry_t *n = (fail_entry_t *) mc_malloc(sizeof(fail_entry_t));
+  memcpy(n, e, sizeof(fail_entry_t));
+  return (hash_data_t) n;
+}
+
+static void fail_entry_destroy(hash_data_t d)
+{
+  mc_free(d);
+}
+
+DECLARE_HASH(failhash, fail_entry_t);
+IMPLEMENT_HASH(failhash, fail_entry_t, fail_entry_copy, fail_entry_destroy);
+
+static failhash *FAILS = NULL;
+static pthread_mutex_t FAIL_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static int COUNT = 0;
+
+static int BACKOFF = 30;
+static int MAX_BACKOFF = 3600;
+
+/**********************************************************************/
+
+static int same_file(fail_entry_t * e, struct stat *st)
+{
+  return e->dev == st->st_dev && e->ino == st->st_ino &&
+         e->mtime == st->st_mtime && e->size == st->st_size;
+}
+
+static int backoff_for(int failures)
+{
+  int b = BACKOFF;
+  while (--failures > 0 && b < MAX_BACKOFF) {
+    b *= 2;
+  }
+  return (b > MAX_BACKOFF) ? MAX_BACKOFF : b;
+}
+
+/**********************************************************************/
+
+void failcache_configure(int backoff_in_s, int max_backoff_in_s)
+{
+  BACKOFF = backoff_in_s;
+  MAX_BACKOFF = (max_backoff_in_s < backoff_in_s) ? backoff_in_s : max_backoff_in_s;
+}
+
+void failcache_init(void)
+{
+  FAILS = failhash_new(100, HASH_CASE_SENSITIVE);
+}
+
+void failcache_destroy(void)
+{
+  failhash_destroy(FAILS);
+  FAILS = NULL;
+  COUNT = 0;
+}
+
+// Returns 1 and sets *err when segment id of audio_file is backed off.
+// Segments that never failed cost a hash lookup, the stat() is only
+// done for those that are in the cache.
+int failcache_check(const char *id, const char *audio_file, int *err)
+{
+  if (FAILS == NULL || BACKOFF <= 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&FAIL_MUTEX);
+  fail_entry_t *e = failhash_get(FAILS, id);
+  if (e == NULL || e->failures == 0) {
+    pthread_mutex_unlock(&FAIL_MUTEX);
+    return 0;
+  }
+  fail_entry_t copy = *e;
+  pthread_mutex_unlock(&FAIL_MUTEX);
+
+  struct stat st;
+  if (stat(audio_file, &st) != 0 || !same_file(&copy, &st)) {
+    log_info2("failcache: %s changed, trying again", audio_file);
+    failcache_forget(id);
+    return 0;
+  }
+
+  if (time(NULL) < copy.retry_at) {
+    *err = copy.err;
+    return 1;
+  }
+  return 0;
+}
+
+void failcache_add(const char *id, const char *audio_file, int err)
+{
+  if (FAILS == NULL || BACKOFF <= 0) {
+    return;
+  }
+
+  struct stat st;
+  if (stat(audio_file, &st) != 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&FAIL_MUTEX);
+  fail_entry_t *e = failhash_get(FAILS, id);
+  if (e == NULL) {
+    fail_entry_t n;
+    memset(&n, 0, sizeof(n));
+    failhash_put(FAILS, id, &n);
+    e = failhash_get(FAILS, id);
+  } else if (e->failures > 0 && !same_file(e, &st)) {
+    e->failures = 0;
+    COUNT -= 1;
+  }
+  if (e->failures == 0) {
+    COUNT += 1;
+  }
+  e->dev = st.st_dev;
+  e->ino = st.st_ino;
+  e->mtime = st.st_mtime;
+  e->size = st.st_size;
+  e->err = err;
+  e->failures += 1;
+  int backoff = backoff_for(e->failures);
+  e->retry_at = time(NULL) + backoff;
+  int failures = e->failures;
+  pthread_mutex_unlock(&FAIL_MUTEX);
+
+  log_info4("failcache: %s failed to split (%d times), backing off %ds",
+            id, failures, backoff);
+}
+
+void failcache_forget(const char *id)
+{
+  if (FAILS == NULL) {
+    return;
+  }
+  // Entries are kept, a file that failed once may well fail again
+  pthread_mutex_lock(&FAIL_MUTEX);
+  fail_entry_t *e = failhash_get(FAILS, id);
+  if (e != NULL && e->failures > 0) {
+    e->failures = 0;
+    e->retry_at = 0;
+    COUNT -= 1;
+  }
+  pthread_mutex_unlock(&FAIL_MUTEX);
+}
+
+int failcache_count(void)
+{
+  return COUNT;
+}
+
+void failcache_report(void)
+{
+  if (FAILS == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&FAIL_MUTEX);
+  log_info2("failcache: %d segments failed to split", COUNT);
+  hash_iter_t it = failhash_iter(FAILS);
+  while (!failhash_iter_end(it)) {
+    fail_entry_t *e = failhash_get(FAILS, failhash_iter_key(it));
+    if (e->failures > 0) {
+      log_info4("failcache: %s (%d failures, error %d)", failhash_iter_key(it), e->failures, e->err);
+    }
+    it = failhash_iter_next(it);
+  }
+  pthread_mutex_unlock(&FAIL_MUTEX);
+}
@@ -0,0 +1,44 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __FAILCACHE__HOD
+#define __FAILCACHE__HOD
+
+/*
+ * Segments that failed to split. A failure is remembered for the
+ * segment id (audio file and offsets), so one bad range doesn't back
+ * off the other tracks of an image, together with the identity of the
+ * audio file (device, inode, mtime and size); while it is backed off,
+ * failcache_check() returns the recorded error without trying again.
+ * Each failure after a retry doubles the back off, up to a maximum.
+ * Once the file changes the entry no longer applies.
+ */
+
+void failcache_configure(int backoff_in_s, int max_backoff_in_s);
+void failcache_init(void);
+void failcache_destroy(void);
+
+int failcache_check(const char *id, const char *audio_file, int *err);
+void failcache_add(const char *id, const char *audio_file, int err);
+void failcache_forget(const char *id);
+
+int failcache_count(void);
+void failcache_report(void);
+
+#endif
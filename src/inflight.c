@@ -0,0 +1,178 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "inflight.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+static pthread_mutex_t INFLIGHT_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static inflight_t *JOBS = NULL;
+static int COUNT = 0;
+static int TIMEOUT = 120;
+static int (*INTERRUPTED)(void) = NULL;
+
+/**********************************************************************/
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int interrupted(void)
+{
+  return INTERRUPTED != NULL && INTERRUPTED();
+}
+
+/**********************************************************************/
+
+void inflight_configure(int timeout_in_s, int (*interrupted_check)(void))
+{
+  TIMEOUT = timeout_in_s;
+  INTERRUPTED = interrupted_check;
+}
+
+inflight_t *inflight_join(const char *id, int *owner)
+{
+  pthread_mutex_lock(&INFLIGHT_MUTEX);
+  inflight_t *job = JOBS;
+  while (job != NULL && strcmp(job->id, id) != 0) {
+    job = job->next;
+  }
+  if (job != NULL && job->result == INFLIGHT_PENDING) {
+    job->refs += 1;
+    *owner = 0;
+    log_debug3("inflight: joining %s, %d waiting", id, job->refs);
+  } else {
+    job = (inflight_t *) mc_malloc(sizeof(inflight_t));
+    job->id = mc_strdup(id);
+    job->refs = 1;
+    job->result = INFLIGHT_PENDING;
+    job->deadline_ms = (TIMEOUT > 0) ? now_ms() + TIMEOUT * 1000.0 : 0.0;
+    job->data = NULL;
+    job->release = NULL;
+    pthread_cond_init(&job->cond, NULL);
+    job->next = JOBS;
+    JOBS = job;
+    COUNT += 1;
+    *owner = 1;
+  }
+  pthread_mutex_unlock(&INFLIGHT_MUTEX);
+  return job;
+}
+
+// Waits for the owner to finish. Wakes up regularly to see if our own
+// request was interrupted or the deadline passed.
+int inflight_wait(inflight_t * job)
+{
+  int result;
+  pthread_mutex_lock(&INFLIGHT_MUTEX);
+  while ((result = job->result) == INFLIGHT_PENDING) {
+    if (job->deadline_ms > 0.0 && now_ms() > job->deadline_ms) {
+      result = INFLIGHT_TIMEDOUT;
+      break;
+    }
+    if (interrupted()) {
+      result = INFLIGHT_CANCELLED;
+      break;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100 * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&job->cond, &INFLIGHT_MUTEX, &ts);
+  }
+  pthread_mutex_unlock(&INFLIGHT_MUTEX);
+  return result;
+}
+
+// data is what the requesters get with the result; release, when not
+// NULL, is called with it once they have all left the job
+void inflight_finish(inflight_t * job, int result, void *data, void (*release)(void *data))
+{
+  pthread_mutex_lock(&INFLIGHT_MUTEX);
+  job->result = result;
+  job->data = data;
+  job->release = release;
+  // Unlink, new requesters start a new job from here on
+  inflight_t **p = &JOBS;
+  while (*p != NULL && *p != job) {
+    p = &(*p)->next;
+  }
+  if (*p == job) {
+    *p = job->next;
+    COUNT -= 1;
+  }
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&INFLIGHT_MUTEX);
+}
+
+void inflight_leave(inflight_t * job)
+{
+  pthread_mutex_lock(&INFLIGHT_MUTEX);
+  int destroy = (--job->refs == 0);
+  pthread_mutex_unlock(&INFLIGHT_MUTEX);
+  if (destroy) {
+    if (job->release != NULL) {
+      job->release(job->data);
+    }
+    pthread_cond_destroy(&job->cond);
+    mc_free(job->id);
+    mc_free(job);
+  }
+}
+
+// Valid once inflight_wait() has returned, until inflight_leave()
+void *inflight_data(inflight_t * job)
+{
+  pthread_mutex_lock(&INFLIGHT_MUTEX);
+  void *data = job->data;
+  pthread_mutex_unlock(&INFLIGHT_MUTEX);
+  return data;
+}
+
+// Called by the owner while it works on the job
+int inflight_cancelled(void *_job)
+{
+  inflight_t *job = (inflight_t *) _job;
+  if (job->deadline_ms > 0.0 && now_ms() > job->deadline_ms) {
+    return INFLIGHT_TIMEDOUT;
+  }
+  pthread_mutex_lock(&INFLIGHT_MUTEX);
+  int alone = (job->refs == 1);
+  pthread_mutex_unlock(&INFLIGHT_MUTEX);
+  if (alone && interrupted()) {
+    return INFLIGHT_CANCELLED;
+  }
+  return 0;
+}
+
+int inflight_count(void)
+{
+  return COUNT;
+}
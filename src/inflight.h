@@ -0,0 +1,64 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __INFLIGHT__HOD
+#define __INFLIGHT__HOD
+
+#include <pthread.h>
+
+/*
+ * Splits in flight, keyed by segment id. The first requester of an id
+ * becomes the owner and does the work; later requesters join the job
+ * and wait for its result without holding any other lock. A requester
+ * that is interrupted, or whose deadline passes, leaves the job. When
+ * only the owner is left and it has been interrupted too, or when the
+ * deadline passes, the job reports itself cancelled, so the split can
+ * stop early. The owner hands its result, the segment, to the
+ * requesters with the job, and lets go of it when the last one left.
+ */
+
+#define INFLIGHT_PENDING    1
+#define INFLIGHT_OK         0
+#define INFLIGHT_FAILED    -1
+#define INFLIGHT_CANCELLED -2
+#define INFLIGHT_TIMEDOUT  -3
+
+typedef struct inflight_s {
+  char *id;
+  int refs;           // requesters still interested, the owner included
+  int result;
+  double deadline_ms;
+  void *data;         // the result, handed to the requesters
+  void (*release)(void *data);   // when the last requester has left
+  pthread_cond_t cond;
+  struct inflight_s *next;
+} inflight_t;
+
+void inflight_configure(int timeout_in_s, int (*interrupted_check)(void));
+
+inflight_t *inflight_join(const char *id, int *owner);
+int inflight_wait(inflight_t * job);
+void inflight_finish(inflight_t * job, int result, void *data, void (*release)(void *data));
+void *inflight_data(inflight_t * job);
+void inflight_leave(inflight_t * job);
+
+int inflight_cancelled(void *job);
+int inflight_count(void);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "intern.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#define ALLOC_TAG ALLOC_DATA
+#include "allocprof.h"
+
+static pthread_rwlock_t INTERN_LOCK = PTHREAD_RWLOCK_INITIALIZER;
+static intern_t **TABLE = NULL;     // open addressing, linear probing
+static int SLOTS = 0;
+static int COUNT = 0;
+static size_t BYTES = 0;
+
+/**********************************************************************/
+
+unsigned long long intern_hash(const char *s, int len)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  int i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Must be called with INTERN_LOCK held
+static int find_slot(const char *s, int len, unsigned long long h)
+{
+  int mask = SLOTS - 1;
+  int i = (int)(h & mask);
+  while (TABLE[i] != NULL) {
+    intern_t *e = TABLE[i];
+    if (e->hash == h && e->len == len && memcmp(e->str, s, len) == 0) {
+      return i;
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+// Must be called with INTERN_LOCK held for writing
+static void grow(void)
+{
+  intern_t **old = TABLE;
+  int old_slots = SLOTS;
+  SLOTS = (SLOTS == 0) ? 1024 : SLOTS * 2;
+  TABLE = (intern_t **) mc_malloc(sizeof(intern_t *) * SLOTS);
+  memset(TABLE, 0, sizeof(intern_t *) * SLOTS);
+  int i;
+  for (i = 0; i < old_slots; i++) {
+    if (old[i] != NULL) {
+      int mask = SLOTS - 1;
+      int k = (int)(old[i]->hash & mask);
+      while (TABLE[k] != NULL) {
+        k = (k + 1) & mask;
+      }
+      TABLE[k] = old[i];
+    }
+  }
+  mc_free(old);
+}
+
+// Empties slot i and moves the records after it that would no longer be
+// found back into the hole. Must be called with INTERN_LOCK held for
+// writing
+static void remove_slot(int i)
+{
+  int mask = SLOTS - 1;
+  int j = i;
+  TABLE[i] = NULL;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (TABLE[j] == NULL) {
+      break;
+    }
+    int k = (int)(TABLE[j]->hash & mask);
+    // stays when its home slot k lies cyclically in (i, j]
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    TABLE[i] = TABLE[j];
+    TABLE[j] = NULL;
+    i = j;
+  }
+}
+
+/**********************************************************************/
+
+void intern_init(void)
+{
+  pthread_rwlock_wrlock(&INTERN_LOCK);
+  if (TABLE == NULL) {
+    grow();
+  }
+  pthread_rwlock_unlock(&INTERN_LOCK);
+}
+
+void intern_destroy(void)
+{
+  pthread_rwlock_wrlock(&INTERN_LOCK);
+  int i;
+  for (i = 0; i < SLOTS; i++) {
+    mc_free(TABLE[i]);
+  }
+  mc_free(TABLE);
+  TABLE = NULL;
+  SLOTS = 0;
+  COUNT = 0;
+  BYTES = 0;
+  pthread_rwlock_unlock(&INTERN_LOCK);
+}
+
+const intern_t *intern_lookup(const char *s)
+{
+  int len = strlen(s);
+  unsigned long long h = intern_hash(s, len);
+  pthread_rwlock_rdlock(&INTERN_LOCK);
+  intern_t *e = (TABLE == NULL) ? NULL : TABLE[find_slot(s, len, h)];
+  pthread_rwlock_unlock(&INTERN_LOCK);
+  return e;
+}
+
+const intern_t *intern(const char *s)
+{
+  int len = strlen(s);
+  unsigned long long h = intern_hash(s, len);
+  // References are taken under the read lock, the last one only goes
+  // under the write lock
+  pthread_rwlock_rdlock(&INTERN_LOCK);
+  intern_t *e = (TABLE == NULL) ? NULL : TABLE[find_slot(s, len, h)];
+  if (e != NULL) {
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&INTERN_LOCK);
+  if (e != NULL) {
+    return e;
+  }
+
+  pthread_rwlock_wrlock(&INTERN_LOCK);
+  if (TABLE == NULL || (COUNT + 1) * 10 > SLOTS * 7) {
+    grow();
+  }
+  // somebody may have added it in between
+  int i = find_slot(s, len, h);
+  if (TABLE[i] == NULL) {
+    intern_t *n = (intern_t *) mc_malloc(sizeof(intern_t) + len);
+    n->hash = h;
+    n->refs = 0;
+    n->len = len;
+    memcpy(n->str, s, len + 1);
+    TABLE[i] = n;
+    COUNT += 1;
+    BYTES += sizeof(intern_t) + len;
+  }
+  e = TABLE[i];
+  e->refs += 1;
+  pthread_rwlock_unlock(&INTERN_LOCK);
+  return e;
+}
+
+const intern_t *intern_ref(const intern_t * e)
+{
+  pthread_rwlock_rdlock(&INTERN_LOCK);
+  __atomic_add_fetch(&((intern_t *) e)->refs, 1, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&INTERN_LOCK);
+  return e;
+}
+
+void intern_release(const intern_t * e)
+{
+  if (e == NULL) {
+    return;
+  }
+  pthread_rwlock_wrlock(&INTERN_LOCK);
+  intern_t *r = (intern_t *) e;
+  if (--r->refs == 0) {
+    remove_slot(find_slot(r->str, r->len, r->hash));
+    COUNT -= 1;
+    BYTES -= sizeof(intern_t) + r->len;
+    mc_free(r);
+  }
+  pthread_rwlock_unlock(&INTERN_LOCK);
+}
+
+int intern_count(void)
+{
+  return COUNT;
+}
+
+size_t intern_bytes(void)
+{
+  return BYTES;
+}
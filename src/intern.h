@@ -0,0 +1,57 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __INTERN__HOD
+#define __INTERN__HOD
+
+#include <stddef.h>
+
+/*
+ * Interned strings. Every distinct string gets one immutable record
+ * holding it and its 64 bit FNV-1a hash; the record's address is a
+ * stable handle, so interned strings compare by pointer and hash
+ * without looking at the characters again.
+ *
+ * Records are reference counted. intern() and intern_ref() return a
+ * reference that is given back with intern_release(); the record goes
+ * when its last reference does, or at intern_destroy(). intern_lookup()
+ * takes no reference, its result is only valid while somebody else
+ * holds one.
+ */
+
+typedef struct {
+  unsigned long long hash;
+  int refs;
+  int len;
+  char str[1];
+} intern_t;
+
+void intern_init(void);
+void intern_destroy(void);
+
+const intern_t *intern(const char *s);
+const intern_t *intern_ref(const intern_t * e);
+void intern_release(const intern_t * e);
+const intern_t *intern_lookup(const char *s);
+unsigned long long intern_hash(const char *s, int len);
+
+int intern_count(void);
+size_t intern_bytes(void);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "latency.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+typedef struct {
+  unsigned long long phase_ns[LAT_COUNT];
+} op_context_t;
+
+static int ENABLED = 1;
+static unsigned long long SLOW_NS = 1000ULL * 1000000ULL;
+static latency_hist_t HISTS[LAT_COUNT];
+static pthread_key_t KEY;
+static int KEY_CREATED = 0;
+
+static const char *NAMES[LAT_COUNT] = {
+  "getattr",
+  "readdir",
+  "open",
+  "read",
+  "release",
+  "classify",
+  "cue_parse",
+  "monitor_wait",
+  "sched_wait",
+  "inflight_wait",
+  "split_lock",
+  "split",
+  "retag",
+  "segment_read"
+};
+
+/**********************************************************************/
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(unsigned long long us)
+{
+  if (us < LAT_SUB) {
+    return (int)us;
+  }
+  int msb = 63 - __builtin_clzll(us);
+  int shift = msb - LAT_SUB_BITS;
+  int b = (shift + 1) * LAT_SUB + (int)((us >> shift) - LAT_SUB);
+  return (b < LAT_BUCKETS) ? b : LAT_BUCKETS - 1;
+}
+
+// Highest value that lands in bucket b
+static unsigned long long bucket_top(int b)
+{
+  if (b < LAT_SUB) {
+    return b;
+  }
+  int shift = b / LAT_SUB - 1;
+  unsigned long long sub = b % LAT_SUB + LAT_SUB;
+  return ((sub + 1) << shift) - 1;
+}
+
+static void record(int which, unsigned long long ns)
+{
+  latency_hist_t *h = &HISTS[which];
+  unsigned long long us = ns / 1000;
+  __atomic_fetch_add(&h->counts[bucket_of(us)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+  unsigned long long max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+  while (us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, 0,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+static op_context_t *context(void)
+{
+  op_context_t *c = (op_context_t *) pthread_getspecific(KEY);
+  if (c == NULL) {
+    c = (op_context_t *) mc_malloc(sizeof(op_context_t));
+    memset(c, 0, sizeof(op_context_t));
+    pthread_setspecific(KEY, c);
+  }
+  return c;
+}
+
+static void context_destroy(void *c)
+{
+  mc_free(c);
+}
+
+static void log_slow(int op, unsigned long long ns, const char *path, op_context_t * c)
+{
+  char breakdown[512];
+  int i, l = 0;
+  breakdown[0] = '\0';
+  for (i = LAT_FIRST_PHASE; i < LAT_COUNT && l < (int)sizeof(breakdown); i++) {
+    if (c->phase_ns[i] >= 100000) {
+      l += snprintf(breakdown + l, sizeof(breakdown) - l, " %s=%.1fms",
+                    NAMES[i], c->phase_ns[i] / 1e6);
+    }
+  }
+  log_info5("slow %s %s: %.1fms%s", NAMES[op], path, ns / 1e6, breakdown);
+}
+
+/**********************************************************************/
+
+void latency_configure(int enabled, int slow_ms)
+{
+  ENABLED = enabled;
+  SLOW_NS = (slow_ms > 0) ? slow_ms * 1000000ULL : 0;
+}
+
+void latency_init(void)
+{
+  memset(HISTS, 0, sizeof(HISTS));
+  if (!KEY_CREATED) {
+    pthread_key_create(&KEY, context_destroy);
+    KEY_CREATED = 1;
+  }
+}
+
+void latency_destroy(void)
+{
+  if (KEY_CREATED) {
+    context_destroy(pthread_getspecific(KEY));
+    pthread_setspecific(KEY, NULL);
+    pthread_key_delete(KEY);
+    KEY_CREATED = 0;
+  }
+}
+
+int latency_enabled(void)
+{
+  return ENABLED && KEY_CREATED;
+}
+
+unsigned long long latency_start(void)
+{
+  return latency_enabled() ? now_ns() : 0;
+}
+
+void latency_phase(int phase, unsigned long long t0)
+{
+  if (t0 == 0 || !KEY_CREATED) {
+    return;
+  }
+  unsigned long long ns = now_ns() - t0;
+  record(phase, ns);
+  context()->phase_ns[phase] += ns;
+}
+
+void latency_op_begin(void)
+{
+  if (latency_enabled()) {
+    op_context_t *c = context();
+    memset(c->phase_ns, 0, sizeof(c->phase_ns));
+  }
+}
+
+void latency_op_end(int op, unsigned long long t0, const char *path)
+{
+  if (t0 == 0 || !KEY_CREATED) {
+    return;
+  }
+  unsigned long long ns = now_ns() - t0;
+  record(op, ns);
+  if (SLOW_NS > 0 && ns >= SLOW_NS) {
+    log_slow(op, ns, path, context());
+  }
+}
+
+const char *latency_name(int which)
+{
+  return NAMES[which];
+}
+
+void latency_snapshot(int which, latency_hist_t * h)
+{
+  latency_hist_t *s = &HISTS[which];
+  int i;
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    h->counts[i] = __atomic_load_n(&s->counts[i], __ATOMIC_RELAXED);
+  }
+  h->count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+  h->sum_us = __atomic_load_n(&s->sum_us, __ATOMIC_RELAXED);
+  h->max_us = __atomic_load_n(&s->max_us, __ATOMIC_RELAXED);
+}
+
+// Upper bound of the bucket holding quantile q (0..1)
+unsigned long long latency_quantile(latency_hist_t * h, double q)
+{
+  unsigned long total = 0;
+  int i;
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    total += h->counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  unsigned long want = (unsigned long)(q * total);
+  unsigned long seen = 0;
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > want) {
+      unsigned long long top = bucket_top(i);
+      return (top < h->max_us) ? top : h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+// Number of values in buckets that lie entirely at or below us
+unsigned long latency_below(latency_hist_t * h, unsigned long long us)
+{
+  unsigned long n = 0;
+  int i;
+  for (i = 0; i < LAT_BUCKETS && bucket_top(i) <= us; i++) {
+    n += h->counts[i];
+  }
+  return n;
+}
+
+void latency_report(void)
+{
+  latency_hist_t h;
+  int i;
+  for (i = 0; i < LAT_COUNT; i++) {
+    latency_snapshot(i, &h);
+    if (h.count > 0) {
+      log_info5("latency: %-13s n=%lu p50=%lluus p99=%lluus",
+                NAMES[i], h.count, latency_quantile(&h, 0.5), latency_quantile(&h, 0.99));
+      log_info3("latency: %-13s max=%lluus", NAMES[i], h.max_us);
+    }
+  }
+}
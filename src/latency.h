@@ -0,0 +1,83 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __LATENCY__HOD
+#define __LATENCY__HOD
+
+/*
+ * Latency histograms of the file system operations and of the phases
+ * they go through. Buckets are log-linear, HDR style: 16 per power of
+ * two of microseconds, so any value is within 1/16 of its bucket.
+ *
+ * A thread keeps the time an operation spent in each phase. When the
+ * operation takes longer than the slow threshold, that breakdown is
+ * logged.
+ *
+ * When disabled, latency_start() returns 0 without reading the clock
+ * and everything given a 0 start returns at once.
+ */
+
+enum {
+  LAT_GETATTR = 0,    // operations
+  LAT_READDIR,
+  LAT_OPEN,
+  LAT_READ,
+  LAT_RELEASE,
+  LAT_CLASSIFY,       // phases
+  LAT_CUE_PARSE,
+  LAT_MONITOR_WAIT,
+  LAT_SCHED_WAIT,
+  LAT_INFLIGHT_WAIT,
+  LAT_SPLIT_LOCK,
+  LAT_SPLIT,
+  LAT_RETAG,
+  LAT_SEGMENT_READ,
+  LAT_COUNT
+};
+
+#define LAT_FIRST_PHASE LAT_CLASSIFY
+
+#define LAT_SUB_BITS  4
+#define LAT_SUB       (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS   (40 * LAT_SUB)    // up to 2^40us, 12 days
+
+typedef struct {
+  unsigned long counts[LAT_BUCKETS];
+  unsigned long count;
+  unsigned long long sum_us;
+  unsigned long long max_us;
+} latency_hist_t;
+
+void latency_configure(int enabled, int slow_ms);
+void latency_init(void);
+void latency_destroy(void);
+int latency_enabled(void);
+
+unsigned long long latency_start(void);
+void latency_phase(int phase, unsigned long long t0);
+void latency_op_begin(void);
+void latency_op_end(int op, unsigned long long t0, const char *path);
+
+const char *latency_name(int which);
+void latency_snapshot(int which, latency_hist_t * h);
+unsigned long long latency_quantile(latency_hist_t * h, double q);
+unsigned long latency_below(latency_hist_t * h, unsigned long long us);
+void latency_report(void);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+// fopencookie() and cookie_io_functions_t are GNU extensions
+#define _GNU_SOURCE
+
+#include "logger.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#define ALLOC_TAG ALLOC_LOG
+#include "allocprof.h"
+
+typedef struct ring_s {
+  char *buf;
+  unsigned long size;         // power of 2
+  unsigned long head;         // written by the owner
+  unsigned long tail;         // written by the drain thread
+  int closed;                 // the owner is gone
+  FILE *f;
+  struct ring_s *next;
+} ring_t;
+
+static const int LEVELS[] = { LOG_DEBUG, LOG_INFO, LOG_ERROR };
+static const char *LEVEL_NAMES[] = { "debug", "info", "error" };
+#define NLEVELS ((int) (sizeof(LEVELS) / sizeof(LEVELS[0])))
+
+static char *FILE_NAME = NULL;
+static volatile int LEVEL = LOG_INFO;
+static unsigned long RING_SIZE = 64 * 1024;
+
+static int FD = -1;
+static pthread_mutex_t FD_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t KEY;
+static pthread_once_t KEY_ONCE = PTHREAD_ONCE_INIT;
+static pthread_mutex_t RINGS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static ring_t *RINGS = NULL;
+
+static pthread_t DRAIN;
+static pthread_mutex_t DRAIN_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t DRAIN_COND = PTHREAD_COND_INITIALIZER;
+static int RUNNING = 0;
+static int STOP = 0;
+static int WOKEN = 0;
+static unsigned long DROPPED = 0;
+
+/**********************************************************************/
+
+// Must be called with FD_MUTEX held
+static int log_fd(void)
+{
+  if (FD < 0) {
+    FD = open((FILE_NAME == NULL) ? "/tmp/mp3cue.log" : FILE_NAME,
+              O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  }
+  return FD;
+}
+
+static void write_direct(const char *data, size_t size)
+{
+  pthread_mutex_lock(&FD_MUTEX);
+  int fd = log_fd();
+  if (fd >= 0 && write(fd, data, size) < 0) {
+    // nowhere to complain
+  }
+  pthread_mutex_unlock(&FD_MUTEX);
+}
+
+static ssize_t ring_write(void *cookie, const char *data, size_t size)
+{
+  ring_t *r = (ring_t *) cookie;
+  if (!__atomic_load_n(&RUNNING, __ATOMIC_ACQUIRE)) {
+    write_direct(data, size);
+    return size;
+  }
+  unsigned long head = r->head;
+  unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (size > r->size - (head - tail)) {
+    __atomic_fetch_add(&DROPPED, 1, __ATOMIC_RELAXED);
+    return size;
+  }
+  unsigned long at = head & (r->size - 1);
+  unsigned long first = r->size - at;
+  if (first > size) {
+    first = size;
+  }
+  memcpy(r->buf + at, data, first);
+  memcpy(r->buf, data + first, size - first);
+  __atomic_store_n(&r->head, head + size, __ATOMIC_RELEASE);
+  // Past half full, don't wait for the next tick. Signalling without
+  // the mutex may go unnoticed; then the tick comes soon enough.
+  if (head + size - tail > r->size / 2 && !__atomic_exchange_n(&WOKEN, 1, __ATOMIC_RELAXED)) {
+    pthread_cond_signal(&DRAIN_COND);
+  }
+  return size;
+}
+
+#ifdef __APPLE__
+static int ring_write_fn(void *cookie, const char *data, int size)
+{
+  return (int)ring_write(cookie, data, size);
+}
+#endif
+
+static int ring_close(void *cookie)
+{
+  ring_t *r = (ring_t *) cookie;
+  __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void thread_exit(void *f)
+{
+  fclose((FILE *) f);
+}
+
+static void make_key(void)
+{
+  pthread_key_create(&KEY, thread_exit);
+}
+
+static FILE *open_ring(ring_t * r)
+{
+#ifdef __APPLE__
+  return funopen(r, NULL, ring_write_fn, NULL, ring_close);
+#else
+  cookie_io_functions_t io = { NULL, ring_write, NULL, ring_close };
+  return fopencookie(r, "w", io);
+#endif
+}
+
+// Writes the complete lines in r. Returns 1 when r can go.
+static int drain(ring_t * r, int all)
+{
+  int closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+  unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  unsigned long tail = r->tail;
+  unsigned long end = head;
+  if (!all && !closed) {
+    while (end > tail && r->buf[(end - 1) & (r->size - 1)] != '\n') {
+      end--;
+    }
+  }
+  if (end > tail) {
+    unsigned long at = tail & (r->size - 1);
+    unsigned long n = end - tail;
+    struct iovec iov[2];
+    int cnt = 1;
+    iov[0].iov_base = r->buf + at;
+    iov[0].iov_len = (at + n > r->size) ? r->size - at : n;
+    if (iov[0].iov_len < n) {
+      iov[1].iov_base = r->buf;
+      iov[1].iov_len = n - iov[0].iov_len;
+      cnt = 2;
+    }
+    pthread_mutex_lock(&FD_MUTEX);
+    int fd = log_fd();
+    if (fd >= 0 && writev(fd, iov, cnt) < 0) {
+      // dropped
+    }
+    pthread_mutex_unlock(&FD_MUTEX);
+    __atomic_store_n(&r->tail, end, __ATOMIC_RELEASE);
+  }
+  return closed && end == head;
+}
+
+static void drain_all(int all)
+{
+  pthread_mutex_lock(&RINGS_MUTEX);
+  ring_t **p = &RINGS;
+  while (*p != NULL) {
+    ring_t *r = *p;
+    if (drain(r, all)) {
+      *p = r->next;
+      mc_free(r->buf);
+      mc_free(r);
+    } else {
+      p = &r->next;
+    }
+  }
+  pthread_mutex_unlock(&RINGS_MUTEX);
+}
+
+static void *drain_thread(void *data)
+{
+  unsigned long reported = 0;
+  pthread_mutex_lock(&DRAIN_MUTEX);
+  while (!__atomic_load_n(&STOP, __ATOMIC_ACQUIRE)) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100 * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&DRAIN_COND, &DRAIN_MUTEX, &ts);
+    __atomic_store_n(&WOKEN, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&DRAIN_MUTEX);
+    drain_all(0);
+    unsigned long dropped = __atomic_load_n(&DROPPED, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+      char line[100];
+      int n = snprintf(line, sizeof(line), "logger: %lu lines dropped\n", dropped - reported);
+      write_direct(line, n);
+      reported = dropped;
+    }
+    pthread_mutex_lock(&DRAIN_MUTEX);
+  }
+  pthread_mutex_unlock(&DRAIN_MUTEX);
+  return NULL;
+}
+
+/**********************************************************************/
+
+void logger_configure(const char *file, int level, int ring_size)
+{
+  if (file != NULL) {
+    mc_free(FILE_NAME);
+    FILE_NAME = mc_strdup(file);
+  }
+  LEVEL = level;
+  unsigned long n = 4096;
+  while (n < (unsigned long)ring_size) {
+    n *= 2;
+  }
+  RING_SIZE = n;
+}
+
+// Call after fuse_main() has forked
+int logger_start(void)
+{
+  __atomic_store_n(&STOP, 0, __ATOMIC_RELEASE);
+  if (pthread_create(&DRAIN, NULL, drain_thread, NULL) != 0) {
+    log_error("logger: cannot start, logging directly");
+    return -1;
+  }
+  __atomic_store_n(&RUNNING, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void logger_stop(void)
+{
+  if (!__atomic_load_n(&RUNNING, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  __atomic_store_n(&RUNNING, 0, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&DRAIN_MUTEX);
+  __atomic_store_n(&STOP, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&DRAIN_COND);
+  pthread_mutex_unlock(&DRAIN_MUTEX);
+  pthread_join(DRAIN, NULL);
+  drain_all(1);
+}
+
+FILE *logger_handle(void)
+{
+  pthread_once(&KEY_ONCE, make_key);
+  FILE *f = (FILE *) pthread_getspecific(KEY);
+  if (f == NULL) {
+    ring_t *r = (ring_t *) mc_malloc(sizeof(ring_t));
+    memset(r, 0, sizeof(ring_t));
+    r->size = RING_SIZE;
+    r->buf = (char *)mc_malloc(r->size);
+    f = open_ring(r);
+    if (f == NULL) {
+      mc_free(r->buf);
+      mc_free(r);
+      return stderr;
+    }
+    setvbuf(f, NULL, _IOLBF, 0);
+    r->f = f;
+    pthread_setspecific(KEY, f);
+    pthread_mutex_lock(&RINGS_MUTEX);
+    r->next = RINGS;
+    RINGS = r;
+    pthread_mutex_unlock(&RINGS_MUTEX);
+  }
+  return f;
+}
+
+int logger_level(void)
+{
+  return LEVEL;
+}
+
+void logger_set_level(int level)
+{
+  LEVEL = level;
+}
+
+static int level_index(void)
+{
+  int i;
+  for (i = 0; i < NLEVELS - 1 && LEVELS[i] < LEVEL; i++) ;
+  return i;
+}
+
+// These two are called from signal handlers
+void logger_more_verbose(void)
+{
+  int i = level_index();
+  LEVEL = LEVELS[(i > 0) ? i - 1 : 0];
+}
+
+void logger_less_verbose(void)
+{
+  int i = level_index();
+  LEVEL = LEVELS[(i < NLEVELS - 1) ? i + 1 : i];
+}
+
+int logger_parse_level(const char *name)
+{
+  int i;
+  for (i = 0; i < NLEVELS; i++) {
+    if (strcasecmp(name, LEVEL_NAMES[i]) == 0) {
+      return LEVELS[i];
+    }
+  }
+  return -1;
+}
+
+const char *logger_level_name(int level)
+{
+  int i;
+  for (i = 0; i < NLEVELS; i++) {
+    if (LEVELS[i] == level) {
+      return LEVEL_NAMES[i];
+    }
+  }
+  return "?";
+}
+
+unsigned long logger_dropped(void)
+{
+  return DROPPED;
+}
@@ -0,0 +1,52 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __LOGGER__HOD
+#define __LOGGER__HOD
+
+#include <stdio.h>
+
+/*
+ * Backend of the elementals log macros, through log_handle() and
+ * log_this_severity(). Below the current level nothing is formatted.
+ * Every thread writes into a ring buffer of its own through a FILE
+ * that is line buffered, so a log line costs a memcpy; a background
+ * thread writes whole lines to the log file. When a ring is full the
+ * line is dropped and counted, a thread never waits for the disk.
+ *
+ * Before logger_start() and after logger_stop() lines are written
+ * to the file directly.
+ */
+
+void logger_configure(const char *file, int level, int ring_size);
+int logger_start(void);
+void logger_stop(void);
+
+FILE *logger_handle(void);
+
+int logger_level(void);
+void logger_set_level(int level);
+void logger_more_verbose(void);
+void logger_less_verbose(void);
+int logger_parse_level(const char *name);   // -1 if unknown
+const char *logger_level_name(int level);
+
+unsigned long logger_dropped(void);
+
+#endif
@@ -0,0 +1,422 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "membudget.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#define CGROUP_SHARE  90      // percent of the cgroup limit we plan with
+#define MIN_SCALE     25      // percent, the budget never goes below
+#define SEGMENT_FLOOR 25      // percent of the budget segments always get
+#define GROW_AFTER    10      // seconds without pressure before a step up
+#define GROW_STEP     10
+#define PSI_TRIGGER   "some 150000 2000000"   // stalled 150ms in 2s
+
+static unsigned long CONFIGURED = 200UL * 1024 * 1024;
+static unsigned long CGROUP = 0;
+static char PSI_PATH[PATH_MAX] = "";
+
+// Written by the budget thread, read by everybody, atomically
+static int SCALE = 100;
+static unsigned long RSS = 0;
+static unsigned long SEGMENTS = 0;
+static unsigned long EVENTS = 0;
+static unsigned long SHRINKS = 0;
+static int EXHAUSTED = 0;
+
+static membudget_usage_fn SEGMENT_USAGE = NULL;
+static membudget_shrink_fn SHRINK = NULL;
+
+static int PSI_FD = -1;
+static int WAKE[2] = { -1, -1 };
+static int RUNNING = 0;
+static pthread_t THREAD;
+
+/**********************************************************************/
+
+static int running(void)
+{
+  return __atomic_load_n(&RUNNING, __ATOMIC_ACQUIRE);
+}
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long resident_size(void)
+{
+  unsigned long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%lu %lu", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(f);
+  return resident * (unsigned long)sysconf(_SC_PAGESIZE);
+}
+
+static unsigned long limit(void)
+{
+  unsigned long l = __atomic_load_n(&CONFIGURED, __ATOMIC_RELAXED);
+  if (CGROUP > 0 && CGROUP / 100 * CGROUP_SHARE < l) {
+    l = CGROUP / 100 * CGROUP_SHARE;
+  }
+  return l / 100 * __atomic_load_n(&SCALE, __ATOMIC_RELAXED);
+}
+
+/**********************************************************************
+ Finding our cgroup and its limit
+*/
+
+static int has_word(const char *list, const char *word)
+{
+  int l = strlen(word);
+  const char *p = list;
+  while ((p = strstr(p, word)) != NULL) {
+    if ((p == list || p[-1] == ',') && (p[l] == ',' || p[l] == '\0')) {
+      return 1;
+    }
+    p += l;
+  }
+  return 0;
+}
+
+// Our path in the v2 hierarchy, or in the v1 one of the memory controller
+static int cgroup_path(int v2, char *path)
+{
+  char line[PATH_MAX + 64];
+  int found = 0;
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    char *c1 = strchr(line, ':');
+    char *c2 = (c1 == NULL) ? NULL : strchr(c1 + 1, ':');
+    if (c2 == NULL) {
+      continue;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    *c2 = '\0';
+    if ((v2 && strcmp(line, "0:") == 0) || (!v2 && has_word(c1 + 1, "memory"))) {
+      strncpy(path, c2 + 1, PATH_MAX - 1);
+      path[PATH_MAX - 1] = '\0';
+      found = 1;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+// Where that hierarchy is mounted, and which of its paths is the root
+// of the mount
+static int cgroup_mount(int v2, char *mnt, char *root)
+{
+  char line[2 * PATH_MAX + 256], type[64], super[256];
+  int found = 0;
+  FILE *f = fopen("/proc/self/mountinfo", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    char *sep = strstr(line, " - ");
+    if (sep == NULL || sscanf(line, "%*s %*s %*s %4095s %4095s", root, mnt) != 2) {
+      continue;
+    }
+    super[0] = '\0';
+    if (sscanf(sep + 3, "%63s %*s %255s", type, super) < 1) {
+      continue;
+    }
+    found = (v2 && strcmp(type, "cgroup2") == 0) ||
+            (!v2 && strcmp(type, "cgroup") == 0 && has_word(super, "memory"));
+  }
+  fclose(f);
+  return found;
+}
+
+static unsigned long read_limit(const char *dir, const char *file)
+{
+  char path[PATH_MAX + 32], value[64];
+  unsigned long l = 0;
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  if (fscanf(f, "%63s", value) == 1 && strcmp(value, "max") != 0) {
+    l = strtoul(value, NULL, 10);
+    // v1 says "no limit" with a number near 2^63
+    if (l >= (1UL << 60)) {
+      l = 0;
+    }
+  }
+  fclose(f);
+  return l;
+}
+
+// The lowest limit of our cgroup and its ancestors, 0 if there is none.
+// Remembers where a v2 cgroup keeps its pressure file.
+static unsigned long cgroup_limit(void)
+{
+  char path[PATH_MAX], mnt[PATH_MAX], root[PATH_MAX], dir[2 * PATH_MAX];
+  unsigned long lowest = 0;
+  int v2;
+  for (v2 = 1; v2 >= 0 && lowest == 0; v2--) {
+    if (!cgroup_path(v2, path) || !cgroup_mount(v2, mnt, root)) {
+      continue;
+    }
+    const char *rel = path;
+    int rl = strlen(root);
+    if (strcmp(root, "/") != 0 && strncmp(path, root, rl) == 0) {
+      rel = path + rl;
+    }
+    snprintf(dir, sizeof(dir), "%s%s", mnt, (strcmp(rel, "/") == 0) ? "" : rel);
+    if (v2) {
+      snprintf(PSI_PATH, sizeof(PSI_PATH), "%s/memory.pressure", dir);
+    }
+    int ml = strlen(mnt);
+    for (;;) {
+      unsigned long l = read_limit(dir, v2 ? "memory.max" : "memory.limit_in_bytes");
+      if (l > 0 && (lowest == 0 || l < lowest)) {
+        lowest = l;
+      }
+      char *slash = strrchr(dir, '/');
+      if (slash == NULL || slash - dir < ml) {
+        break;
+      }
+      *slash = '\0';
+    }
+  }
+  return lowest;
+}
+
+static int psi_open(const char *path)
+{
+  int fd = open(path, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    return -1;
+  }
+  if (write(fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  log_info2("membudget: memory pressure from %s", path);
+  return fd;
+}
+
+/**********************************************************************/
+
+static void sample(void)
+{
+  __atomic_store_n(&SEGMENTS, SEGMENT_USAGE(), __ATOMIC_RELAXED);
+  __atomic_store_n(&RSS, resident_size(), __ATOMIC_RELAXED);
+}
+
+// The resident size of everything but the segments
+static unsigned long other(void)
+{
+  unsigned long rss = __atomic_load_n(&RSS, __ATOMIC_RELAXED);
+  unsigned long segments = __atomic_load_n(&SEGMENTS, __ATOMIC_RELAXED);
+  return (rss > segments) ? rss - segments : 0;
+}
+
+// Whether the rest of the process leaves the segments less than their floor
+static int exhausted(void)
+{
+  unsigned long l = limit();
+  return other() + l / 100 * SEGMENT_FLOOR > l;
+}
+
+static void shrink(int all)
+{
+  SHRINK(membudget_segment_limit(), all);
+  __atomic_fetch_add(&SHRINKS, 1, __ATOMIC_RELAXED);
+#ifdef __GLIBC__
+  // give what was freed back to the system
+  if (all) {
+    malloc_trim(0);
+  }
+#endif
+  __atomic_store_n(&SEGMENTS, SEGMENT_USAGE(), __ATOMIC_RELAXED);
+}
+
+static void *budget_thread(void *data)
+{
+  double last_change = now_s(), last_drop = 0.0;
+  sample();
+  while (running()) {
+    struct pollfd p[2];
+    int n = 0, pressure = 0;
+    p[n].fd = WAKE[0];
+    p[n++].events = POLLIN;
+    if (PSI_FD >= 0) {
+      p[n].fd = PSI_FD;
+      p[n++].events = POLLPRI;
+    }
+    int r = poll(p, n, 1000);
+    if (!running()) {
+      break;
+    }
+    if (r > 0 && n > 1) {
+      if (p[1].revents & POLLERR) {
+        log_error("membudget: pressure notifications stopped");
+        close(PSI_FD);
+        __atomic_store_n(&PSI_FD, -1, __ATOMIC_RELAXED);
+      } else if (p[1].revents & POLLPRI) {
+        pressure = 1;
+      }
+    }
+
+    sample();
+    double now = now_s();
+    int scale = __atomic_load_n(&SCALE, __ATOMIC_RELAXED);
+    if (pressure) {
+      __atomic_fetch_add(&EVENTS, 1, __ATOMIC_RELAXED);
+      if (scale > MIN_SCALE) {
+        scale = (scale * 3 / 4 < MIN_SCALE) ? MIN_SCALE : scale * 3 / 4;
+        log_info2("membudget: memory pressure, budget down to %d%%", scale);
+      }
+      last_change = now;
+    } else if (scale < 100 && now - last_change >= GROW_AFTER) {
+      scale = (scale + GROW_STEP > 100) ? 100 : scale + GROW_STEP;
+      log_info2("membudget: no memory pressure, budget up to %d%%", scale);
+      last_change = now;
+    }
+    __atomic_store_n(&SCALE, scale, __ATOMIC_RELAXED);
+
+    int over = exhausted();
+    if (over != __atomic_load_n(&EXHAUSTED, __ATOMIC_RELAXED)) {
+      if (over) {
+        log_error3("membudget: %luMB used besides the segments, the budget of %luMB is exhausted; raise -m",
+                   other() >> 20, limit() >> 20);
+      } else {
+        log_info("membudget: back within the budget");
+      }
+      __atomic_store_n(&EXHAUSTED, over, __ATOMIC_RELAXED);
+    }
+    // While exhausted, the other caches are dropped now and then, not
+    // every second, so they still save some work
+    int all = pressure || (over && now - last_drop >= GROW_AFTER);
+    if (all || __atomic_load_n(&SEGMENTS, __ATOMIC_RELAXED) > membudget_segment_limit()) {
+      shrink(all);
+      last_drop = all ? now : last_drop;
+    }
+  }
+  return NULL;
+}
+
+/**********************************************************************/
+
+void membudget_configure(int limit_in_mb)
+{
+  // may be changed through the control file while the thread runs
+  __atomic_store_n(&CONFIGURED, (unsigned long)limit_in_mb * 1024 * 1024, __ATOMIC_RELAXED);
+}
+
+void membudget_start(membudget_usage_fn segments, membudget_shrink_fn shrink)
+{
+  SEGMENT_USAGE = segments;
+  SHRINK = shrink;
+  CGROUP = cgroup_limit();
+  if (CGROUP > 0) {
+    log_info3("membudget: cgroup allows %luMB, planning with %d%% of it", CGROUP >> 20, CGROUP_SHARE);
+  }
+  PSI_FD = (PSI_PATH[0] != '\0') ? psi_open(PSI_PATH) : -1;
+  if (PSI_FD < 0) {
+    PSI_FD = psi_open("/proc/pressure/memory");
+  }
+  if (pipe(WAKE) != 0) {
+    log_error("membudget: cannot make a pipe, no budget thread");
+    return;
+  }
+  RUNNING = 1;
+  if (pthread_create(&THREAD, NULL, budget_thread, NULL) != 0) {
+    log_error("membudget: cannot start the budget thread");
+    RUNNING = 0;
+  }
+}
+
+void membudget_stop(void)
+{
+  if (running()) {
+    __atomic_store_n(&RUNNING, 0, __ATOMIC_RELEASE);
+    if (write(WAKE[1], "x", 1) < 0) {
+      // the thread notices within a second anyway
+    }
+    pthread_join(THREAD, NULL);
+  }
+  if (WAKE[0] >= 0) {
+    close(WAKE[0]);
+    close(WAKE[1]);
+    WAKE[0] = WAKE[1] = -1;
+  }
+  if (PSI_FD >= 0) {
+    close(PSI_FD);
+    PSI_FD = -1;
+  }
+}
+
+// What the segment cache may hold: the budget less everything else, and
+// at least the floor, so tracks can still be opened when the rest of the
+// process has taken the budget
+unsigned long membudget_segment_limit(void)
+{
+  unsigned long l = limit();
+  unsigned long rest = other();
+  unsigned long floor = l / 100 * SEGMENT_FLOOR;
+  return (l > rest + floor) ? l - rest : floor;
+}
+
+void membudget_stats(membudget_stats_t * out)
+{
+  out->limit = limit();
+  out->configured = __atomic_load_n(&CONFIGURED, __ATOMIC_RELAXED);
+  out->cgroup = CGROUP;
+  out->rss = __atomic_load_n(&RSS, __ATOMIC_RELAXED);
+  out->segments = __atomic_load_n(&SEGMENTS, __ATOMIC_RELAXED);
+  out->other = (out->rss > out->segments) ? out->rss - out->segments : 0;
+  out->scale_percent = __atomic_load_n(&SCALE, __ATOMIC_RELAXED);
+  out->psi = (__atomic_load_n(&PSI_FD, __ATOMIC_RELAXED) >= 0);
+  out->exhausted = __atomic_load_n(&EXHAUSTED, __ATOMIC_RELAXED);
+  out->pressure_events = __atomic_load_n(&EVENTS, __ATOMIC_RELAXED);
+  out->shrinks = __atomic_load_n(&SHRINKS, __ATOMIC_RELAXED);
+}
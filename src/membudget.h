@@ -0,0 +1,69 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __MEMBUDGET__HOD
+#define __MEMBUDGET__HOD
+
+/*
+ * One memory budget for the whole process. The limit is the configured
+ * one (-m), or what the cgroup allows if that is less: memory.max of
+ * cgroup v2 and its ancestors, memory.limit_in_bytes of v1, of which
+ * 90% is used to leave room for the page cache and stacks.
+ *
+ * Everything that isn't the segment cache is measured together as the
+ * resident size of the process less the segments, so the data table,
+ * size cache, parsed cue sheets, interned strings, listings and the
+ * allocator's slack all count. The segment cache gets what is left,
+ * but never less than a quarter of the budget. When the rest takes
+ * more than that leaves, the budget is exhausted: a warning is logged
+ * and the caches that can be rebuilt are dropped too.
+ *
+ * A thread samples the resident size once a second and waits for
+ * memory pressure notifications (PSI, the cgroup's memory.pressure or
+ * /proc/pressure/memory). Every notification scales the budget down a
+ * step and has all caches shrunk to it; when there has been no
+ * pressure for a while it grows back a step at a time.
+ */
+
+typedef unsigned long (*membudget_usage_fn) (void);
+// all is set under pressure or when the budget is exhausted
+typedef void (*membudget_shrink_fn) (unsigned long limit, int all);
+
+typedef struct {
+  unsigned long limit;          // with the pressure scale applied
+  unsigned long configured;
+  unsigned long cgroup;         // 0 when there is no cgroup limit
+  unsigned long rss;
+  unsigned long segments;
+  unsigned long other;          // rss less segments
+  int scale_percent;
+  int psi;                      // pressure notifications are on
+  int exhausted;                // the rest leaves segments only the floor
+  unsigned long pressure_events;
+  unsigned long shrinks;
+} membudget_stats_t;
+
+void membudget_configure(int limit_in_mb);
+void membudget_start(membudget_usage_fn segments, membudget_shrink_fn shrink);
+void membudget_stop(void);
+
+unsigned long membudget_segment_limit(void);
+void membudget_stats(membudget_stats_t * out);
+
+#endif
@@ -29,10 +29,29 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <signal.h>
 
 #include "cue.h"
 #include "segmenter.h"
+#include "watcher.h"
+#include "dircache.h"
+#include "negcache.h"
+#include "scheduler.h"
+#include "inflight.h"
+#include "failcache.h"
+#include "cuecache.h"
+#include "crawler.h"
+#include "intern.h"
+#include "strtable.h"
+#include "stats.h"
+#include "control.h"
+#include "latency.h"
+#include "logger.h"
+#include "trace.h"
+#include "membudget.h"
+#include "prefetch.h"
 #include "../version.h"
 
 #include <elementals/hash.h>
@@ -40,6 +59,7 @@
 #include <elementals/list.h>
 #include <elementals/memcheck.h>
 #include <elementals/os.h>
+#include "allocprof.h"
 
 #define MKR(st,A) if (st.st_mode&A) { log_debug("modeadjust");st.st_mode-=A; }
 #define MK_READONLY(st) MKR(st,S_IWUSR);MKR(st,S_IWGRP);MKR(st,S_IWOTH);
@@ -53,13 +73,58 @@
 /***********************************************************************/
 
 static char* BASEDIR;
-static int MAX_MEM_USAGE_IN_MB = 200;
+static int MAX_MEM_USAGE_IN_MB = 200;  // for the whole process, see membudget.h
+
+// Kernel attribute and entry cache timeouts (seconds). Cue sheet edits
+// become visible to clients at most this long after they happen.
+static double ATTR_TIMEOUT = 30.0;
+static double ENTRY_TIMEOUT = 30.0;
+
+// Change detection; with the watcher running the hot paths don't stat()
+static int WATCH_LIMIT = 8192;
+static int SCAN_INTERVAL = 10;
+
+// Misses are remembered by us and, for NEGATIVE_TIMEOUT, by the kernel
+static double NEGATIVE_TIMEOUT = 10.0;
+static int NEGATIVE_SLOTS = 4096;
+
+// Split work admission. More than one worker only when segmenter.c is
+// built without GARD_WITH_MUTEX, see split_workers().
+static int WORKERS = 1;
+static int SPLIT_TIMEOUT = 120;
+static int FAIL_BACKOFF = 30;
+static int FAIL_MAX_BACKOFF = 3600;
+
+// Background crawl of the library at mount time
+static int CRAWL = false;
+static int CRAWL_THREADS = 2;
+static int CRAWL_SIZES = true;
+
+// Latency histograms, operations slower than SLOW_OP_MS are logged
+static int LATENCY = true;
+static int SLOW_OP_MS = 1000;
+
+// Logging, the level can be changed with SIGUSR1 and SIGUSR2
+static char* LOG_FILE = "/tmp/mp3cue.log";
+static int LOG_LEVEL = LOG_INFO;
+
+// Binary trace of all operations, for the replayer
+static char* TRACE_FILE = NULL;
+
+// Where the size cache is kept between mounts, set by main()
+static char SIZES_FILE[1024] = "";
 
 /***********************************************************************/
 
 int usage(char* p)
 {
-  fprintf(stderr, "%s [--memory|m maxMB] <cue directory> <mountpoint> [fuse options]\n", p);
+  fprintf(stderr, "%s [--memory|m maxMB] [--attr-timeout secs] [--entry-timeout secs] "
+                  "[--watch-limit n] [--scan-interval secs] [--negative-timeout secs] [--negative-slots n] "
+                  "[--workers n] [--size-queue n] [--prefetch-queue n] [--split-timeout secs] "
+                  "[--fail-backoff secs] [--fail-max-backoff secs] "
+                  "[--crawl] [--crawl-threads n] [--crawl-no-sizes] "
+                  "[--no-latency] [--slow-op ms] [--log-file file] [--log-level debug|info|error] [--trace file] "
+                  "<cue directory> <mountpoint> [fuse options]\n", p);
   return 1;
 }
 
@@ -79,44 +144,46 @@ static char* trim(const char* line)
 
 /***********************************************************************/
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_SIZE
+
+// Sizes of tracks by full path, for the cue mtime they were computed
+// for. Used inside the DE_MONITOR, and before fuse_main() starts.
 typedef struct {
+  const intern_t *vfile;
   size_t size;
   time_t mtime;
 } vfile_size_t;
 
-vfile_size_t *vfile_size_copy(vfile_size_t *e) {
-  vfile_size_t *fs=(vfile_size_t *) mc_malloc(sizeof(vfile_size_t));
-  fs->size=e->size;
-  fs->mtime=e->mtime;
-  return fs;
+static const intern_t *vfile_size_key(const void *item)
+{
+  return ((const vfile_size_t *) item)->vfile;
 }
 
-void vfile_size_destroy(hash_data_t d) {
-  log_debug("destroying size hash elem");
-  vfile_size_t *fs=(vfile_size_t *) d;
-  mc_free(fs);
+static void vfile_size_destroy(void *item)
+{
+  intern_release(((vfile_size_t *) item)->vfile);
+  mc_free(item);
 }
 
-DECLARE_HASH(vfilesize_hash, vfile_size_t);
-IMPLEMENT_HASH(vfilesize_hash, vfile_size_t, vfile_size_copy, vfile_size_destroy);
-
-static vfilesize_hash *SIZE_HASH = NULL;
+static strtable_t *SIZE_HASH = NULL;
 
 void put_size(const char* vfile, size_t size, time_t mtime) {
-  vfile_size_t *e = vfilesize_hash_get(SIZE_HASH, vfile);
-  if (e!=NULL) {
-    if (e->mtime != mtime) {
-      vfile_size_t e = { size, mtime };
-      vfilesize_hash_put(SIZE_HASH,vfile, &e);
-    }
-  } else {
-    vfile_size_t e = { size, mtime };
-    vfilesize_hash_put(SIZE_HASH,vfile, &e);
+  vfile_size_t *e = (vfile_size_t *) strtable_get(SIZE_HASH, vfile);
+  if (e == NULL) {
+    e = (vfile_size_t *) mc_malloc(sizeof(vfile_size_t));
+    e->vfile = intern(vfile);
+    e->size = size;
+    e->mtime = mtime;
+    strtable_put(SIZE_HASH, e);
+  } else if (e->mtime != mtime) {
+    e->size = size;
+    e->mtime = mtime;
   }
 }
 
 int has_size(const char* vfile, time_t mtime) {
-  vfile_size_t *e = vfilesize_hash_get(SIZE_HASH, vfile);
+  vfile_size_t *e = (vfile_size_t *) strtable_get(SIZE_HASH, vfile);
   if (e != NULL && e->mtime == mtime) {
     return 1;
   } else {
@@ -125,7 +192,7 @@ int has_size(const char* vfile, time_t mtime) {
 }
 
 size_t get_size(const char* vfile) {
-  vfile_size_t *e = vfilesize_hash_get(SIZE_HASH, vfile);
+  vfile_size_t *e = (vfile_size_t *) strtable_get(SIZE_HASH, vfile);
   if (e != NULL) {
     return e->size;
   } else {
@@ -177,30 +244,46 @@ void read_in_sizes(const char* from_file) {
   fclose(f);
 }
 
-void write_sizes(const char*  to_file) {
-  FILE *f = fopen(to_file, "wt");
+static void write_size(void *item, void *data) {
+  vfile_size_t *e = (vfile_size_t *) item;
+  fprintf((FILE *) data, "%s\n%lu\n%lu\n", e->vfile->str,
+              (unsigned long) e->size, (unsigned long) e->mtime );
+}
+
+// Writes a new file next to to_file and moves it over, so a crash
+// halfway doesn't lose the sizes. Returns 0 or a negative errno.
+int write_sizes(const char*  to_file) {
+  char tmp[1024];
+  snprintf(tmp, sizeof(tmp), "%s.new", to_file);
+  FILE *f = fopen(tmp, "wt");
+  if (f == NULL) {
+    int err = -errno;
+    log_error2("cannot write sizes to %s", tmp);
+    return err;
+  }
   fputs(VFILESIZE_FILE_TYPE /**/ "\n", f);
   fputs(VFILESIZE_FILE_VERSION /**/ "\n", f);
-  hash_iter_t it;
-  it = vfilesize_hash_iter(SIZE_HASH);
-  while (!vfilesize_hash_iter_end(it)) {
-    vfile_size_t *e = vfilesize_hash_get(SIZE_HASH, vfilesize_hash_iter_key(it) );
-    if (e != NULL) {
-      fprintf(f, "%s\n%lu\n%lu\n", vfilesize_hash_iter_key(it),
-                  (unsigned long) e->size, (unsigned long) e->mtime );
-    } else {
-      log_debug("Unexpected!");
-    }
-    it = vfilesize_hash_iter_next(it);
+  strtable_foreach(SIZE_HASH, write_size, f);
+  if (fclose(f) != 0 || rename(tmp, to_file) != 0) {
+    log_error2("cannot write sizes to %s", to_file);
+    unlink(tmp);
+    return -EIO;
   }
-  fclose(f);
+  return 0;
 }
 
 /***********************************************************************/
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_SEGMENT
+
+// The entry holds its own references on id and source, the segment may
+// outlive the cue sheet they came from
 typedef struct {
-  char* id;
+  const intern_t *id;       // audio, offsets and tags
+  const intern_t *source;   // audio and offsets
   segmenter_t *segment;
+  int stale;                // failed to split again, not found any more
 } seg_entry_t;
 
 list_data_t seg_entry_copy(seg_entry_t * e)
@@ -212,8 +295,9 @@ void seg_entry_destroy(list_data_t _e)
 {
   log_debug("destroying segment");
   seg_entry_t *e = (seg_entry_t *) _e;
-  mc_free(e->id);
   segmenter_destroy(e->segment);
+  intern_release(e->id);
+  intern_release(e->source);
   mc_free(e);
 }
 
@@ -222,47 +306,160 @@ IMPLEMENT_LIST(seglist, seg_entry_t, seg_entry_copy, seg_entry_destroy);
 
 static list_t *SEGMENT_LIST = NULL;
 
-void add_seg_entry(cue_entry_t * e, segmenter_t * s)
+// Segments of pinned tracks aren't evicted, whatever their tags, as long
+// as they take at most PIN_SHARE percent of what segments may use.
+// Keyed by source; unpinned entries are kept, like in the failcache.
+// Guarded by the segment list lock.
+#define PIN_SHARE 50
+
+typedef struct {
+  int pinned;
+} pin_t;
+
+static hash_data_t pin_copy(pin_t * e)
+{
+  pin_t *n = (pin_t *) mc_malloc(sizeof(pin_t));
+  memcpy(n, e, sizeof(pin_t));
+  return (hash_data_t) n;
+}
+
+static void pin_destroy(hash_data_t d)
+{
+  mc_free(d);
+}
+
+DECLARE_HASH(pinhash, pin_t);
+IMPLEMENT_HASH(pinhash, pin_t, pin_copy, pin_destroy);
+
+static pinhash *PINS = NULL;
+static int N_PINS = 0;
+
+static int pinned(const intern_t *source)
+{
+  pin_t *p = pinhash_get(PINS, source->str);
+  return p != NULL && p->pinned;
+}
+
+static void pin_segment(const intern_t *source, int pin)
 {
-  log_debug("lock segment list");
   seglist_lock(SEGMENT_LIST);
-  {
-    log_debug("first look if we need to destroy a segment");
-    seg_entry_t *se;
-    se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
-    double count_mb = 0.0;
-    while (se != NULL) {
-      count_mb += segmenter_size(se->segment) / (1024.0 * 1024.0);
-      se = seglist_next_iter(SEGMENT_LIST);
+  pin_t *p = pinhash_get(PINS, source->str);
+  if (p == NULL && pin) {
+    pin_t n = { false };
+    pinhash_put(PINS, source->str, &n);
+    p = pinhash_get(PINS, source->str);
+  }
+  if (p != NULL && p->pinned != pin) {
+    p->pinned = pin;
+    N_PINS += pin ? 1 : -1;
+  }
+  seglist_unlock(SEGMENT_LIST);
+}
+
+// Must be called with the segment list locked
+static unsigned long pinned_bytes(void)
+{
+  unsigned long total = 0;
+  seg_entry_t *se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
+  while (se != NULL) {
+    if (pinned(se->source)) {
+      total += segmenter_size(se->segment);
     }
-    log_debug("drop last ones as long we're above our memory limit");
-    int n = seglist_count(SEGMENT_LIST);
-    int k = 0;
-    while (((int)count_mb) > MAX_MEM_USAGE_IN_MB && k < 5) {
-      se = seglist_start_iter(SEGMENT_LIST, LIST_LAST);
-      if (se != NULL) {
-        if (!segmenter_stream(se->segment)) {
-          count_mb -= segmenter_size(se->segment) / (1024.0 * 1024.0);
-          seglist_drop_iter(SEGMENT_LIST);
-          k = 0;
-        } else {
-          seglist_move_iter(SEGMENT_LIST, LIST_FIRST);
-          k += 1;
+    se = seglist_next_iter(SEGMENT_LIST);
+  }
+  return total;
+}
+
+// Must be called with the segment list locked
+static unsigned long segment_bytes_locked(void)
+{
+  unsigned long total = 0;
+  seg_entry_t *se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
+  while (se != NULL) {
+    total += segmenter_size(se->segment);
+    se = seglist_next_iter(SEGMENT_LIST);
+  }
+  return total;
+}
+
+static unsigned long segment_bytes(void)
+{
+  seglist_lock(SEGMENT_LIST);
+  unsigned long total = segment_bytes_locked();
+  seglist_unlock(SEGMENT_LIST);
+  return total;
+}
+
+// Drops stale segments nobody reads, then the oldest segments that
+// aren't being read, split again or pinned until the rest fits in limit.
+// Pinned ones go too, oldest first, while they take more than their
+// share. Must be called with the segment list locked.
+static void evict_segments(unsigned long limit)
+{
+  unsigned long total = 0, pins = 0;
+  unsigned long pin_limit = membudget_segment_limit() / 100 * PIN_SHARE;
+  seg_entry_t *se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
+  while (se != NULL) {
+    if (se->stale && !segmenter_stream(se->segment) && !segmenter_busy(se->segment)) {
+      // nobody reads it any more, count again without it
+      seglist_drop_iter(SEGMENT_LIST);
+      se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
+      total = 0;
+      pins = 0;
+      continue;
+    }
+    total += segmenter_size(se->segment);
+    pins += pinned(se->source) ? segmenter_size(se->segment) : 0;
+    se = seglist_next_iter(SEGMENT_LIST);
+  }
+  // k counts the segments that were kept in a row; when all have been,
+  // there's nothing left to drop
+  int k = 0, n = seglist_count(SEGMENT_LIST);
+  while (total > limit && k < n) {
+    se = seglist_start_iter(SEGMENT_LIST, LIST_LAST);
+    if (se != NULL) {
+      int pin = pinned(se->source);
+      if (!segmenter_stream(se->segment) && !segmenter_busy(se->segment) && (!pin || pins > pin_limit)) {
+        if (pin) {
+          log_info3("%s evicted, pinned tracks take more than %d%% of the segments", se->id->str, PIN_SHARE);
+          pins -= segmenter_size(se->segment);
         }
+        total -= segmenter_size(se->segment);
+        stats_inc(STAT_EVICTIONS);
+        stats_add(STAT_EVICTED_BYTES, segmenter_size(se->segment));
+        seglist_drop_iter(SEGMENT_LIST);
+        n -= 1;
+        k = 0;
       } else {
-        count_mb = 0;
+        seglist_move_iter(SEGMENT_LIST, LIST_FIRST);
+        k += 1;
       }
+    } else {
+      total = 0;
     }
+  }
+}
+
+void add_seg_entry(const intern_t *id, const intern_t *source, segmenter_t * s)
+{
+  log_debug("lock segment list");
+  seglist_lock(SEGMENT_LIST);
+  {
+    log_debug("drop last ones as long we're above our memory budget");
+    evict_segments(membudget_segment_limit());
+    seg_entry_t *se;
     log_debug("add our segment on front");
     se = (seg_entry_t *) mc_malloc(sizeof(seg_entry_t));
-    se->id = cue_entry_alloc_id(e);
+    se->id = intern_ref(id);
+    se->source = intern_ref(source);
     se->segment = s;
+    se->stale = false;
     seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
     seglist_prepend_iter(SEGMENT_LIST, se);
   }
   log_debug("unlock segmentlist");
   seglist_unlock(SEGMENT_LIST);
-  {
+  if (log_this_severity(LOG_DEBUG)) {
     // report 
     seglist_lock(SEGMENT_LIST);
     int n = seglist_count(SEGMENT_LIST);
@@ -283,16 +480,15 @@ void add_seg_entry(cue_entry_t * e, segmenter_t * s)
   }
 }
 
-segmenter_t *find_seg_entry(cue_entry_t * e)
+// Ids are interned, they compare by pointer
+segmenter_t *find_seg_entry(const intern_t *id)
 {
-  char* id = cue_entry_alloc_id(e);
   seglist_lock(SEGMENT_LIST);
   seg_entry_t *se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
-  while (se != NULL && strcmp(se->id, id) != 0) {
+  while (se != NULL && (se->id != id || se->stale)) {
     se = seglist_next_iter(SEGMENT_LIST);
   }
-  log_debug3("found segment %p for id %s", se, id);
-  mc_free(id);
+  log_debug3("found segment %p for id %s", se, id->str);
   seglist_unlock(SEGMENT_LIST);
   if (se == NULL) {
     return NULL;
@@ -301,12 +497,47 @@ segmenter_t *find_seg_entry(cue_entry_t * e)
   }
 }
 
+// A segment of the same audio with other tags, to retag a copy of
+segmenter_t *find_seg_source(const intern_t *source)
+{
+  seglist_lock(SEGMENT_LIST);
+  seg_entry_t *se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
+  while (se != NULL && (se->source != source || se->stale || segmenter_busy(se->segment))) {
+    se = seglist_next_iter(SEGMENT_LIST);
+  }
+  seglist_unlock(SEGMENT_LIST);
+  return (se == NULL) ? NULL : se->segment;
+}
+
+// A segment that failed to split again no longer matches its audio. It
+// isn't found any more, so the next open is a miss; tracks that have it
+// open keep reading its old bytes until they close it.
+static void retire_seg_entry(segmenter_t *s)
+{
+  seglist_lock(SEGMENT_LIST);
+  seg_entry_t *se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
+  while (se != NULL && se->segment != s) {
+    se = seglist_next_iter(SEGMENT_LIST);
+  }
+  if (se != NULL && (segmenter_stream(s) || segmenter_busy(s))) {
+    se->stale = true;
+  } else if (se != NULL) {
+    seglist_drop_iter(SEGMENT_LIST);
+  }
+  seglist_unlock(SEGMENT_LIST);
+}
+
 /***********************************************************************/
 
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_DATA
+
 pthread_mutex_t DATA_ENTRY_MONITOR=PTHREAD_MUTEX_INITIALIZER;
 
 void enter_de_monitor() {
+  unsigned long long t0 = latency_start();
   pthread_mutex_lock(&DATA_ENTRY_MONITOR);
+  latency_phase(LAT_MONITOR_WAIT, t0);
 }
 
 void leave_de_monitor() {
@@ -316,18 +547,29 @@ void leave_de_monitor() {
 #define DE_MONITOR(code) enter_de_monitor();code;leave_de_monitor()
 
 typedef struct {
-  cue_entry_t *entry;
-  char* path;
+  const intern_t *key;  // path in the mount, the key in DATA
+  cue_entry_t *entry;   // in a shared cue sheet, which we hold a reference on
+  const intern_t *path; // full path
   struct stat *st;
+  time_t size_mtime;    // st->st_size is valid for this cue mtime, -1 if unknown
   int open_count;
+  int content_changed;  // segment bytes changed since the kernel last cached them
+  unsigned long cue_stamp;    // watcher stamps seen at the last stat()
+  unsigned long audio_stamp;
 } data_entry_t;
 
-static data_entry_t *mydata_entry_new(const char* path, cue_entry_t * entry, struct stat *st)
+static data_entry_t *mydata_entry_new(const char* key, const char* path, cue_entry_t * entry, struct stat *st)
 {
   data_entry_t *e = (data_entry_t *) mc_malloc(sizeof(data_entry_t));
-  e->path = mc_strdup(path);
+  e->key = intern(key);
+  e->path = intern(path);
+  e->size_mtime = (time_t) -1;
   e->entry = entry;
+  cuecache_ref(cue_entry_sheet(entry));
   e->open_count = 0;
+  e->content_changed = false;
+  e->cue_stamp = 0;
+  e->audio_stamp = 0;
 
   if (st != NULL) {
     struct stat *stn = (struct stat *)mc_malloc(sizeof(struct stat));
@@ -340,53 +582,41 @@ static data_entry_t *mydata_entry_new(const char* path, cue_entry_t * entry, str
   return e;
 }
 
-#define data_entry_new(p,e,s) (data_entry_t *) mc_take_over(mydata_entry_new(p,e,s))
+#define data_entry_new(k,p,e,s) (data_entry_t *) mc_take_over(mydata_entry_new(k,p,e,s))
 
 static void data_entry_destroy(data_entry_t * e)
 {
   log_debug2("Destroying cue entry %s", cue_entry_title(e->entry));
-  cue_entry_destroy(e->entry);
-  mc_free(e->path);
+  cuecache_release(cue_entry_sheet(e->entry));
+  intern_release(e->key);
+  intern_release(e->path);
   mc_free(e->st);
   mc_free(e);
 }
 
-static hash_data_t data_copy(data_entry_t * e)
+static const intern_t *data_key(const void *item)
 {
-  return (hash_data_t) e;
+  return ((const data_entry_t *) item)->key;
 }
 
-static void data_destroy(hash_data_t d)
+static void data_destroy(void *item)
 {
   log_debug("Destroying data entry");
-  data_entry_t *e = (data_entry_t *) d;
-  data_entry_destroy(e);
+  data_entry_destroy((data_entry_t *) item);
 }
 
-DECLARE_HASH(datahash, data_entry_t);
-IMPLEMENT_HASH(datahash, data_entry_t, data_copy, data_destroy);
-
-datahash *DATA = NULL;
+// Looked up outside the DE_MONITOR, put inside it
+strtable_t *DATA = NULL;
 
 /***********************************************************************/
 
-char* basename(const char* path) 
-{
-  int l = strlen(path);
-  int i;
-  for(i=l-1;i >= 0 && path[i] != '/';--i);
-  if (i < 0) {
-    return mc_strdup(path);
-  } else {
-    return mc_strdup(&path[i+1]);
-  }
-}
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_PATH
 
 char* mymake_path(const char* path)
 {
   int l = strlen(path) + strlen(BASEDIR) + 1;
   char* np = (char* )mc_malloc(l);
-  fprintf(stderr, "np=%p\n", np);
   if (np == NULL) {
     return np;
   } else {
@@ -446,106 +676,342 @@ static int isExt(const char* path, const char* ext)
   }
 }
 
-static int isCue(const char* path)
-{
-  return isExt(path, ".cue");
-}
-
 static int isImage(const char* path)
 {
   return isExt(path, ".jpg") || isExt(path, ".jpeg")
       || isExt(path, ".png");
 }
 
-static char* stripExt(const char* _path, const char* ext)
+static char* parentPath(const char* path) {
+  char* fp = mc_strdup(path);
+  int i,N;
+  for(N = strlen(fp), i = N-1; i >= 0 && fp[i] != '/'; --i);
+  if (i<0) {
+    log_error("Unexpected!");
+  } else {
+    fp[i] = '\0';
+  }
+  return fp;
+}
+
+/***********************************************************************
+ Path classification. Instead of probing the disk for <path>.cue in all
+ case variants, we look the name up in the cached listing of its parent
+ directory. A listing is made with one readdir and keeps cue sheets by
+ their name without extension (the extension in any case), so one
+ lookup tells whether a path is a cue directory, a plain file or
+ directory, or nothing at all. A virtual track is a name whose parent is
+ a cue directory in the grandparent's listing.
+*/
+
+#define PATH_ABSENT       0
+#define PATH_PASSTHROUGH  1
+#define PATH_CUE_DIR      2
+#define PATH_TRACK        3
+
+static int lookup(const char* dir, const char* name, char** actual)
 {
-  char* path = mc_strdup(_path);
-  if (path == NULL) {
-    return NULL;
-  } else if (isExt(path, ext)) {
-    int l = strlen(path) - strlen(ext);
-    if (l > 0) {
-      path[l] = '\0';
+  dircache_listing_t *l = dircache_get(dir, dir, dircache_read_dir, NULL);
+  if (l == NULL) {
+    return 0;
+  }
+  int kind = 0;
+  dircache_entry_t *e = dircache_find(l, name);
+  if (e != NULL) {
+    kind = e->kind;
+    if (actual != NULL) {
+      *actual = make_rel_path2(dir, e->actual);
     }
   }
-  return path;
+  dircache_release(l);
+  return kind;
 }
 
-static char* isCueFile(const char* full_path)
+// For PATH_CUE_DIR and PATH_TRACK, *cuefile is set to the full path
+// of the cue sheet, which must be freed by the caller.
+static int classify_path(const char* path, char** cuefile)
 {
-  char* fp = (char* )mc_malloc(strlen(full_path) + strlen(".cue") + 1);
-  char* cues[] = { ".cue", ".Cue", ".cUe", ".cuE", ".CUe", ".CuE", ".cUE", ".CUE",
-    NULL
-  };
-  int i;
+  *cuefile = NULL;
+  if (strcmp(path, "/") == 0) {
+    return PATH_PASSTHROUGH;
+  }
 
-  for (i = 0; cues[i] != NULL; i++) {
-    sprintf(fp, "%s%s", full_path, cues[i]);
-    FILE *f = fopen(fp, "r");
-    if (f != NULL) {
-      fclose(f);
-      return fp;
+  char* dir = mc_strdup(path);
+  char* name = strrchr(dir, '/');
+  if (name == NULL) {
+    mc_free(dir);
+    return PATH_ABSENT;
+  }
+  *name++ = '\0';
+
+  int result = -1;
+  if (dir[0] != '\0') {
+    // Is our parent a cue sheet in the grandparent?
+    char* pname = strrchr(dir, '/');
+    *pname++ = '\0';
+    char* gp = make_path((dir[0] == '\0') ? "/" : dir);
+    int pkind = lookup(gp, pname, cuefile);
+    mc_free(gp);
+    pname[-1] = '/';
+    if (pkind == DIRCACHE_CUE) {
+      result = PATH_TRACK;
+    } else {
+      mc_free(*cuefile);
+      *cuefile = NULL;
+      if (pkind != DIRCACHE_DIR) {
+        result = PATH_ABSENT;
+      }
     }
   }
 
-  mc_free(fp);
+  if (result < 0) {
+    char* parent = make_path((dir[0] == '\0') ? "/" : dir);
+    char* actual = NULL;
+    int kind = lookup(parent, name, &actual);
+    mc_free(parent);
+    if (kind == DIRCACHE_CUE) {
+      *cuefile = actual;
+      result = PATH_CUE_DIR;
+    } else {
+      mc_free(actual);
+      result = (kind == 0) ? PATH_ABSENT : PATH_PASSTHROUGH;
+    }
+  }
 
-  return NULL;
+  mc_free(dir);
+  log_debug3("classify %s = %d", path, result);
+  return result;
 }
 
-static char* getCueFileForTrack(const char* full_path_of_track, int with_ext) {
-  char* fp = (char* )mc_malloc(strlen(full_path_of_track) + strlen(".cue") + 1);
-  strcpy(fp, full_path_of_track);
-  int i,N;
-  for(N = strlen(fp), i = N-1; i >= 0 && fp[i] != '/'; --i);
-  if (i<0) {
-    log_error("Unexpected!");
-    return fp;
-  } else {
-    fp[i] = '\0';
-    if (with_ext) {
-      strcat(fp, ".cue");
-    }
-    return fp;
-  }
+static int classify(const char* path, char** cuefile)
+{
+  unsigned long long t0 = latency_start();
+  int kind = classify_path(path, cuefile);
+  latency_phase(LAT_CLASSIFY, t0);
+  return kind;
 }
 
 /***********************************************************************/
 
-static segmenter_t *get_segment(cue_entry_t * e, int update)
+#undef ALLOC_TAG
+#define ALLOC_TAG ALLOC_OTHER
+
+// Splits are serialised in segmenter.c unless it is built without
+// GARD_WITH_MUTEX; admitting more would bypass the priority classes.
+static int split_workers(int workers)
 {
-  segmenter_t *se = find_seg_entry(e);
-  if (se != NULL) {
-    if (update) {
-      segmenter_create(se);
-    }
+  int max = segmenter_max_parallel();
+  if (workers > max) {
+    log_info3("%d workers asked for, but splits run one at a time; using %d", workers, max);
+    return max;
+  }
+  return workers;
+}
+
+static int inflight_errno(int result)
+{
+  switch (result) {
+    case INFLIGHT_TIMEDOUT: return -ETIMEDOUT;
+    case INFLIGHT_CANCELLED: return -EINTR;
+    default: return -EIO;
+  }
+}
+
+// Sets the source and tags of s from e
+static void prepare_segment(segmenter_t *s, cue_entry_t * e)
+{
+  cue_t *sheet = cue_entry_sheet(e);
+  const char* fullpath = cue_entry_audio_file(e); //cue_audio_file(sheet);
+  log_debug2("fullpath = %s", fullpath);
+  int year = atoi(cue_entry_year(e));
+  segmenter_prepare(s,
+        fullpath,
+        cue_entry_tracknr(e),
+        cue_entry_title(e),
+        cue_entry_performer(e),
+        cue_album_title(sheet),
+        cue_album_performer(sheet),
+        cue_entry_composer(e),
+        cue_genre(sheet),
+        year,
+        cue_entry_piece(e), cue_entry_begin_offset_in_ms(e), cue_entry_end_offset_in_ms(e)
+      );
+}
+
+typedef struct {
+  inflight_t *job;
+  segmenter_t *existing;  // a segment in the list that is split again
+} split_t;
+
+// Lets go of a segment handed to the requesters of a split
+static void release_segment(void *s)
+{
+  segmenter_set_busy((segmenter_t *) s, false);
+}
+
+// A split is given up when its requesters have (see inflight_cancelled).
+// A segment that is split again is wanted by the handles that have it
+// open as well; then the split goes on until the last one is released.
+static int split_cancelled(void *data)
+{
+  split_t *sp = (split_t *) data;
+  int r = inflight_cancelled(sp->job);
+  if (r == INFLIGHT_CANCELLED && sp->existing != NULL && segmenter_stream(sp->existing) > 0) {
+    return 0;
+  }
+  return r;
+}
+
+// Called inside the DE_MONITOR. A split runs once per segment id: the
+// first requester does it, later ones wait for its result. Splitting
+// goes through the scheduler with the given priority class, and the
+// monitor is left while waiting and splitting, so other operations go
+// on. Returns NULL with *err set (-EAGAIN when the scheduler refuses,
+// -ETIMEDOUT, -EINTR or -EIO) when there is no segment.
+static segmenter_t *get_segment(cue_entry_t * e, int update, int klass, int *err)
+{
+  *err = 0;
+  const intern_t *id = cue_entry_id(e);
+  segmenter_t *se = find_seg_entry(id);
+  if (se != NULL && !update) {
+    // Segments are shared by tracks with the same audio and tags
+    stats_inc(STAT_SEGMENT_HITS);
     return se;
-  } else {
+  }
+  if (se == NULL) {
+    // After a cue edit that only changed tags, a copy of the segment
+    // with the old tags is retagged. The old one stays as it is for its
+    // readers, and goes when it is evicted.
+    segmenter_t *from = find_seg_source(cue_entry_source(e));
+    if (from != NULL) {
+      segmenter_t *s = segmenter_new();
+      prepare_segment(s, e);
+      unsigned long long t0 = latency_start();
+      int r = segmenter_retag_from(s, from);
+      latency_phase(LAT_RETAG, t0);
+      if (r == SEGMENTER_OK) {
+        stats_inc(STAT_SEGMENT_HITS);
+        stats_inc(STAT_RETAGS);
+        add_seg_entry(id, cue_entry_source(e), s);
+        return s;
+      }
+      segmenter_destroy(s);
+      log_debug2("cannot retag %s, splitting", id->str);
+    }
+  }
+  stats_inc(STAT_SEGMENT_MISSES);
+  if (failcache_check(cue_entry_source(e)->str, cue_entry_audio_file(e), err)) {
+    log_debug2("%s is backed off after failing to split", id->str);
+    stats_inc(STAT_SPLIT_BACKED_OFF);
+    return NULL;
+  }
+
+  int owner;
+  inflight_t *job = inflight_join(id->str, &owner);
+  if (!owner) {
+    stats_inc(STAT_SPLIT_JOINED);
+    // A cue reload may replace e while we wait, the reference on its
+    // sheet keeps it valid.
     cue_t *sheet = cue_entry_sheet(e);
-    segmenter_t *s = segmenter_new();
-    const char* fullpath = cue_entry_audio_file(e); //cue_audio_file(sheet);
-    log_debug2("fullpath = %s", fullpath);
-    int year = atoi(cue_entry_year(e));
-    log_debug("prepare");
-    segmenter_prepare(s,
-          fullpath,
-          cue_entry_tracknr(e),
-          cue_entry_title(e),
-          cue_entry_performer(e),
-          cue_album_title(sheet),
-          cue_album_performer(sheet),
-          cue_entry_composer(e),
-          cue_genre(sheet),
-          year,
-          cue_entry_piece(e), cue_entry_begin_offset_in_ms(e), cue_entry_end_offset_in_ms(e)
-        );
+    cuecache_ref(sheet);
+    leave_de_monitor();
+    unsigned long long t0 = latency_start();
+    int result = inflight_wait(job);
+    latency_phase(LAT_INFLIGHT_WAIT, t0);
+    enter_de_monitor();
+    // The owner holds the segment until we have left the job, so other
+    // splits can't evict it before we got the monitor back
+    se = (result == INFLIGHT_OK) ? (segmenter_t *) inflight_data(job) : NULL;
+    inflight_leave(job);
+    if (se == NULL) {
+      *err = inflight_errno(result);
+    }
+    cuecache_release(sheet);
+    return se;
+  }
+
+  segmenter_t *s = se;
+  if (s == NULL) {
+    s = segmenter_new();
+  }
+  log_debug("prepare");
+  prepare_segment(s, e);
+
+  // e may be replaced by a cue reload while we're outside the monitor,
+  // from here on only id, source, audio and s are used; the reference on
+  // the sheet keeps id and source. A segment that is in the list already
+  // is kept from eviction meanwhile.
+  const intern_t *source = cue_entry_source(e);
+  cue_t *sheet = cuecache_ref(cue_entry_sheet(e));
+  char* audio = mc_strdup(cue_entry_audio_file(e));
+  if (se != NULL) {
+    segmenter_set_busy(se, true);
+  }
+  leave_de_monitor();
+  split_t sp = { job, se };
+  int result;
+  unsigned long long t0 = latency_start();
+  int admitted = sched_enter_cancellable(klass, split_cancelled, &sp);
+  latency_phase(LAT_SCHED_WAIT, t0);
+  if (admitted == SCHED_OK) {
     log_debug("create");
-    segmenter_create(s);
-    log_debug("add");
-    add_seg_entry(e, s);
-    log_debug("return s");
-    return s;
+    segmenter_set_cancel(s, split_cancelled, &sp);
+    int r = segmenter_create(s);
+    segmenter_set_cancel(s, NULL, NULL);
+    sched_leave(klass);
+    stats_inc(STAT_SPLITS);
+    if (r == SEGMENTER_OK) {
+      result = INFLIGHT_OK;
+      failcache_forget(source->str);
+    } else if (r == SEGMENTER_ERR_CANCELLED) {
+      stats_inc(STAT_SPLIT_CANCELLED);
+      result = split_cancelled(&sp);
+      result = (result == 0) ? INFLIGHT_CANCELLED : result;
+    } else {
+      log_error3("Cannot split %s (%d)", id->str, r);
+      stats_inc(STAT_SPLIT_FAILURES);
+      result = INFLIGHT_FAILED;
+      failcache_add(source->str, audio, -EIO);
+    }
+  } else if (admitted == SCHED_BUSY) {
+    stats_inc(STAT_SPLIT_BUSY);
+    result = INFLIGHT_FAILED;
+    *err = -EAGAIN;
+  } else {
+    stats_inc(STAT_SPLIT_CANCELLED);
+    result = split_cancelled(&sp);
+    result = (result == 0) ? INFLIGHT_CANCELLED : result;
+  }
+  enter_de_monitor();
+  if (se != NULL) {
+    segmenter_set_busy(se, false);
   }
+
+  if (se == NULL) {
+    if (result == INFLIGHT_OK) {
+      log_debug("add");
+      add_seg_entry(id, source, s);
+    } else {
+      segmenter_destroy(s);
+      s = NULL;
+    }
+  } else if (result != INFLIGHT_OK) {
+    retire_seg_entry(se);
+    s = NULL;
+  }
+  if (s != NULL) {
+    segmenter_set_busy(s, true);
+  }
+  inflight_finish(job, result, s, release_segment);
+  inflight_leave(job);
+  mc_free(audio);
+  cuecache_release(sheet);
+
+  if (s == NULL && *err == 0) {
+    *err = inflight_errno(result);
+  }
+  log_debug("return s");
+  return s;
 }
 
 /***********************************************************************/
@@ -563,300 +1029,917 @@ static void delist_destroy_entry(list_data_t e)
 DECLARE_LIST(delist, data_entry_t);
 IMPLEMENT_LIST(delist, data_entry_t, delist_copy, delist_destroy_entry);
 
-static cue_t *mp3cue_readcue_in_hash(const char* path, int update_data)
+// Makes sure all tracks of cue, with the stat st and the watcher stamp
+// cue_stamp of its sheet, are in DATA. With update_data, existing tracks
+// are moved to this sheet. Called inside the DE_MONITOR.
+static void mp3cue_put_cue_in_hash(const char* path, cue_t *cue, struct stat st, unsigned long cue_stamp, int update_data)
 {
-  char* fullpath = make_path(path);
-  char* cuefile = isCueFile(fullpath);
-  log_debug3("reading cuefile %s for %s", cuefile, fullpath);
-  cue_t *cue = (cue_t *) mc_take_over(cue_new(cuefile));
   log_debug3("cue: %s, %d", cue_audio_file(cue), cue_count(cue));
-  struct stat st;
-  stat(cuefile, &st);
   MK_READONLY(st);
-  if (cue != NULL && cue_valid(cue)) {
-    int added = 0;
+  if (cue_valid(cue)) {
     int i, N;
 
-    // check if cue already exists in hash. If not, create whole cue in hash and read in again.
     for (i = 0, N = cue_count(cue); i < N; i++) {
       cue_entry_t *entry = cue_entry(cue, i);
-      char* p = make_path2(path, cue_entry_vfile(entry));
+      char* p = make_rel_path2(path, cue_entry_vfile(entry));
 
       log_debug2("p=%s", p);
-      if (datahash_exists(DATA, p)) {
-        // update entry only if requested
-        if ( update_data ) {
-          // only update the data in d, otherwise we won't be thread safe!
-          // Never deallocate an entry in the hash!
+      data_entry_t *dd = (data_entry_t *) strtable_get(DATA, p);
+      if (dd != NULL) {
+        // update entry only if requested and the sheet was parsed again
+        if ( update_data && dd->entry != entry ) {
+          // Never deallocate an entry in the hash! We're inside the
+          // monitor, so moving dd to the new sheet is safe; the old
+          // sheet goes when its last track lets go.
           // We also know, that when the track title is changed, there will be a
           // new entry in the hash, so, we get some rubbish but don't care.
-          // We update the file sizes and the cue_entry here.
-
-          // So we need a monitor around the file operations that act on the hash
-          // data.
-
-          data_entry_t *dd = datahash_get(DATA, p);
-          cue_entry_destroy(dd->entry);
-          dd->entry=entry;
+          // A track with the same audio and tags has the same bytes:
+          // its size carries over and the kernel may keep its pages.
+          // Other tracks get a retagged copy of the segment of their
+          // audio from get_segment().
+          int same = cue_entry_same_source(dd->entry, entry) &&
+                     cue_entry_same_tags(dd->entry, entry);
+          if (same && has_size(dd->path->str, dd->st->st_mtime)) {
+            put_size(dd->path->str, get_size(dd->path->str), st.st_mtime);
+          }
+          cue_t *old = cue_entry_sheet(dd->entry);
+          dd->entry = entry;
+          cuecache_ref(cue);
+          cuecache_release(old);
           dd->st[0]=st;
+          dd->size_mtime = (time_t) -1;
+          dd->content_changed |= !same;
+          dd->cue_stamp=cue_stamp;
 
           // we don't need to update dd->path as dd->path and p must be equal
         }
       } else {
-        data_entry_t *d = data_entry_new(p, entry, &st);
-        datahash_put(DATA, p, d);
-        added = 1;
+        char* fp = make_path(p);
+        data_entry_t *d = data_entry_new(p, fp, entry, &st);
+        mc_free(fp);
+        d->cue_stamp = cue_stamp;
+        strtable_put(DATA, d);
       }
 
       mc_free(p);
     }
-
-    if (added) {
-      mc_free(cuefile);
-      mc_free(fullpath);
-      return mp3cue_readcue_in_hash(path, false);
-    }
   }
+}
 
-  mc_free(cuefile);
-  mc_free(fullpath);
+// Returns the (shared) cue sheet and makes sure all its tracks are in
+// DATA. With update_data, existing tracks are moved to this sheet.
+// Release the result with cuecache_release().
+static cue_t *mp3cue_readcue_in_hash(const char* path, const char* cuefile, int update_data)
+{
+  log_debug3("reading cuefile %s for %s", cuefile, path);
+  struct stat st;
+  // The stamp is the one taken before the sheet was parsed, a change
+  // while parsing makes it stale
+  unsigned long cue_stamp;
+  cue_t *cue = cuecache_get(cuefile, &st, &cue_stamp);
+  mp3cue_put_cue_in_hash(path, cue, st, cue_stamp, update_data);
   return cue;
 }
 
-static int mp3cue_readcue(const char* path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+// Builds the listing of a cue directory. data is the path of the
+// directory in the mount; called inside the DE_MONITOR.
+static int mp3cue_build_cue_listing(dircache_listing_t *l, const char* cuefile, void *data)
 {
+  const char* path = (const char*) data;
   log_debug2("enter with %s", path);
-  cue_t *cue = mp3cue_readcue_in_hash(path, false);
-
-  char* fullpath = make_path(path);
-  char* cuefile = isCueFile(fullpath);
+  cue_t *cue = mp3cue_readcue_in_hash(path, cuefile, false);
 
   struct stat st;
-  stat(cuefile, &st);
+  cuecache_release(cuecache_get(cuefile, &st, NULL));
   MK_READONLY(st);
-  if (cue != NULL && cue_valid(cue)) {
+  if (cue_valid(cue)) {
     int i, N;
     for (i = 0, N = cue_count(cue); i < N; i++) {
       cue_entry_t *entry = cue_entry(cue, i);
-      data_entry_t *d = datahash_get(DATA, fullpath);
-      if (d != NULL) {
-        filler(buf, cue_entry_vfile(entry), d->st, 0);
-      } else {
-        filler(buf, cue_entry_vfile(entry), &st, 0);
-      }
+      dircache_add(l, cue_entry_vfile(entry), cue_entry_vfile(entry), &st, DIRCACHE_TRACK, 1);
     }
   }
 
-  cue_destroy(cue);
-
-  mc_free(cuefile);
-  mc_free(fullpath);
+  cuecache_release(cue);
 
   return 0;
 }
 
+// Readdir with real offsets: the offset of an entry is its index in the
+// listing + 1, so a full buffer resumes where it left off.
+static void mp3cue_fill_listing(dircache_listing_t *l, void *buf, fuse_fill_dir_t filler, off_t offset)
+{
+  int i, N;
+  for (i = offset, N = dircache_count(l); i < N; i++) {
+    dircache_entry_t *e = dircache_entry(l, i);
+    if (e->listed) {
+      if (filler(buf, e->name, &e->st, i + 1) != 0) {
+        break;
+      }
+    }
+  }
+}
+
 /***********************************************************************
- File system operations. Here we use the DE_MONITOR. Nowhere else!
+ Background crawl. Cue sheets are loaded into DATA and, optionally,
+ track sizes are computed into SIZE_HASH, so the first walk over the
+ mount finds everything warm.
 */
 
-static int mp3cue_getattr(const char* path, struct stat *stbuf)
+// The crawler gives up a split as soon as a foreground split waits
+static int crawl_yield(void *data)
 {
-  log_debug2("mp3cue_getattr %s", path);
-  
-  // This may seem strange, but with OSXFuse, this function gets
-  // somehow called even if mp3cue_readdir doesn't return these files.
-  // We don't want to see hidden files, so we return EACCES. 
-  char *bn = basename(path);
-  if (bn[0] == '.') {
-    return EACCES;
+  return crawler_stopping(NULL) || sched_foreground_waiting(SCHED_CRAWL);
+}
+
+// Computes the size of a track without keeping its segment around.
+// Returns 1 when the size is known, 0 when we gave way, -1 on failure.
+static int crawl_size(const char* path)
+{
+  enter_de_monitor();
+  data_entry_t *d = (data_entry_t *) strtable_get(DATA, path);
+  if (d == NULL) {
+    leave_de_monitor();
+    return 0;
+  } else if (d->size_mtime == d->st->st_mtime || has_size(d->path->str, d->st->st_mtime)) {
+    leave_de_monitor();
+    return 1;
   }
-  
-  char* fullpath = make_path(path);
-  char* cue = isCueFile(fullpath);
-
-  if (cue != NULL) {
-    log_debug2("mp3cue_getattr cue=%s", cue);
-    int ret = stat(cue, stbuf);
-    PMK_READONLY(stbuf);
-    stbuf->st_mode -= S_IFREG;
-    stbuf->st_mode += S_IFDIR;
-    stbuf->st_mode |= S_IXUSR;
-    stbuf->st_mode |= S_IXGRP;
-    mc_free(fullpath);
-    mc_free(cue);
-    DE_MONITOR(
-      cue_t *cue=mp3cue_readcue_in_hash(path, false);
-      cue_destroy(cue);
-    );
-    return ret;
 
-  } else {
+  segmenter_t *se = find_seg_entry(cue_entry_id(d->entry));
+  if (se != NULL) {
+    put_size(d->path->str, segmenter_size(se), d->st->st_mtime);
+    leave_de_monitor();
+    return 1;
+  }
+  int err;
+  const intern_t *source = cue_entry_source(d->entry);
+  if (failcache_check(source->str, cue_entry_audio_file(d->entry), &err)) {
+    leave_de_monitor();
+    return -1;
+  }
 
-    data_entry_t *d = datahash_get(DATA, fullpath);
-    log_debug2("found d=%p", d);
-    if (d != NULL) {
+  segmenter_t *s = segmenter_new();
+  prepare_segment(s, d->entry);
+  time_t mtime = d->st->st_mtime;
+  const intern_t *key = d->path;
+  // a cue reload may replace d->entry, its sheet keeps source
+  cue_t *sheet = cuecache_ref(cue_entry_sheet(d->entry));
+  char* audio = mc_strdup(cue_entry_audio_file(d->entry));
+  leave_de_monitor();
+
+  int result = 0;
+  if (sched_enter_cancellable(SCHED_CRAWL, crawler_stopping, NULL) == SCHED_OK) {
+    segmenter_set_cancel(s, crawl_yield, NULL);
+    int r = segmenter_create(s);
+    sched_leave(SCHED_CRAWL);
+    stats_inc(STAT_SPLITS);
+    if (r == SEGMENTER_OK) {
       DE_MONITOR(
-        // check if the cuesheet mtime has changed, if so,
-        // reread the cue.
-        {
-          log_debug2("cuefile for %s",fullpath);
-          char* cue = getCueFileForTrack(fullpath, true);
-          struct stat st;
-          int ret = stat(cue, &st);
-          log_debug4("stat cuefile %s, mtime=%d, registered:%d",
-                      cue,
-                      (int) st.st_mtime,
-                      (int) d->st->st_mtime
-                      );
-          mc_free(cue);
-          if (st.st_mtime != d->st->st_mtime) {
-            char* cpath = getCueFileForTrack(path, false);
-            mp3cue_readcue_in_hash(cpath, true); // replace cue in hash
-            mc_free(cpath);
-          }
-        }
-        // check if we already have the size
-        if (has_size( fullpath, d->st->st_mtime )) {
-          log_debug("hassize = true");
-          d->st->st_size = get_size( fullpath );
-        } else {
-          log_debug("hassize = false");
-          segmenter_t *s = get_segment(d->entry, true);
-          d->st->st_size = segmenter_size(s);
-          put_size(fullpath, d->st->st_size, d->st->st_mtime);
-        }
-        log_debug3("for filename %s, size=%d",
-             cue_entry_audio_file(d->entry), (int) d->st->st_size);
-        memcpy(stbuf, d->st, sizeof(struct stat));
-        mc_free(fullpath);
-      ); // end monitor
-      return 0;
+        put_size(key->str, segmenter_size(s), mtime);
+      );
+      result = 1;
+    } else if (r != SEGMENTER_ERR_CANCELLED) {
+      stats_inc(STAT_SPLIT_FAILURES);
+      failcache_add(source->str, audio, -EIO);
+      result = -1;
     } else {
-      int ret = stat(fullpath, stbuf);
-      PMK_READONLY(stbuf);
+      stats_inc(STAT_SPLIT_CANCELLED);
+    }
+  }
+  segmenter_destroy(s);
+  mc_free(audio);
+  cuecache_release(sheet);
+  return result;
+}
+
+static void mp3cue_crawl_cue(const char* dir, const char* cuefile, crawler_progress_t *counts, void *data)
+{
+  // The sheet is parsed outside the monitor, so foreground requests
+  // only wait for its tracks going into DATA
+  struct stat st;
+  unsigned long cue_stamp;
+  cue_t *cue = cuecache_get(cuefile, &st, &cue_stamp);
+  // The sheet is shared read only and we hold a reference
+  if (cue_valid(cue)) {
+    crawler_yield();
+    DE_MONITOR(
+      mp3cue_put_cue_in_hash(dir, cue, st, cue_stamp, false);
+    );
+    int i, N;
+    for (i = 0, N = cue_count(cue); i < N && !crawler_stopping(NULL); i++) {
+      counts->tracks += 1;
+      if (CRAWL_SIZES) {
+        char* p = make_rel_path2(dir, cue_entry_vfile(cue_entry(cue, i)));
+        int r = crawl_size(p);
+        if (r > 0) {
+          counts->sized += 1;
+        } else if (r < 0) {
+          counts->failed += 1;
+        }
+        mc_free(p);
+      }
+    }
+  }
+  cuecache_release(cue);
+}
+
+/***********************************************************************
+ Statistics, in CONTROL_DIR/stats. One "name value" pair per line.
+*/
+
+static void fill_stats(control_buf_t *b)
+{
+  unsigned long v[STAT_COUNTERS];
+  int i;
+  stats_get_all(v);
+  for (i = 0; i < STAT_COUNTERS; i++) {
+    control_printf(b, "%s %lu\n", stats_name(i), v[i]);
+  }
+  control_printf(b, "open_handles %ld\n", (long) (v[STAT_OPEN] - v[STAT_RELEASE]));
+
+  // Segments resident against the memory limit
+  unsigned long resident = 0;
+  int segments;
+  seglist_lock(SEGMENT_LIST);
+  segments = seglist_count(SEGMENT_LIST);
+  seg_entry_t *se = seglist_start_iter(SEGMENT_LIST, LIST_FIRST);
+  while (se != NULL) {
+    resident += segmenter_size(se->segment);
+    se = seglist_next_iter(SEGMENT_LIST);
+  }
+  seglist_unlock(SEGMENT_LIST);
+  control_printf(b, "segments %d\n", segments);
+  control_printf(b, "segment_bytes %lu\n", resident);
+  control_printf(b, "segment_bytes_limit %lu\n", membudget_segment_limit());
+
+  // The budget of the whole process
+  membudget_stats_t m;
+  membudget_stats(&m);
+  control_printf(b, "memory_limit %lu\n", m.limit);
+  control_printf(b, "memory_configured %lu\n", m.configured);
+  control_printf(b, "memory_cgroup_limit %lu\n", m.cgroup);
+  control_printf(b, "memory_resident %lu\n", m.rss);
+  control_printf(b, "memory_other %lu\n", m.other);
+  control_printf(b, "memory_scale_percent %d\n", m.scale_percent);
+  control_printf(b, "memory_pressure_notifications %d\n", m.psi);
+  control_printf(b, "memory_exhausted %d\n", m.exhausted);
+  control_printf(b, "memory_pressure_events %lu\n", m.pressure_events);
+  control_printf(b, "memory_shrinks %lu\n", m.shrinks);
+
+  control_printf(b, "tracks %d\n", strtable_count(DATA));
+  control_printf(b, "size_cache_entries %d\n", strtable_count(SIZE_HASH));
+  control_printf(b, "cue_sheets %d\n", cuecache_count());
+  control_printf(b, "cue_hits %lu\n", cuecache_hits());
+  control_printf(b, "cue_parses %lu\n", cuecache_parses());
+  control_printf(b, "negative_hits %lu\n", negcache_hits());
+  control_printf(b, "negative_misses %lu\n", negcache_misses());
+  control_printf(b, "interned_strings %d\n", intern_count());
+  control_printf(b, "interned_bytes %lu\n", (unsigned long) intern_bytes());
+  control_printf(b, "failed_segments %d\n", failcache_count());
+  control_printf(b, "splits_in_flight %d\n", inflight_count());
+  control_printf(b, "log_level %s\n", logger_level_name(logger_level()));
+  control_printf(b, "log_dropped %lu\n", logger_dropped());
+
+  if (alloc_profiling()) {
+    alloc_stats_t a[ALLOC_TAGS];
+    alloc_stats_all(a);
+    for (i = 0; i < ALLOC_TAGS; i++) {
+      const char* n = alloc_tag_name(i);
+      control_printf(b, "alloc_%s_live_bytes %lu\n", n, a[i].live_bytes);
+      control_printf(b, "alloc_%s_live_blocks %lu\n", n, a[i].live_blocks);
+      control_printf(b, "alloc_%s_allocs %lu\n", n, a[i].allocs);
+      control_printf(b, "alloc_%s_allocs_per_s %.0f\n", n, a[i].allocs_per_s);
+      control_printf(b, "alloc_%s_bytes_per_s %.0f\n", n, a[i].bytes_per_s);
+    }
+  }
+
+  for (i = 0; i < SCHED_CLASSES; i++) {
+    sched_class_stats_t st;
+    sched_stats(i, &st);
+    const char* n = sched_class_name(i);
+    control_printf(b, "sched_%s_queued %d\n", n, st.waiting);
+    control_printf(b, "sched_%s_running %d\n", n, st.running);
+    control_printf(b, "sched_%s_admitted %lu\n", n, st.admitted);
+    control_printf(b, "sched_%s_rejected %lu\n", n, st.rejected);
+    control_printf(b, "sched_%s_wait_avg_ms %.1f\n", n, (st.admitted > 0) ? st.wait_total_ms / st.admitted : 0.0);
+    control_printf(b, "sched_%s_wait_max_ms %.1f\n", n, st.wait_max_ms);
+  }
+
+  if (CRAWL) {
+    crawler_progress_t p;
+    crawler_progress(&p);
+    control_printf(b, "crawl_running %d\n", p.running);
+    control_printf(b, "crawl_dirs %lu\n", p.dirs);
+    control_printf(b, "crawl_cues %lu\n", p.cues);
+    control_printf(b, "crawl_tracks %lu\n", p.tracks);
+    control_printf(b, "crawl_sized %lu\n", p.sized);
+    control_printf(b, "crawl_failed %lu\n", p.failed);
+  }
+}
+
+/***********************************************************************
+ The same, and the latency histograms, in the Prometheus text format
+ in CONTROL_DIR/metrics.
+*/
+
+static const double METRIC_BUCKETS[] = {
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+  0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 0.0
+};
+
+static void fill_histogram(control_buf_t *b, const char* metric, const char* label, int which, latency_hist_t *h)
+{
+  int i;
+  latency_snapshot(which, h);
+  const char* name = latency_name(which);
+  for (i = 0; METRIC_BUCKETS[i] > 0.0; i++) {
+    unsigned long long us = (unsigned long long) (METRIC_BUCKETS[i] * 1e6);
+    control_printf(b, "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n",
+                   metric, label, name, METRIC_BUCKETS[i], latency_below(h, us));
+  }
+  control_printf(b, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", metric, label, name, h->count);
+  control_printf(b, "%s_sum{%s=\"%s\"} %.6f\n", metric, label, name, h->sum_us / 1e6);
+  control_printf(b, "%s_count{%s=\"%s\"} %lu\n", metric, label, name, h->count);
+}
+
+static void fill_metrics(control_buf_t *b)
+{
+  unsigned long v[STAT_COUNTERS];
+  int i;
+  stats_get_all(v);
+  for (i = 0; i < STAT_COUNTERS; i++) {
+    control_printf(b, "# TYPE mp3cuefuse_%s_total counter\n", stats_name(i));
+    control_printf(b, "mp3cuefuse_%s_total %lu\n", stats_name(i), v[i]);
+  }
+  control_printf(b, "# TYPE mp3cuefuse_open_handles gauge\n");
+  control_printf(b, "mp3cuefuse_open_handles %ld\n", (long) (v[STAT_OPEN] - v[STAT_RELEASE]));
+  control_printf(b, "# TYPE mp3cuefuse_tracks gauge\n");
+  control_printf(b, "mp3cuefuse_tracks %d\n", strtable_count(DATA));
+  control_printf(b, "# TYPE mp3cuefuse_cue_sheets gauge\n");
+  control_printf(b, "mp3cuefuse_cue_sheets %d\n", cuecache_count());
+
+  membudget_stats_t m;
+  membudget_stats(&m);
+  control_printf(b, "# TYPE mp3cuefuse_memory_limit_bytes gauge\n");
+  control_printf(b, "mp3cuefuse_memory_limit_bytes %lu\n", m.limit);
+  control_printf(b, "# TYPE mp3cuefuse_memory_resident_bytes gauge\n");
+  control_printf(b, "mp3cuefuse_memory_resident_bytes %lu\n", m.rss);
+  control_printf(b, "# TYPE mp3cuefuse_segment_bytes gauge\n");
+  control_printf(b, "mp3cuefuse_segment_bytes %lu\n", m.segments);
+  control_printf(b, "# TYPE mp3cuefuse_memory_pressure_events_total counter\n");
+  control_printf(b, "mp3cuefuse_memory_pressure_events_total %lu\n", m.pressure_events);
+
+  if (alloc_profiling()) {
+    alloc_stats_t a[ALLOC_TAGS];
+    alloc_stats_all(a);
+    control_printf(b, "# TYPE mp3cuefuse_alloc_live_bytes gauge\n");
+    for (i = 0; i < ALLOC_TAGS; i++) {
+      control_printf(b, "mp3cuefuse_alloc_live_bytes{subsystem=\"%s\"} %lu\n", alloc_tag_name(i), a[i].live_bytes);
+    }
+    control_printf(b, "# TYPE mp3cuefuse_allocs_total counter\n");
+    for (i = 0; i < ALLOC_TAGS; i++) {
+      control_printf(b, "mp3cuefuse_allocs_total{subsystem=\"%s\"} %lu\n", alloc_tag_name(i), a[i].allocs);
+    }
+    control_printf(b, "# TYPE mp3cuefuse_alloc_bytes_total counter\n");
+    for (i = 0; i < ALLOC_TAGS; i++) {
+      control_printf(b, "mp3cuefuse_alloc_bytes_total{subsystem=\"%s\"} %lu\n", alloc_tag_name(i), a[i].bytes);
+    }
+  }
+
+  if (!latency_enabled()) {
+    return;
+  }
+  latency_hist_t *h = (latency_hist_t *) mc_malloc(sizeof(latency_hist_t));
+  control_printf(b, "# HELP mp3cuefuse_op_duration_seconds File system operations\n");
+  control_printf(b, "# TYPE mp3cuefuse_op_duration_seconds histogram\n");
+  for (i = 0; i < LAT_FIRST_PHASE; i++) {
+    fill_histogram(b, "mp3cuefuse_op_duration_seconds", "op", i, h);
+  }
+  control_printf(b, "# HELP mp3cuefuse_phase_duration_seconds Phases of the operations\n");
+  control_printf(b, "# TYPE mp3cuefuse_phase_duration_seconds histogram\n");
+  for (i = LAT_FIRST_PHASE; i < LAT_COUNT; i++) {
+    fill_histogram(b, "mp3cuefuse_phase_duration_seconds", "phase", i, h);
+  }
+  mc_free(h);
+}
+
+/***********************************************************************
+ Allocations by call site in CONTROL_DIR/allocs, in builds with
+ ALLOC_PROFILE. The sites that allocate most often come first.
+*/
+
+#define ALLOC_SITES 50
+
+static void fill_allocs(control_buf_t *b)
+{
+  alloc_site_t sites[ALLOC_SITES];
+  int i, n = alloc_hot_sites(sites, ALLOC_SITES);
+  control_printf(b, "# allocs bytes subsystem site\n");
+  for (i = 0; i < n; i++) {
+    control_printf(b, "%lu %lu %s %s:%d\n", sites[i].allocs, sites[i].bytes,
+                   alloc_tag_name(sites[i].tag), sites[i].file, sites[i].line);
+  }
+}
+
+/***********************************************************************
+ Commands, written to CONTROL_DIR/control, one per line:
+
+   memory <MB>         budget of the whole process
+   workers <n>         splits that may run at the same time, at most
+                       segmenter_max_parallel()
+   log-level <level>   debug, info or error
+   prefetch <path>     split the tracks under path in the background
+   pin <path>          keep the tracks under path in memory, and prefetch;
+                       pins may take half of what segments may use
+   unpin <path>        pin and unpin are done in the background too
+   drop                evict what isn't pinned or open, forget misses
+   flush               write the size cache to disk
+
+ A path is a track, an album (cue directory) or any directory above
+ them, as seen in the mount, without "..".
+*/
+
+// Set in our own threads, which FUSE knows nothing of
+static __thread int BACKGROUND = false;
+static int (*REQUEST_INTERRUPTED)(void) = NULL;
+
+// fuse_interrupted() may only be asked in a FUSE thread. A prefetch
+// counts as interrupted when prefetching stops.
+static int mp3cue_interrupted(void)
+{
+  if (BACKGROUND) {
+    return prefetch_stopping();
+  }
+  return REQUEST_INTERRUPTED != NULL && REQUEST_INTERRUPTED();
+}
+
+// For the scheduler
+static int request_cancelled(void *data)
+{
+  return mp3cue_interrupted();
+}
+
+typedef int (*track_fn)(const char* track, void *data);
+
+// Calls fn for every track under path, with its cue sheet loaded. fn
+// returns non zero to stop the walk. Returns the number of tracks, or
+// a negative errno.
+static int walk_tracks(const char* path, track_fn fn, void *data)
+{
+  char* cue;
+  int n = 0;
+  int kind = classify(path, &cue);
+  if (kind == PATH_CUE_DIR || kind == PATH_TRACK) {
+    char* dir = mc_strdup(path);
+    if (kind == PATH_TRACK) {
+      *strrchr(dir, '/') = '\0';
+    }
+    DE_MONITOR(
+      cue_t *sheet = mp3cue_readcue_in_hash(dir, cue, false);
+    );
+    if (cue_valid(sheet)) {
+      int i, N;
+      for (i = 0, N = cue_count(sheet); i < N && n >= 0; i++) {
+        char* p = make_rel_path2(dir, cue_entry_vfile(cue_entry(sheet, i)));
+        if (kind == PATH_CUE_DIR || strcmp(p, path) == 0) {
+          n = (fn(p, data) == 0) ? n + 1 : -EINTR;
+        }
+        mc_free(p);
+      }
+    }
+    cuecache_release(sheet);
+    mc_free(dir);
+  } else if (kind == PATH_PASSTHROUGH) {
+    char* fullpath = make_path(path);
+    dircache_listing_t *l = dircache_get(fullpath, fullpath, dircache_read_dir, NULL);
+    mc_free(fullpath);
+    if (l != NULL) {
+      int i, N;
+      for (i = 0, N = dircache_count(l); i < N && n >= 0; i++) {
+        dircache_entry_t *e = dircache_entry(l, i);
+        if (e->kind == DIRCACHE_DIR || e->kind == DIRCACHE_CUE) {
+          char* p = make_rel_path2(path, e->name);
+          int r = walk_tracks(p, fn, data);
+          n = (r == -EINTR) ? r : (r > 0) ? n + r : n;
+          mc_free(p);
+        }
+      }
+      dircache_release(l);
+    }
+  } else {
+    n = -ENOENT;
+  }
+  mc_free(cue);
+  return n;
+}
+
+static int prefetch_track(const char* track, void *data)
+{
+  if (prefetch_stopping()) {
+    return 1;
+  }
+  int err = 0;
+  DE_MONITOR(
+    data_entry_t *d = (data_entry_t *) strtable_get(DATA, track);
+    if (d != NULL) {
+      get_segment(d->entry, false, SCHED_PREFETCH, &err);
+    }
+  );
+  if (err != 0) {
+    log_info3("prefetch: %s failed (%d)", track, err);
+  }
+  return 0;
+}
+
+static int pin_track(const char* track, void *data)
+{
+  int pin = *(int *) data;
+  DE_MONITOR(
+    data_entry_t *d = (data_entry_t *) strtable_get(DATA, track);
+    if (d != NULL) {
+      pin_segment(cue_entry_source(d->entry), pin);
+    }
+  );
+  return 0;
+}
+
+static void mp3cue_prefetch(const char* path, int op, void *data)
+{
+  BACKGROUND = true;
+  if (op == PREFETCH_PIN || op == PREFETCH_UNPIN) {
+    int pin = (op == PREFETCH_PIN);
+    int n = walk_tracks(path, pin_track, &pin);
+    log_info4("%s: %s, %d tracks", pin ? "pin" : "unpin", path, n);
+  }
+  if (op == PREFETCH_PIN || op == PREFETCH_LOAD) {
+    int n = walk_tracks(path, prefetch_track, NULL);
+    log_info3("prefetch: %s, %d tracks", path, n);
+  }
+}
+
+// Whether path can be given to a command: absolute, and no ".." in it
+static int command_path(const char* path)
+{
+  if (path[0] != '/') {
+    return false;
+  }
+  const char* p = path;
+  while ((p = strstr(p, "..")) != NULL) {
+    if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0')) {
+      return false;
+    }
+    p += 2;
+  }
+  return true;
+}
+
+static int mp3cue_command(const char* line, control_buf_t *reply)
+{
+  char cmd[32];
+  int n = 0;
+  if (sscanf(line, "%31s%n", cmd, &n) != 1) {
+    return -EINVAL;
+  }
+  const char* arg = line + n;
+  while (isspace(*arg)) {
+    arg++;
+  }
+
+  if (strcmp(cmd, "memory") == 0) {
+    int mb = atoi(arg);
+    if (mb < 30) {
+      return -EINVAL;
+    }
+    MAX_MEM_USAGE_IN_MB = mb;
+    membudget_configure(mb);
+    control_printf(reply, "memory %d\n", mb);
+  } else if (strcmp(cmd, "workers") == 0) {
+    int workers = atoi(arg);
+    if (workers < 1) {
+      return -EINVAL;
+    }
+    sched_configure(split_workers(workers));
+    control_printf(reply, "workers %d\n", sched_workers());
+  } else if (strcmp(cmd, "log-level") == 0) {
+    int level = logger_parse_level(arg);
+    if (level < 0) {
+      return -EINVAL;
+    }
+    logger_set_level(level);
+    control_printf(reply, "log-level %s\n", logger_level_name(level));
+  } else if (strcmp(cmd, "prefetch") == 0 || strcmp(cmd, "pin") == 0 || strcmp(cmd, "unpin") == 0) {
+    if (!command_path(arg)) {
+      return -EINVAL;
+    }
+    char* cue;
+    int kind = classify(arg, &cue);
+    mc_free(cue);
+    if (kind == PATH_ABSENT) {
+      return -ENOENT;
+    }
+    int op = (strcmp(cmd, "pin") == 0) ? PREFETCH_PIN :
+             (strcmp(cmd, "unpin") == 0) ? PREFETCH_UNPIN : PREFETCH_LOAD;
+    int r = prefetch_queue(arg, op);
+    if (r < 0) {
+      return r;
+    }
+    control_printf(reply, "%s queued %s\n", cmd, arg);
+  } else if (strcmp(cmd, "drop") == 0) {
+    // both sizes under the same lock, a split finishing meanwhile
+    // doesn't count
+    unsigned long dropped;
+    DE_MONITOR(
+      seglist_lock(SEGMENT_LIST);
+      dropped = segment_bytes_locked();
+      evict_segments(0);
+      dropped -= segment_bytes_locked();
+      seglist_unlock(SEGMENT_LIST)
+    );
+    negcache_clear();
+    control_printf(reply, "dropped %lu bytes\n", dropped);
+  } else if (strcmp(cmd, "flush") == 0) {
+    int r = -ENOENT;
+    if (SIZES_FILE[0] != '\0') {
+      DE_MONITOR(
+        r = write_sizes(SIZES_FILE);
+      );
+    }
+    if (r < 0) {
+      return r;
+    }
+    control_printf(reply, "flushed %d sizes to %s\n", strtable_count(SIZE_HASH), SIZES_FILE);
+  } else {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+static void fill_control(control_buf_t *b)
+{
+  seglist_lock(SEGMENT_LIST);
+  int pins = N_PINS;
+  unsigned long pin_bytes = pinned_bytes();
+  seglist_unlock(SEGMENT_LIST);
+  control_printf(b, "memory %d\n", MAX_MEM_USAGE_IN_MB);
+  control_printf(b, "workers %d\n", sched_workers());
+  control_printf(b, "log-level %s\n", logger_level_name(logger_level()));
+  control_printf(b, "pinned_tracks %d\n", pins);
+  control_printf(b, "pinned_bytes %lu\n", pin_bytes);
+  control_printf(b, "pinned_bytes_limit %lu\n", membudget_segment_limit() / 100 * PIN_SHARE);
+  control_printf(b, "prefetch_queued %d\n", prefetch_queued());
+  control_printf(b, "prefetch_done %lu\n", prefetch_done());
+  control_printf(b, "# commands: memory <MB>, workers <n>, log-level <level>, "
+                    "prefetch <path>, pin <path>, unpin <path>, drop, flush\n");
+}
+
+/***********************************************************************
+ File system operations. Here we use the DE_MONITOR. Nowhere else!
+*/
+
+static int mp3cue_getattr(const char* path, struct stat *stbuf)
+{
+  log_debug2("mp3cue_getattr %s", path);
+  stats_inc(STAT_GETATTR);
+
+  if (control_kind(path) != CONTROL_NONE) {
+    control_stat(path, stbuf);
+    return 0;
+  }
+  
+  // This may seem strange, but with OSXFuse, this function gets
+  // somehow called even if mp3cue_readdir doesn't return these files.
+  // We don't want to see hidden files, so they don't exist. ENOENT
+  // lets the kernel cache the miss for the negative timeout.
+  const char *bn = strrchr(path, '/');
+  if (bn != NULL && bn[1] == '.') {
+    return -ENOENT;
+  }
+
+  // Recent misses (desktop indexers probing for folder.jpg & co.)
+  if (negcache_hit(path)) {
+    log_debug2("negative cache hit for %s", path);
+    return -ENOENT;
+  }
+  
+  data_entry_t *d = (data_entry_t *) strtable_get(DATA, path);
+  log_debug2("found d=%p", d);
+
+  if (d == NULL) {
+    char* fullpath = make_path(path);
+    unsigned long nstamp = negcache_stamp(path);
+    char* cue;
+    int kind = classify(path, &cue);
+
+    if (kind == PATH_CUE_DIR) {
+      log_debug2("mp3cue_getattr cue=%s", cue);
+      if (stat(cue, stbuf) != 0) {
+        int err = -errno;
+        mc_free(fullpath);
+        mc_free(cue);
+        return err;
+      }
+      PMK_READONLY(stbuf);
+      stbuf->st_mode -= S_IFREG;
+      stbuf->st_mode += S_IFDIR;
+      stbuf->st_mode |= S_IXUSR;
+      stbuf->st_mode |= S_IXGRP;
       mc_free(fullpath);
+      DE_MONITOR(
+        cuecache_release(mp3cue_readcue_in_hash(path, cue, false));
+      );
+      mc_free(cue);
+      return 0;
+    } else if (kind == PATH_TRACK) {
+      // The cue directory hasn't been visited yet
+      char* cpath = parentPath(path);
+      DE_MONITOR(
+        cuecache_release(mp3cue_readcue_in_hash(cpath, cue, false));
+      );
+      mc_free(cpath);
+      mc_free(cue);
+      d = (data_entry_t *) strtable_get(DATA, path);
+    } else if (kind == PATH_PASSTHROUGH) {
+      int ret = (stat(fullpath, stbuf) == 0) ? 0 : -errno;
+      mc_free(fullpath);
+      if (ret == 0) {
+        PMK_READONLY(stbuf);
+      }
       return ret;
     }
+    mc_free(fullpath);
+
+    if (d == NULL) {
+      negcache_add(path, nstamp);
+      return -ENOENT;
+    }
   }
+
+  int retval = 0;
+  DE_MONITOR(
+    // check if the cuesheet mtime has changed, if so,
+    // reread the cue. The watcher tells us when we need to look.
+    unsigned long stamp = watcher_stamp(cue_file(cue_entry_sheet(d->entry)));
+    if (stamp == 0 || stamp != d->cue_stamp) {
+      // the reload may drop the sheet cue_file() points into
+      char* cue = mc_strdup(cue_file(cue_entry_sheet(d->entry)));
+      log_debug3("cuefile for %s = %s", path, cue);
+      struct stat st;
+      stat(cue, &st);
+      log_debug4("stat cuefile %s, mtime=%d, registered:%d",
+                  cue,
+                  (int) st.st_mtime,
+                  (int) d->st->st_mtime
+                  );
+      if (st.st_mtime != d->st->st_mtime) {
+        char* cpath = parentPath(path);
+        cuecache_release(mp3cue_readcue_in_hash(cpath, cue, true)); // replace cue in hash
+        mc_free(cpath);
+      }
+      d->cue_stamp = stamp;
+      mc_free(cue);
+    }
+    // check if we already have the size, in the entry or in the size cache
+    if (d->size_mtime == d->st->st_mtime) {
+      log_debug("hassize = true");
+      stats_inc(STAT_SIZE_HITS);
+    } else if (has_size(d->path->str, d->st->st_mtime)) {
+      log_debug("hassize = true (size cache)");
+      stats_inc(STAT_SIZE_HITS);
+      d->st->st_size = get_size(d->path->str);
+      d->size_mtime = d->st->st_mtime;
+    } else {
+      log_debug("hassize = false");
+      stats_inc(STAT_SIZE_MISSES);
+      segmenter_t *s = get_segment(d->entry, false, SCHED_SIZE, &retval);
+      // A stat of a track that exists must not fail because the size
+      // queue is full; wait for room instead.
+      while (s == NULL && retval == -EAGAIN) {
+        leave_de_monitor();
+        int r = sched_wait_room(SCHED_SIZE, request_cancelled, NULL);
+        enter_de_monitor();
+        if (r != SCHED_OK) {
+          retval = -EINTR;
+        } else {
+          s = get_segment(d->entry, false, SCHED_SIZE, &retval);
+        }
+      }
+      if (s != NULL) {
+        d->st->st_size = segmenter_size(s);
+        d->size_mtime = d->st->st_mtime;
+        put_size(d->path->str, d->st->st_size, d->st->st_mtime);
+      }
+    }
+    log_debug3("for filename %s, size=%d",
+         cue_entry_audio_file(d->entry), (int) d->st->st_size);
+    memcpy(stbuf, d->st, sizeof(struct stat));
+  ); // end monitor
+  return retval;
 }
 
 static int mp3cue_readdir(const char* path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
   log_debug2("mp3cue_readdir %s", path);
 
+  if (control_kind(path) == CONTROL_ROOT) {
+    int i;
+    const char* name;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for (i = 0; (name = control_name(i)) != NULL; i++) {
+      filler(buf, name, NULL, 0);
+    }
+    return 0;
+  }
+
   char* fullpath = make_path(path);
   if (fullpath == NULL) {
     return ENOMEM;
   }
 
-  char* cue = isCueFile(fullpath);
-  if (cue != NULL) {
+  dircache_listing_t *l = NULL;
+  char* cue;
+  int kind = classify(path, &cue);
+  if (kind == PATH_CUE_DIR) {
     log_debug2("mp3cue_readdir iscuefile %s", cue);
-    mc_free(cue);
-    mc_free(fullpath);
-    int retval;
     DE_MONITOR(
-      retval=mp3cue_readcue(path, buf, filler, offset, fi);
+      l = dircache_get(cue, cue, mp3cue_build_cue_listing, (void *) path);
     );
-    return retval;
+    mc_free(cue);
+  } else if (kind == PATH_PASSTHROUGH) {
+    l = dircache_get(fullpath, fullpath, dircache_read_dir, NULL);
+  } else {
+    mc_free(cue);
   }
+  mc_free(fullpath);
 
-  DIR *dh = opendir(fullpath);
-  if (dh == NULL) {
-    log_debug2("opendir %s returns NULL!", fullpath);
-    mc_free(fullpath);
-    return errno;
+  if (l == NULL) {
+    return -ENOENT;
   } else {
-    struct dirent *de;
-    while ((de = readdir(dh)) != NULL) {
-      log_debug2("d_name=%s",de->d_name);
-      if (de->d_name[0] != '.') {
-        char* pf = make_path2(path, de->d_name);
-        log_debug2("pf=%s", pf);
-        struct stat st;
-        if (pf == NULL) {
-          closedir(dh);
-          return ENOMEM;
-        } else {
-          int r = stat(pf, &st);
-          MK_READONLY(st);
-          switch (st.st_mode & S_IFMT) {
-          case S_IFREG:{
-              if (isCue(pf)) {
-                char* dr = stripExt(de->d_name, ".cue");
-                if (dr == NULL) {
-                  closedir(dh);
-                  return ENOMEM;
-                }
-                st.st_mode &= !S_IFREG;
-                st.st_mode += S_IFDIR;
-                log_debug2("adding cue file %s", dr);
-                filler(buf, dr, &st, 0);
-                mc_free(dr);
-              }
-              break;
-            }
-          case S_IFDIR:{
-              filler(buf, de->d_name, &st, 0);
-              break;
-            }
-          default:
-            break;
-          }
-        }
-        mc_free(pf);
-      } else {
-        // skip
-      }
-    }
-    closedir(dh);
+    mp3cue_fill_listing(l, buf, filler, offset);
+    dircache_release(l);
+    return 0;
   }
-  mc_free(fullpath);
+}
 
-  return 0;
+// Commands are taken from the user that mounted, and from root
+static int may_command(const char* path)
+{
+  struct fuse_context *c = fuse_get_context();
+  return control_writable(path) && c != NULL && (c->uid == 0 || c->uid == getuid());
 }
 
 static int mp3cue_open(const char* path, struct fuse_file_info *fi)
 {
   log_debug2("mp3cue_open %s", path);
-  char* fullpath = make_path(path);
-  char* cue = isCueFile(fullpath);
-  if (cue != NULL) {
-    int ret = -EISDIR;
-    fi->fh = 0;
-    mc_free(fullpath);
-    mc_free(cue);
-    return ret;
-  } else {
-    data_entry_t *d = datahash_get(DATA, fullpath);
+  {
+    data_entry_t *d = (data_entry_t *) strtable_get(DATA, path);
     log_debug2("found d=%p", d);
-    if (d != NULL) {
+    if (d == NULL && control_kind(path) == CONTROL_FILE) {
+      if ((fi->flags & O_ACCMODE) != O_RDONLY && !may_command(path)) {
+        return -EACCES;
+      }
+      fi->fh = (uint64_t) (uintptr_t) control_open(path);
+      fi->direct_io = 1;
+      return 0;
+    } else if (d != NULL) {
       int retval=0;
       DE_MONITOR(
-        int update = cue_entry_audio_changed(d->entry);
-        segmenter_t *s = get_segment(d->entry, update );
-        if (update) { cue_entry_audio_update_mtime(d->entry); }
-        if (!segmenter_stream(s)) {
-          if (segmenter_open(s) != SEGMENTER_OK) {
-            log_debug2("Cannot open segment %s", cue_entry_vfile(d->entry));
-            mc_free(fullpath);
-            retval = -EPERM;
-          }
+        int update = false;
+        unsigned long stamp = watcher_stamp(cue_entry_audio_file(d->entry));
+        if (stamp == 0 || stamp != d->audio_stamp) {
+          update = cue_entry_audio_changed(d->entry);
+          d->audio_stamp = stamp;
+        }
+        segmenter_t *s = get_segment(d->entry, update, SCHED_OPEN, &retval);
+        if (update) {
+          cue_entry_audio_update_mtime(d->entry);
+          d->content_changed = true;
+        }
+        if (s != NULL && segmenter_open(s) != SEGMENTER_OK) {
+          log_debug2("Cannot open segment %s", cue_entry_vfile(d->entry));
+          retval = -EPERM;
         }
         if (retval == 0) {
-          /*FILE *f = segmenter_stream(s);
-          fi->fh = fileno(f);*/
-          fi->fh = 1;
+          // The handle keeps the segment it opened; while it is open
+          // the segment can't be evicted.
+          fi->fh = (uint64_t) (uintptr_t) s;
+          // Let the kernel keep the pages of this track between opens,
+          // unless the cue sheet or audio changed; then drop them once.
+          fi->direct_io = 0;
+          fi->keep_cache = !d->content_changed;
+          d->content_changed = false;
           d->open_count += 1;
-          mc_free(fullpath);
+          stats_inc(STAT_OPEN);
         }
       );
       return retval;
     } else {
+      char* cue;
+      int kind = classify(path, &cue);
+      mc_free(cue);
       fi->fh = 0;
-      int ret = -EISDIR;
-      mc_free(fullpath);
-      return ret;
+      return (kind == PATH_ABSENT) ? -ENOENT : -EISDIR;
     }
   }
 }
@@ -865,23 +1948,26 @@ static int mp3cue_read(const char* path, char* buf, size_t size, off_t offset, s
 {
   log_debug4("mp3cue_read %s %d %d", path, (int)size, (int)offset);
   if (fi->fh == 0) {
+    stats_inc(STAT_READ_ERRORS);
     return -EIO;
   } else {
-    char* fullpath = make_path(path);
-    data_entry_t *d = datahash_get(DATA, fullpath);
-    mc_free(fullpath);
+    stats_inc(STAT_READ);
+    data_entry_t *d = (data_entry_t *) strtable_get(DATA, path);
     log_debug2("found d=%p", d);
     if (d != NULL) {
-      DE_MONITOR(
-        segmenter_t *s = get_segment(d->entry, false);
-      );
-      if (!segmenter_stream(s)) {
-        return -EIO;
-      } else {
-	segmenter_seek(s, offset);
-        int bytes = segmenter_read(s,buf, size);
-        return bytes;
+      // Reads don't need the monitor, the segment is the one the open
+      // got and it has a lock of its own.
+      segmenter_t *s = (segmenter_t *) (uintptr_t) fi->fh;
+      unsigned long long t0 = latency_start();
+      int bytes = segmenter_read_at(s, buf, size, offset);
+      latency_phase(LAT_SEGMENT_READ, t0);
+      if (bytes > 0) {
+        stats_add(STAT_READ_BYTES, bytes);
       }
+      return bytes;
+    } else if (control_kind(path) == CONTROL_FILE) {
+      stats_inc(STAT_CONTROL_READS);
+      return control_read((control_buf_t *) (uintptr_t) fi->fh, buf, size, offset);
     } else {
       return -EIO;
     }
@@ -894,83 +1980,292 @@ static int mp3cue_release(const char* path, struct fuse_file_info *fi)
   if (fi->fh == 0) {
     return -EIO;
   } else {
-    char* fullpath = make_path(path);
-    data_entry_t *d = datahash_get(DATA, fullpath);
+    data_entry_t *d = (data_entry_t *) strtable_get(DATA, path);
     if (d != NULL) {
-      log_debug3("found d=%p, count=%d", d, d->open_count);
-      d->open_count -= 1;
-      if (d->open_count <= 0) {
-        d->open_count = 0;
-        DE_MONITOR(
-          segmenter_t *s = get_segment(d->entry, false);
-          log_debug2("closing segment %s", cue_entry_vfile(d->entry));
-        );
+      // Close what the open got; the cue entry of d may have changed
+      // since.
+      segmenter_t *s = (segmenter_t *) (uintptr_t) fi->fh;
+      DE_MONITOR(
+        log_debug3("found d=%p, count=%d", d, d->open_count);
+        d->open_count -= 1;
+        if (d->open_count <= 0) {
+          d->open_count = 0;
+        }
+        log_debug2("closing segment %s", cue_entry_vfile(d->entry));
         segmenter_close(s);
-        fi->fh = 0;
-      }
-      mc_free(fullpath);
+      );
+      fi->fh = 0;
+      stats_inc(STAT_RELEASE);
+      return 0;
+    } else if (control_kind(path) == CONTROL_FILE) {
+      control_release((control_buf_t *) (uintptr_t) fi->fh);
+      fi->fh = 0;
       return 0;
     } else {
-      mc_free(fullpath);
       return -EIO;
     }
   }
 }
 
+// Only the control file can be written
+static int mp3cue_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  if (control_kind(path) != CONTROL_FILE || fi->fh == 0) {
+    return -EACCES;
+  }
+  return control_write(path, (control_buf_t *) (uintptr_t) fi->fh, buf, size);
+}
+
+// "echo command > control" truncates before it writes
+static int mp3cue_truncate(const char* path, off_t size)
+{
+  return control_writable(path) ? 0 : -EACCES;
+}
+
+// Called by the memory budget thread. Under pressure, or when the rest
+// of the process has used up the budget, the caches that can be built
+// again go too.
+static void shrink_caches(unsigned long limit, int all)
+{
+  DE_MONITOR(
+    seglist_lock(SEGMENT_LIST);
+    evict_segments(limit);
+    seglist_unlock(SEGMENT_LIST)
+  );
+  if (all) {
+    negcache_clear();
+    int listings = dircache_trim();
+    int sheets = cuecache_trim();
+    log_info3("membudget: dropped %d listings and %d cue sheets", listings, sheets);
+  }
+}
+
+static void *mp3cue_init(struct fuse_conn_info *conn)
+{
+  // Threads must be started here, fuse_main() forks into the background
+  logger_start();
+  trace_start();
+  watcher_start(BASEDIR);
+  dircache_init();
+  negcache_init(BASEDIR);
+  failcache_init();
+  if (CRAWL) {
+    crawler_start(BASEDIR, mp3cue_crawl_cue, NULL);
+  }
+  membudget_start(segment_bytes, shrink_caches);
+  prefetch_start(mp3cue_prefetch, NULL);
+  return NULL;
+}
+
+static void mp3cue_destroy(void *private_data)
+{
+  prefetch_stop();
+  membudget_stop();
+  crawler_stop();
+  sched_report();
+  latency_report();
+  failcache_report();
+  failcache_destroy();
+  negcache_destroy();
+  dircache_destroy();
+  watcher_stop();
+  trace_stop();
+  logger_stop();
+}
+
+/***********************************************************************
+ Timed and traced entry points of the operations above
+*/
+
+#define TIMED(op, trace, path, fh, offset, size, call) \
+  unsigned long long t0 = latency_start(); \
+  unsigned long long tt = trace_clock(); \
+  latency_op_begin(); \
+  int r = call; \
+  latency_op_end(op, t0, path); \
+  trace_op(trace, path, fh, offset, size, r, tt); \
+  return r
+
+static int timed_getattr(const char* path, struct stat *stbuf)
+{
+  TIMED(LAT_GETATTR, TRACE_GETATTR, path, 0, 0, 0, mp3cue_getattr(path, stbuf));
+}
+
+static int timed_readdir(const char* path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+  TIMED(LAT_READDIR, TRACE_READDIR, path, 0, offset, 0, mp3cue_readdir(path, buf, filler, offset, fi));
+}
+
+static int timed_open(const char* path, struct fuse_file_info *fi)
+{
+  TIMED(LAT_OPEN, TRACE_OPEN, path, fi->fh, 0, 0, mp3cue_open(path, fi));
+}
+
+static int timed_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  TIMED(LAT_READ, TRACE_READ, path, fi->fh, offset, size, mp3cue_read(path, buf, size, offset, fi));
+}
+
+// Released handles are traced with the value they had
+static int timed_release(const char* path, struct fuse_file_info *fi)
+{
+  uint64_t fh = fi->fh;
+  TIMED(LAT_RELEASE, TRACE_RELEASE, path, fh, 0, 0, mp3cue_release(path, fi));
+}
+
 static struct fuse_operations mp3cue_oper = {
-  .getattr = mp3cue_getattr,
-  .readdir = mp3cue_readdir,
-  .open = mp3cue_open,
-  .read = mp3cue_read,
-  .release = mp3cue_release,
+  .init = mp3cue_init,
+  .destroy = mp3cue_destroy,
+  .getattr = timed_getattr,
+  .readdir = timed_readdir,
+  .open = timed_open,
+  .read = timed_read,
+  .release = timed_release,
+  .write = mp3cue_write,
+  .truncate = mp3cue_truncate,
 };
 
 /***********************************************************************/
 
 extern FILE *log_handle()
 {
-  static FILE *log = NULL;
-  if (log == NULL) {
-    log = fopen("/tmp/mp3cue.log", "wt");
-  }
-  return log;
+  return logger_handle();
 }
 
 extern int log_this_severity(int severity)
 {
-  //int retval = (severity > LOG_DEBUG);
-  int retval=1;
-  return retval;
+  return severity >= logger_level();
+}
+
+// kill -USR1 logs more, kill -USR2 less
+static void on_log_signal(int sig)
+{
+  if (sig == SIGUSR1) {
+    logger_more_verbose();
+  } else {
+    logger_less_verbose();
+  }
+}
+
+/***********************************************************************
+ Setting up and tearing down the engine. main() goes through these, and
+ so do the benchmarks, which include this file with MP3CUEFUSE_NO_MAIN
+ and call the operations in mp3cue_oper directly.
+*/
+
+static void mp3cue_setup(void)
+{
+  intern_init();
+  stats_init();
+  latency_init();
+  control_register("stats", fill_stats);
+  control_register("metrics", fill_metrics);
+  control_register_command("control", fill_control, mp3cue_command);
+  if (alloc_profiling()) {
+    control_register("allocs", fill_allocs);
+  }
+  DATA = strtable_new(1024, data_key, data_destroy);
+  cuecache_init();
+  SEGMENT_LIST = seglist_new();
+  PINS = pinhash_new(100, HASH_CASE_SENSITIVE);
+  SIZE_HASH = strtable_new(1024, vfile_size_key, vfile_size_destroy);
+}
+
+// After option handling
+static void mp3cue_configure(int (*interrupted)(void))
+{
+  watcher_configure(WATCH_LIMIT, SCAN_INTERVAL);
+  negcache_configure(NEGATIVE_SLOTS, (int) NEGATIVE_TIMEOUT);
+  sched_configure(split_workers(WORKERS));
+  REQUEST_INTERRUPTED = interrupted;
+  inflight_configure(SPLIT_TIMEOUT, mp3cue_interrupted);
+  failcache_configure(FAIL_BACKOFF, FAIL_MAX_BACKOFF);
+  crawler_configure(CRAWL_THREADS);
+  latency_configure(LATENCY, SLOW_OP_MS);
+  logger_configure(LOG_FILE, LOG_LEVEL, 64 * 1024);
+  membudget_configure(MAX_MEM_USAGE_IN_MB);
+  trace_configure(TRACE_FILE);
+}
+
+static void mp3cue_set_basedir(const char* dir)
+{
+  mc_free(BASEDIR);
+  BASEDIR = mc_strdup(dir);
+  // paths are made as BASEDIR + path, path starts with '/'
+  int l = strlen(BASEDIR);
+  while (l > 1 && BASEDIR[l - 1] == '/') {
+    BASEDIR[--l] = '\0';
+  }
+}
+
+static void mp3cue_teardown(void)
+{
+  log_info3("destroying DATA hash (%d entries, %d slots)", strtable_count(DATA), strtable_slots(DATA));
+  strtable_destroy(DATA);
+  cuecache_destroy();
+  log_info("destroying SEGMENT_LIST");
+  seglist_destroy(SEGMENT_LIST);
+  pinhash_destroy(PINS);
+  PINS = NULL;
+  N_PINS = 0;
+  log_info("destroying SIZE_HASH");
+  strtable_destroy(SIZE_HASH);
+  log_info3("destroying %d interned strings (%lu bytes)", intern_count(), (unsigned long) intern_bytes());
+  intern_destroy();
+  control_destroy();
+  stats_destroy();
+  latency_destroy();
+  log_info("destroying BASEDIR");
+  mc_free(BASEDIR);
+  BASEDIR = NULL;
 }
 
 /***********************************************************************/
 
+#ifndef MP3CUEFUSE_NO_MAIN
+
 int main(int argc, char* argv[])
 {
   // Initialize
   mc_init();
-
-  DATA = datahash_new(100, HASH_CASE_SENSITIVE);
-  SEGMENT_LIST = seglist_new();
-  SIZE_HASH = vfilesize_hash_new(100, HASH_CASE_SENSITIVE);
+  mp3cue_setup();
 
   // Read in current sizes
   char* home=getenv("HOME");
-  char cfgfile[1024];
-  snprintf(cfgfile,1024-1,"%s/.mp3cuefuse",home);
-  read_in_sizes(cfgfile);
+  snprintf(SIZES_FILE,sizeof(SIZES_FILE)-1,"%s/.mp3cuefuse",home);
+  read_in_sizes(SIZES_FILE);
 
   // Option handling
 
   int option_index;
   struct option long_options[] = {
-    {"memory", 1, 0, 0},
+    {"memory", 1, 0, 'm'},
+    {"attr-timeout", 1, 0, 'A'},
+    {"entry-timeout", 1, 0, 'E'},
+    {"watch-limit", 1, 0, 'W'},
+    {"scan-interval", 1, 0, 'S'},
+    {"negative-timeout", 1, 0, 'N'},
+    {"negative-slots", 1, 0, 'n'},
+    {"workers", 1, 0, 'w'},
+    {"size-queue", 1, 0, 'q'},
+    {"prefetch-queue", 1, 0, 'p'},
+    {"split-timeout", 1, 0, 't'},
+    {"fail-backoff", 1, 0, 'b'},
+    {"fail-max-backoff", 1, 0, 'B'},
+    {"crawl", 0, 0, 'c'},
+    {"crawl-threads", 1, 0, 'T'},
+    {"crawl-no-sizes", 0, 0, 'z'},
+    {"no-latency", 0, 0, 'L'},
+    {"slow-op", 1, 0, 's'},
+    {"log-file", 1, 0, 'F'},
+    {"log-level", 1, 0, 'V'},
+    {"trace", 1, 0, 'R'},
     {0, 0, 0, 0}
   };
 
-  int c = getopt_long(argc, argv, "m:", long_options, &option_index);
+  int c;
   int _memset = 0;
-  if (c >= 0) {
+  while ((c = getopt_long(argc, argv, "+m:", long_options, &option_index)) >= 0) {
     if (c == 'm') {
       char* memory = optarg;
       MAX_MEM_USAGE_IN_MB = atoi(memory);
@@ -979,6 +2274,51 @@ int main(int argc, char* argv[])
         MAX_MEM_USAGE_IN_MB = 30;
       }
       _memset = 1;
+    } else if (c == 'A') {
+      ATTR_TIMEOUT = atof(optarg);
+    } else if (c == 'E') {
+      ENTRY_TIMEOUT = atof(optarg);
+    } else if (c == 'W') {
+      WATCH_LIMIT = atoi(optarg);
+    } else if (c == 'S') {
+      SCAN_INTERVAL = atoi(optarg);
+    } else if (c == 'N') {
+      NEGATIVE_TIMEOUT = atof(optarg);
+    } else if (c == 'n') {
+      NEGATIVE_SLOTS = atoi(optarg);
+    } else if (c == 'w') {
+      WORKERS = atoi(optarg);
+    } else if (c == 'q') {
+      sched_set_limit(SCHED_SIZE, atoi(optarg));
+    } else if (c == 'p') {
+      sched_set_limit(SCHED_PREFETCH, atoi(optarg));
+    } else if (c == 't') {
+      SPLIT_TIMEOUT = atoi(optarg);
+    } else if (c == 'b') {
+      FAIL_BACKOFF = atoi(optarg);
+    } else if (c == 'B') {
+      FAIL_MAX_BACKOFF = atoi(optarg);
+    } else if (c == 'c') {
+      CRAWL = true;
+    } else if (c == 'T') {
+      CRAWL_THREADS = atoi(optarg);
+    } else if (c == 'z') {
+      CRAWL_SIZES = false;
+    } else if (c == 'L') {
+      LATENCY = false;
+    } else if (c == 's') {
+      SLOW_OP_MS = atoi(optarg);
+    } else if (c == 'F') {
+      LOG_FILE = optarg;
+    } else if (c == 'V') {
+      LOG_LEVEL = logger_parse_level(optarg);
+      if (LOG_LEVEL < 0) {
+        return usage(argv[0]);
+      }
+    } else if (c == 'R') {
+      TRACE_FILE = optarg;
+    } else {
+      return usage(argv[0]);
     }
   }
 
@@ -988,19 +2328,30 @@ int main(int argc, char* argv[])
   } else {
     fprintf(stderr, "Max memory usage set to %dMB\n", MAX_MEM_USAGE_IN_MB);
   }
+  fprintf(stderr, "Attribute timeout %gs, entry timeout %gs\n", ATTR_TIMEOUT, ENTRY_TIMEOUT);
+  mp3cue_configure(fuse_interrupted);
+  signal(SIGUSR1, on_log_signal);
+  signal(SIGUSR2, on_log_signal);
 
   int retval = -1;
 
   if (optind < argc) {
-    BASEDIR = mc_strdup(argv[optind++]);
+    mp3cue_set_basedir(argv[optind++]);
     if (optind < argc) {
       int fargc;
-      char* *fargv = (char* *)mc_malloc(sizeof(char* ) * (argc - optind + 2));
+      char* *fargv = (char* *)mc_malloc(sizeof(char* ) * (argc - optind + 4));
+      char timeouts[128];
+      // intr: the kernel tells us when a client gives up on a request,
+      // fuse_interrupted() lets splits nobody waits for stop early
+      snprintf(timeouts, sizeof(timeouts), "intr,attr_timeout=%g,entry_timeout=%g,negative_timeout=%g",
+               ATTR_TIMEOUT, ENTRY_TIMEOUT, NEGATIVE_TIMEOUT);
       int k = 1;
       fargv[0] = argv[0];
       while (optind < argc) {
         fargv[k++] = argv[optind++];
       }
+      fargv[k++] = "-o";
+      fargv[k++] = timeouts;
       fargv[k] = NULL;
       fargc = k;
       log_info("Starting fuse_main");
@@ -1015,19 +2366,13 @@ int main(int argc, char* argv[])
   }
 
   // Write out
-  write_sizes(cfgfile);
+  write_sizes(SIZES_FILE);
 
   // Destroy
-
-  log_info("destroying DATA hash");
-  datahash_destroy(DATA);
-  log_info("destroying SEGMENT_LIST");
-  seglist_destroy(SEGMENT_LIST);
-  log_info("destroying SIZE_HASH");
-  vfilesize_hash_destroy(SIZE_HASH);
-  log_info("destroying BASEDIR");
-  mc_free(BASEDIR);
+  mp3cue_teardown();
 
   return retval;
 
 }
+
+#endif
@@ -0,0 +1,209 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "negcache.h"
+#include "watcher.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+typedef struct {
+  unsigned long hash;
+  unsigned long stamp;
+  time_t added;
+  char *path;
+} neg_slot_t;
+
+static int SLOTS = 4096;
+static int TTL = 60;
+static neg_slot_t *TABLE = NULL;
+static char *BASE = NULL;
+static int BASE_LEN = 0;
+static pthread_mutex_t NEG_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long HITS = 0;
+static unsigned long MISSES = 0;
+
+/**********************************************************************/
+
+static unsigned long hash_path(const char *path)
+{
+  unsigned long h = 5381;
+  const unsigned char *p = (const unsigned char *)path;
+  while (*p) {
+    h = ((h << 5) + h) ^ *p++;
+  }
+  return h;
+}
+
+// Stamp of the parent and grandparent directory of path. The
+// grandparent covers names in cue directories, whose cue sheet lives
+// there. Uses a stack buffer, so nothing gets allocated.
+static unsigned long dir_stamp(const char *path)
+{
+  if (!watcher_active()) {
+    return 0;
+  }
+  char buf[PATH_MAX];
+  int l = strlen(path);
+  if (BASE_LEN + l + 1 > PATH_MAX) {
+    return 0;
+  }
+  memcpy(buf, BASE, BASE_LEN);
+  memcpy(buf + BASE_LEN, path, l + 1);
+
+  unsigned long stamp = 0;
+  int k, i = BASE_LEN + l;
+  for (k = 0; k < 2; k++) {
+    for (; i > BASE_LEN && buf[i] != '/'; i--) ;
+    if (i <= BASE_LEN) {
+      buf[BASE_LEN] = '\0';
+      stamp += watcher_stamp(BASE);
+      break;
+    }
+    buf[i] = '\0';
+    stamp += watcher_stamp(buf);
+  }
+  return stamp;
+}
+
+/**********************************************************************/
+
+void negcache_configure(int slots, int ttl_in_s)
+{
+  int n = 1;
+  while (n < slots) {
+    n *= 2;
+  }
+  SLOTS = (slots <= 0) ? 0 : n;
+  TTL = ttl_in_s;
+}
+
+void negcache_init(const char *basedir)
+{
+  BASE = mc_strdup(basedir);
+  BASE_LEN = strlen(BASE);
+  if (SLOTS > 0) {
+    TABLE = (neg_slot_t *) mc_malloc(sizeof(neg_slot_t) * SLOTS);
+    memset(TABLE, 0, sizeof(neg_slot_t) * SLOTS);
+  }
+}
+
+void negcache_destroy(void)
+{
+  negcache_clear();
+  mc_free(TABLE);
+  TABLE = NULL;
+  mc_free(BASE);
+  BASE = NULL;
+}
+
+unsigned long negcache_stamp(const char *path)
+{
+  return dir_stamp(path);
+}
+
+int negcache_hit(const char *path)
+{
+  if (TABLE == NULL) {
+    return 0;
+  }
+
+  unsigned long h = hash_path(path);
+  neg_slot_t *slot = &TABLE[h & (SLOTS - 1)];
+  int hit = 0;
+  unsigned long stamp = 0;
+
+  pthread_mutex_lock(&NEG_MUTEX);
+  if (slot->path != NULL && slot->hash == h && strcmp(slot->path, path) == 0) {
+    stamp = slot->stamp;
+    hit = (time(NULL) - slot->added) < TTL;
+  }
+  pthread_mutex_unlock(&NEG_MUTEX);
+
+  if (hit) {
+    hit = (dir_stamp(path) == stamp);
+  }
+
+  pthread_mutex_lock(&NEG_MUTEX);
+  if (hit) {
+    HITS += 1;
+  } else {
+    MISSES += 1;
+  }
+  pthread_mutex_unlock(&NEG_MUTEX);
+
+  return hit;
+}
+
+void negcache_add(const char *path, unsigned long stamp)
+{
+  if (TABLE == NULL) {
+    return;
+  }
+
+  unsigned long h = hash_path(path);
+  neg_slot_t *slot = &TABLE[h & (SLOTS - 1)];
+  char *p = mc_strdup(path);
+
+  pthread_mutex_lock(&NEG_MUTEX);
+  char *old = slot->path;
+  slot->path = p;
+  slot->hash = h;
+  slot->stamp = stamp;
+  slot->added = time(NULL);
+  pthread_mutex_unlock(&NEG_MUTEX);
+
+  mc_free(old);
+}
+
+void negcache_clear(void)
+{
+  if (TABLE == NULL) {
+    return;
+  }
+  int i;
+  pthread_mutex_lock(&NEG_MUTEX);
+  for (i = 0; i < SLOTS; i++) {
+    mc_free(TABLE[i].path);
+    TABLE[i].path = NULL;
+  }
+  pthread_mutex_unlock(&NEG_MUTEX);
+}
+
+unsigned long negcache_hits(void)
+{
+  return HITS;
+}
+
+unsigned long negcache_misses(void)
+{
+  return MISSES;
+}
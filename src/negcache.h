@@ -0,0 +1,44 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __NEGCACHE__HOD
+#define __NEGCACHE__HOD
+
+/*
+ * Bounded cache of paths that were looked up and don't exist (Finder,
+ * Spotlight and desktop indexers probe for ._*, .DS_Store, folder.jpg
+ * etc.). It's direct mapped on a hash of the path; a newer miss simply
+ * replaces an older one. An entry is dropped when the watcher stamp of
+ * its parent or grandparent directory changes, or when it is older
+ * than the time to live. Lookups don't allocate.
+ */
+
+void negcache_configure(int slots, int ttl_in_s);
+void negcache_init(const char *basedir);
+void negcache_destroy(void);
+
+unsigned long negcache_stamp(const char *path);
+int negcache_hit(const char *path);
+void negcache_add(const char *path, unsigned long stamp);
+void negcache_clear(void);
+
+unsigned long negcache_hits(void);
+unsigned long negcache_misses(void);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "prefetch.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+typedef struct path_s {
+  char *path;
+  int op;
+  struct path_s *next;
+} path_t;
+
+static pthread_mutex_t PREFETCH_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t PREFETCH_COND = PTHREAD_COND_INITIALIZER;
+static path_t *HEAD = NULL;
+static path_t *TAIL = NULL;
+static int QUEUED = 0;
+static unsigned long DONE = 0;
+static int RUNNING = 0;
+static int STOP = 0;
+static pthread_t THREAD;
+static prefetch_fn FN = NULL;
+static void *DATA = NULL;
+
+/**********************************************************************/
+
+static void *prefetch_thread(void *unused)
+{
+  pthread_mutex_lock(&PREFETCH_MUTEX);
+  while (!STOP) {
+    if (HEAD == NULL) {
+      pthread_cond_wait(&PREFETCH_COND, &PREFETCH_MUTEX);
+      continue;
+    }
+    path_t *p = HEAD;
+    HEAD = p->next;
+    if (HEAD == NULL) {
+      TAIL = NULL;
+    }
+    QUEUED -= 1;
+    pthread_mutex_unlock(&PREFETCH_MUTEX);
+
+    log_info2("prefetch: %s", p->path);
+    FN(p->path, p->op, DATA);
+    mc_free(p->path);
+    mc_free(p);
+
+    pthread_mutex_lock(&PREFETCH_MUTEX);
+    DONE += 1;
+  }
+  pthread_mutex_unlock(&PREFETCH_MUTEX);
+  return NULL;
+}
+
+/**********************************************************************/
+
+int prefetch_start(prefetch_fn fn, void *data)
+{
+  FN = fn;
+  DATA = data;
+  STOP = 0;
+  if (pthread_create(&THREAD, NULL, prefetch_thread, NULL) != 0) {
+    log_error("prefetch: cannot start the prefetch thread");
+    return -1;
+  }
+  RUNNING = 1;
+  return 0;
+}
+
+void prefetch_stop(void)
+{
+  if (!RUNNING) {
+    return;
+  }
+  pthread_mutex_lock(&PREFETCH_MUTEX);
+  STOP = 1;
+  pthread_cond_signal(&PREFETCH_COND);
+  pthread_mutex_unlock(&PREFETCH_MUTEX);
+  pthread_join(THREAD, NULL);
+  RUNNING = 0;
+
+  while (HEAD != NULL) {
+    path_t *p = HEAD;
+    HEAD = p->next;
+    mc_free(p->path);
+    mc_free(p);
+  }
+  TAIL = NULL;
+  QUEUED = 0;
+}
+
+int prefetch_queue(const char *path, int op)
+{
+  pthread_mutex_lock(&PREFETCH_MUTEX);
+  if (QUEUED >= PREFETCH_MAX_QUEUED) {
+    pthread_mutex_unlock(&PREFETCH_MUTEX);
+    return -EAGAIN;
+  }
+  path_t *p = (path_t *) mc_malloc(sizeof(path_t));
+  p->path = mc_strdup(path);
+  p->op = op;
+  p->next = NULL;
+  if (TAIL == NULL) {
+    HEAD = p;
+  } else {
+    TAIL->next = p;
+  }
+  TAIL = p;
+  QUEUED += 1;
+  pthread_cond_signal(&PREFETCH_COND);
+  pthread_mutex_unlock(&PREFETCH_MUTEX);
+  return 0;
+}
+
+int prefetch_stopping(void)
+{
+  pthread_mutex_lock(&PREFETCH_MUTEX);
+  int stop = STOP;
+  pthread_mutex_unlock(&PREFETCH_MUTEX);
+  return stop;
+}
+
+int prefetch_queued(void)
+{
+  pthread_mutex_lock(&PREFETCH_MUTEX);
+  int n = QUEUED;
+  pthread_mutex_unlock(&PREFETCH_MUTEX);
+  return n;
+}
+
+unsigned long prefetch_done(void)
+{
+  pthread_mutex_lock(&PREFETCH_MUTEX);
+  unsigned long n = DONE;
+  pthread_mutex_unlock(&PREFETCH_MUTEX);
+  return n;
+}
@@ -0,0 +1,50 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __PREFETCH__HOD
+#define __PREFETCH__HOD
+
+/*
+ * Background work on the tracks under a path, asked for through the
+ * control file: loading them, and pinning or unpinning them, so a write
+ * to the control file doesn't walk a whole library. A thread works
+ * through the queued paths in order and hands each to a callback with
+ * its operation. The callback splits with the prefetch class of the
+ * scheduler, so it gives way to playback, and looks at
+ * prefetch_stopping() between tracks.
+ */
+
+#define PREFETCH_MAX_QUEUED 64
+
+#define PREFETCH_LOAD   0
+#define PREFETCH_PIN    1     // pin, then load
+#define PREFETCH_UNPIN  2
+
+typedef void (*prefetch_fn)(const char *path, int op, void *data);
+
+int prefetch_start(prefetch_fn fn, void *data);
+void prefetch_stop(void);
+
+int prefetch_queue(const char *path, int op);   // 0, or -EAGAIN when the queue is full
+int prefetch_stopping(void);
+
+int prefetch_queued(void);
+unsigned long prefetch_done(void);
+
+#endif
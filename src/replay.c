@@ -0,0 +1,410 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+/*
+ * Replays a trace recorded with --trace against the engine in-process.
+ *
+ *   replay [-d dir] [-g] [-f] [-x speed] [-p] trace
+ *
+ * Every recorded thread gets a thread of its own that issues its
+ * operations in the recorded order; by default at the recorded times
+ * (-x 2 plays twice as fast), with -f as fast as possible. dir is the
+ * library, the recorded paths are used as they are. With -g a
+ * synthetic library is made in dir instead and every traced track and
+ * directory is mapped onto one of it, so a trace of a library that
+ * isn't at hand can still be played. -p prints the trace as text.
+ *
+ * Prints the operations replayed, how many had another outcome than
+ * when recorded, and p50/p99 per operation.
+ */
+
+#define MP3CUEFUSE_NO_MAIN
+#include "mp3cuefuse.c"
+#include "synth.h"
+
+typedef struct {
+  unsigned long long token;   // handle in the trace
+  struct fuse_file_info fi;
+} handle_t;
+
+typedef struct {
+  int thread;
+  trace_rec_t **recs;
+  int n;
+  unsigned long ops;
+  unsigned long diverged;
+  unsigned long orphans;
+  char *buf;
+  size_t buf_size;
+} player_t;
+
+static trace_t *TRACE = NULL;
+static char **PATHS = NULL;       // path to play for each traced path
+static handle_t *HANDLES = NULL;
+static int N_HANDLES = 0;
+static int HANDLES_SIZE = 0;
+static pthread_mutex_t HANDLE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static double SPEED = 1.0;
+static int FAST = false;
+static unsigned long long START_NS = 0;
+static latency_hist_t BEFORE[TRACE_OPS];
+static const int LAT_OF[TRACE_OPS] = { LAT_GETATTR, LAT_READDIR, LAT_OPEN, LAT_READ, LAT_RELEASE };
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int count_filler(void *buf, const char* name, const struct stat *st, off_t off)
+{
+  return 0;
+}
+
+/**********************************************************************/
+
+static void handle_add(unsigned long long token, struct fuse_file_info *fi)
+{
+  pthread_mutex_lock(&HANDLE_MUTEX);
+  if (N_HANDLES == HANDLES_SIZE) {
+    HANDLES_SIZE = (HANDLES_SIZE == 0) ? 64 : HANDLES_SIZE * 2;
+    HANDLES = (handle_t *) realloc(HANDLES, sizeof(handle_t) * HANDLES_SIZE);
+  }
+  HANDLES[N_HANDLES].token = token;
+  HANDLES[N_HANDLES].fi = *fi;
+  N_HANDLES += 1;
+  pthread_mutex_unlock(&HANDLE_MUTEX);
+}
+
+// Handles with the same token may be used for each other
+static int handle_get(unsigned long long token, struct fuse_file_info *fi, int take)
+{
+  int i, found = false;
+  pthread_mutex_lock(&HANDLE_MUTEX);
+  for (i = N_HANDLES - 1; i >= 0 && !found; i--) {
+    if (HANDLES[i].token == token) {
+      *fi = HANDLES[i].fi;
+      if (take) {
+        HANDLES[i] = HANDLES[--N_HANDLES];
+      }
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&HANDLE_MUTEX);
+  return found;
+}
+
+/**********************************************************************/
+
+static int play(player_t *p, trace_rec_t *r)
+{
+  const char* path = PATHS[r->path];
+  struct fuse_file_info fi;
+  struct stat st;
+
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_RDONLY;
+  switch (r->op) {
+    case TRACE_GETATTR:
+      return mp3cue_oper.getattr(path, &st);
+    case TRACE_READDIR:
+      return mp3cue_oper.readdir(path, NULL, count_filler, r->offset, NULL);
+    case TRACE_OPEN: {
+      int res = mp3cue_oper.open(path, &fi);
+      if (res == 0) {
+        handle_add(r->handle, &fi);
+      }
+      return res;
+    }
+    case TRACE_READ:
+      if (r->handle != 0 && !handle_get(r->handle, &fi, false)) {
+        p->orphans += 1;
+        return r->result;
+      }
+      if (p->buf_size < r->size) {
+        p->buf = (char*) realloc(p->buf, r->size);
+        p->buf_size = r->size;
+      }
+      return mp3cue_oper.read(path, p->buf, r->size, r->offset, &fi);
+    case TRACE_RELEASE:
+      if (r->handle != 0 && !handle_get(r->handle, &fi, true)) {
+        p->orphans += 1;
+        return r->result;
+      }
+      return mp3cue_oper.release(path, &fi);
+  }
+  return -EINVAL;
+}
+
+static void *player(void *data)
+{
+  player_t *p = (player_t *) data;
+  int i;
+  for (i = 0; i < p->n; i++) {
+    trace_rec_t *r = p->recs[i];
+    if (!FAST) {
+      unsigned long long at = START_NS + (unsigned long long) (r->t_ns / SPEED);
+      unsigned long long now = now_ns();
+      if (at > now) {
+        struct timespec ts = { (at - now) / 1000000000ULL, (at - now) % 1000000000ULL };
+        nanosleep(&ts, NULL);
+      }
+    }
+    int res = play(p, r);
+    p->ops += 1;
+    if ((res < 0) != (r->result < 0)) {
+      p->diverged += 1;
+    }
+  }
+  return NULL;
+}
+
+static int by_time(const void *a, const void *b)
+{
+  const trace_rec_t *x = *(trace_rec_t * const *) a, *y = *(trace_rec_t * const *) b;
+  return (x->t_ns < y->t_ns) ? -1 : (x->t_ns > y->t_ns);
+}
+
+/**********************************************************************/
+
+typedef struct {
+  char **v;
+  int n;
+} list_of_t;
+
+static void list_add(list_of_t *l, const char* s)
+{
+  l->v = (char**) realloc(l->v, sizeof(char*) * (l->n + 1));
+  l->v[l->n++] = strdup(s);
+}
+
+static void collect(const char* path, list_of_t *dirs, list_of_t *tracks);
+
+static int collect_filler(void *buf, const char* name, const struct stat *st, off_t off)
+{
+  if (name[0] != '.') {
+    list_add((list_of_t *) buf, name);
+  }
+  return 0;
+}
+
+// Every directory and track in the mount
+static void collect(const char* path, list_of_t *dirs, list_of_t *tracks)
+{
+  list_of_t names = { NULL, 0 };
+  char sub[4096];
+  int i;
+  list_add(dirs, path);
+  mp3cue_oper.readdir(path, &names, collect_filler, 0, NULL);
+  for (i = 0; i < names.n; i++) {
+    struct stat st;
+    snprintf(sub, sizeof(sub), "%s%s%s", path, (strcmp(path, "/") == 0) ? "" : "/", names.v[i]);
+    if (mp3cue_oper.getattr(sub, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        collect(sub, dirs, tracks);
+      } else if (isExt(sub, ".mp3") || isExt(sub, ".ogg")) {
+        list_add(tracks, sub);
+      }
+    }
+    free(names.v[i]);
+  }
+  free(names.v);
+}
+
+// Maps the traced paths onto the synthetic library: paths that were
+// opened, or look like audio, onto tracks; paths that were listed onto
+// directories. Hidden and control paths are played as they are.
+static void map_paths(void)
+{
+  list_of_t dirs = { NULL, 0 }, tracks = { NULL, 0 };
+  char *kind = (char*) calloc(TRACE->n_paths, 1);
+  int i, nd = 0, nt = 0;
+
+  collect("/", &dirs, &tracks);
+  for (i = 0; i < TRACE->n_recs; i++) {
+    trace_rec_t *r = &TRACE->recs[i];
+    if (r->op == TRACE_READDIR) {
+      kind[r->path] = 'd';
+    } else if (r->op != TRACE_GETATTR) {
+      kind[r->path] = 't';
+    }
+  }
+  for (i = 0; i < TRACE->n_paths; i++) {
+    const char* p = TRACE->paths[i];
+    const char* bn = strrchr(p, '/');
+    if (kind[i] == 0 && (isExt(p, ".mp3") || isExt(p, ".ogg") || isExt(p, ".flac"))) {
+      kind[i] = 't';
+    }
+    if (control_kind(p) != CONTROL_NONE || (bn != NULL && bn[1] == '.')) {
+      kind[i] = 0;
+    }
+    if (kind[i] == 't' && tracks.n > 0) {
+      PATHS[i] = strdup(tracks.v[nt++ % tracks.n]);
+    } else if (kind[i] == 'd' && dirs.n > 0) {
+      PATHS[i] = strdup(dirs.v[nd++ % dirs.n]);
+    } else {
+      PATHS[i] = strdup(p);
+    }
+  }
+  for (i = 0; i < dirs.n; i++) {
+    free(dirs.v[i]);
+  }
+  for (i = 0; i < tracks.n; i++) {
+    free(tracks.v[i]);
+  }
+  free(dirs.v);
+  free(tracks.v);
+  free(kind);
+}
+
+static void print_trace(void)
+{
+  int i;
+  printf("# %d operations, %d paths, %d threads\n", TRACE->n_recs, TRACE->n_paths, TRACE->threads);
+  printf("# ms thread op handle offset size result us path\n");
+  for (i = 0; i < TRACE->n_recs; i++) {
+    trace_rec_t *r = &TRACE->recs[i];
+    printf("%.3f %d %s %llx %lld %u %d %u %s\n", r->t_ns / 1e6, r->thread, trace_op_name(r->op),
+           r->handle, r->offset, r->size, r->result, r->dur_us, TRACE->paths[r->path]);
+  }
+}
+
+static void report(double secs, unsigned long ops, unsigned long diverged, unsigned long orphans)
+{
+  double span = (TRACE->n_recs > 0) ? TRACE->recs[TRACE->n_recs - 1].t_ns / 1e9 : 0.0;
+  int i;
+  printf("replay ops=%lu secs=%.3f traced_secs=%.3f ops/s=%.0f diverged=%lu orphans=%lu\n",
+         ops, secs, span, (secs > 0.0) ? ops / secs : 0.0, diverged, orphans);
+  latency_hist_t *h = (latency_hist_t *) mc_malloc(sizeof(latency_hist_t));
+  for (i = 0; i < TRACE_OPS; i++) {
+    int b;
+    latency_snapshot(LAT_OF[i], h);
+    for (b = 0; b < LAT_BUCKETS; b++) {
+      h->counts[b] -= BEFORE[i].counts[b];
+    }
+    h->count -= BEFORE[i].count;
+    h->sum_us -= BEFORE[i].sum_us;
+    if (h->count > 0) {
+      printf("%-8s count=%lu mean_us=%llu p50_us=%llu p99_us=%llu\n", trace_op_name(i),
+             h->count, h->sum_us / h->count, latency_quantile(h, 0.50), latency_quantile(h, 0.99));
+    }
+  }
+  mc_free(h);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* dir = "/tmp/mp3cue_replay";
+  int synthetic = false, print = false, i, c;
+
+  while ((c = getopt(argc, argv, "d:gfx:p")) != -1) {
+    switch (c) {
+      case 'd': dir = optarg; break;
+      case 'g': synthetic = true; break;
+      case 'f': FAST = true; break;
+      case 'x': SPEED = atof(optarg); break;
+      case 'p': print = true; break;
+      default: optind = argc + 1; break;
+    }
+  }
+  if (optind != argc - 1 || SPEED <= 0.0) {
+    fprintf(stderr, "usage: %s [-d dir] [-g] [-f] [-x speed] [-p] trace\n", argv[0]);
+    return 1;
+  }
+
+  mc_init();
+  TRACE = trace_load(argv[optind]);
+  if (TRACE == NULL) {
+    fprintf(stderr, "replay: cannot read trace %s\n", argv[optind]);
+    return 1;
+  }
+  if (print) {
+    print_trace();
+    trace_free(TRACE);
+    return 0;
+  }
+  if (synthetic) {
+    synth_config_t cfg;
+    synth_defaults(&cfg);
+    if (synth_library(dir, &cfg) < 0) {
+      fprintf(stderr, "replay: cannot make a library in %s\n", dir);
+      return 1;
+    }
+  }
+
+  LOG_FILE = "/tmp/replay_mp3cue.log";
+  mp3cue_setup();
+  mp3cue_configure(NULL);
+  mp3cue_set_basedir(dir);
+  mp3cue_oper.init(NULL);
+
+  PATHS = (char**) calloc(TRACE->n_paths, sizeof(char*));
+  if (synthetic) {
+    map_paths();
+  } else {
+    for (i = 0; i < TRACE->n_paths; i++) {
+      PATHS[i] = strdup(TRACE->paths[i]);
+    }
+  }
+
+  int n = TRACE->threads;
+  player_t *players = (player_t *) calloc(n, sizeof(player_t));
+  pthread_t *tids = (pthread_t *) calloc(n, sizeof(pthread_t));
+  for (i = 0; i < TRACE->n_recs; i++) {
+    player_t *p = &players[TRACE->recs[i].thread - 1];
+    p->recs = (trace_rec_t **) realloc(p->recs, sizeof(trace_rec_t *) * (p->n + 1));
+    p->recs[p->n++] = &TRACE->recs[i];
+  }
+  // mapping went through the engine too, only count what follows
+  for (i = 0; i < TRACE_OPS; i++) {
+    latency_snapshot(LAT_OF[i], &BEFORE[i]);
+  }
+  START_NS = now_ns();
+  for (i = 0; i < n; i++) {
+    qsort(players[i].recs, players[i].n, sizeof(trace_rec_t *), by_time);
+    pthread_create(&tids[i], NULL, player, &players[i]);
+  }
+  unsigned long ops = 0, diverged = 0, orphans = 0;
+  for (i = 0; i < n; i++) {
+    pthread_join(tids[i], NULL);
+    ops += players[i].ops;
+    diverged += players[i].diverged;
+    orphans += players[i].orphans;
+    free(players[i].recs);
+    free(players[i].buf);
+  }
+  report((now_ns() - START_NS) / 1e9, ops, diverged, orphans);
+
+  // Handles the trace didn't release
+  for (i = 0; i < N_HANDLES; i++) {
+    mp3cue_oper.release("", &HANDLES[i].fi);
+  }
+  mp3cue_oper.destroy(NULL);
+  mp3cue_teardown();
+  for (i = 0; i < TRACE->n_paths; i++) {
+    free(PATHS[i]);
+  }
+  free(PATHS);
+  free(HANDLES);
+  free(players);
+  free(tids);
+  trace_free(TRACE);
+  return 0;
+}
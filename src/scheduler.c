@@ -0,0 +1,246 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "scheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <elementals/log.h>
+
+static pthread_mutex_t SCHED_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t CONDS[SCHED_CLASSES] = {
+  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER
+};
+
+// libmp3splt isn't reentrant (see GARD_WITH_MUTEX in segmenter.c), so
+// by default one split runs at a time. The caller caps workers with
+// segmenter_max_parallel().
+static int WORKERS = 1;
+static int RUNNING = 0;
+static sched_class_stats_t STATS[SCHED_CLASSES] = {
+  { 0, 0, 0, 0, 0, 0.0, 0.0 },    // reads: unlimited
+  { 0, 0, 0, 0, 0, 0.0, 0.0 },    // opens: unlimited
+  { 0, 0, 16, 0, 0, 0.0, 0.0 },
+  { 0, 0, 8, 0, 0, 0.0, 0.0 },
+  { 0, 0, 0, 0, 0, 0.0, 0.0 }     // crawl: bounded by the crawler threads
+};
+
+// Broadcast whenever a request leaves a class, for sched_wait_room()
+static pthread_cond_t ROOM = PTHREAD_COND_INITIALIZER;
+
+static const char *NAMES[SCHED_CLASSES] = { "read", "open", "prefetch", "size", "crawl" };
+
+/**********************************************************************/
+
+static double now_ms(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Must be called with SCHED_MUTEX held
+static int higher_waiting(int klass)
+{
+  int k;
+  for (k = 0; k < klass; k++) {
+    if (STATS[k].waiting > 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Must be called with SCHED_MUTEX held
+static void wake_next(void)
+{
+  int k;
+  for (k = 0; k < SCHED_CLASSES; k++) {
+    if (STATS[k].waiting > 0) {
+      pthread_cond_broadcast(&CONDS[k]);
+      return;
+    }
+  }
+}
+
+/**********************************************************************/
+
+void sched_configure(int workers)
+{
+  pthread_mutex_lock(&SCHED_MUTEX);
+  WORKERS = (workers < 1) ? 1 : workers;
+  wake_next();
+  pthread_mutex_unlock(&SCHED_MUTEX);
+}
+
+void sched_set_limit(int klass, int limit)
+{
+  pthread_mutex_lock(&SCHED_MUTEX);
+  STATS[klass].limit = limit;
+  pthread_mutex_unlock(&SCHED_MUTEX);
+}
+
+int sched_workers(void)
+{
+  return WORKERS;
+}
+
+int sched_enter(int klass)
+{
+  return sched_enter_cancellable(klass, NULL, NULL);
+}
+
+// While waiting, cancelled(data) is asked ten times a second whether
+// the request is still wanted.
+int sched_enter_cancellable(int klass, int (*cancelled)(void *data), void *data)
+{
+  sched_class_stats_t *st = &STATS[klass];
+  pthread_mutex_lock(&SCHED_MUTEX);
+
+  if (st->limit > 0 && st->waiting + st->running >= st->limit) {
+    st->rejected += 1;
+    pthread_mutex_unlock(&SCHED_MUTEX);
+    log_debug2("scheduler: %s class busy", NAMES[klass]);
+    return SCHED_BUSY;
+  }
+
+  double t0 = now_ms();
+  st->waiting += 1;
+  while (RUNNING >= WORKERS || higher_waiting(klass)) {
+    if (cancelled == NULL) {
+      pthread_cond_wait(&CONDS[klass], &SCHED_MUTEX);
+    } else {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 100 * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&CONDS[klass], &SCHED_MUTEX, &ts);
+      if (cancelled(data)) {
+        st->waiting -= 1;
+        // we may have been holding back a lower class
+        wake_next();
+        pthread_cond_broadcast(&ROOM);
+        pthread_mutex_unlock(&SCHED_MUTEX);
+        log_debug2("scheduler: %s request cancelled while waiting", NAMES[klass]);
+        return SCHED_CANCELLED;
+      }
+    }
+  }
+  st->waiting -= 1;
+  st->running += 1;
+  RUNNING += 1;
+
+  double waited = now_ms() - t0;
+  st->admitted += 1;
+  st->wait_total_ms += waited;
+  if (waited > st->wait_max_ms) {
+    st->wait_max_ms = waited;
+  }
+  // Somebody else of this class may fit in too
+  if (RUNNING < WORKERS) {
+    wake_next();
+  }
+  pthread_mutex_unlock(&SCHED_MUTEX);
+
+  if (waited > 1000.0) {
+    log_info3("scheduler: %s request waited %dms", NAMES[klass], (int)waited);
+  }
+  return SCHED_OK;
+}
+
+void sched_leave(int klass)
+{
+  pthread_mutex_lock(&SCHED_MUTEX);
+  STATS[klass].running -= 1;
+  RUNNING -= 1;
+  wake_next();
+  pthread_cond_broadcast(&ROOM);
+  pthread_mutex_unlock(&SCHED_MUTEX);
+}
+
+// For requests that must not fail when their class is full: waits until
+// the class is below its limit. Returns SCHED_OK, or SCHED_CANCELLED
+// when cancelled(data) says the request is no longer wanted. The room
+// isn't reserved, sched_enter() may still refuse.
+int sched_wait_room(int klass, int (*cancelled)(void *data), void *data)
+{
+  sched_class_stats_t *st = &STATS[klass];
+  int result = SCHED_OK;
+  pthread_mutex_lock(&SCHED_MUTEX);
+  while (st->limit > 0 && st->waiting + st->running >= st->limit) {
+    if (cancelled != NULL && cancelled(data)) {
+      result = SCHED_CANCELLED;
+      break;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 100 * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec += 1;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&ROOM, &SCHED_MUTEX, &ts);
+  }
+  pthread_mutex_unlock(&SCHED_MUTEX);
+  return result;
+}
+
+// Whether requests of a higher class than klass are waiting. Background
+// work checks this before starting something new.
+int sched_foreground_waiting(int klass)
+{
+  pthread_mutex_lock(&SCHED_MUTEX);
+  int waiting = higher_waiting(klass);
+  pthread_mutex_unlock(&SCHED_MUTEX);
+  return waiting;
+}
+
+void sched_stats(int klass, sched_class_stats_t * out)
+{
+  pthread_mutex_lock(&SCHED_MUTEX);
+  memcpy(out, &STATS[klass], sizeof(sched_class_stats_t));
+  pthread_mutex_unlock(&SCHED_MUTEX);
+}
+
+const char *sched_class_name(int klass)
+{
+  return NAMES[klass];
+}
+
+void sched_report(void)
+{
+  int k;
+  for (k = 0; k < SCHED_CLASSES; k++) {
+    sched_class_stats_t st;
+    sched_stats(k, &st);
+    log_info5("scheduler: %-8s queued=%d running=%d admitted=%lu",
+              NAMES[k], st.waiting, st.running, st.admitted);
+    log_info5("scheduler: %-8s rejected=%lu avg wait=%.1fms max wait=%.1fms",
+              NAMES[k], st.rejected,
+              (st.admitted > 0) ? st.wait_total_ms / st.admitted : 0.0, st.wait_max_ms);
+  }
+}
@@ -0,0 +1,66 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __SCHEDULER__HOD
+#define __SCHEDULER__HOD
+
+/*
+ * Admission of split work. There are a fixed number of worker slots;
+ * when a slot frees up, the waiting request of the highest priority
+ * class gets it. Each class has a limit on the number of requests
+ * waiting or running; above it sched_enter() refuses at once, so a
+ * scanning storm can't pile up behind playback.
+ */
+
+#define SCHED_READ      0   // read on an open handle
+#define SCHED_OPEN      1   // open of a track
+#define SCHED_PREFETCH  2   // background warming
+#define SCHED_SIZE      3   // getattr that only needs the size
+#define SCHED_CRAWL     4   // sizes computed by the crawler
+#define SCHED_CLASSES   5
+
+#define SCHED_OK        0
+#define SCHED_BUSY     -1
+#define SCHED_CANCELLED -2
+
+typedef struct {
+  int waiting;
+  int running;
+  int limit;
+  unsigned long admitted;
+  unsigned long rejected;
+  double wait_total_ms;
+  double wait_max_ms;
+} sched_class_stats_t;
+
+void sched_configure(int workers);
+void sched_set_limit(int klass, int limit);
+int sched_workers(void);
+
+int sched_enter(int klass);
+int sched_enter_cancellable(int klass, int (*cancelled)(void *data), void *data);
+void sched_leave(int klass);
+int sched_wait_room(int klass, int (*cancelled)(void *data), void *data);
+int sched_foreground_waiting(int klass);
+
+void sched_stats(int klass, sched_class_stats_t * out);
+const char *sched_class_name(int klass);
+void sched_report(void);
+
+#endif
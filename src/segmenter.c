@@ -19,6 +19,7 @@
 */
 
 #include "segmenter.h"
+#include "latency.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +29,8 @@
 #include <elementals/log.h>
 #include <elementals/memcheck.h>
 #include <elementals/memblock.h>
+#define ALLOC_TAG ALLOC_SEGMENT
+#include "allocprof.h"
 
 #define GARD_WITH_MUTEX
 
@@ -49,47 +52,64 @@ static char* getExt(const char* filename)
   }
 }
 
-static void replace(char** s, const char* n)
+// Returns 1 if the value changed
+static int replace(char** s, const char* n)
 {
-  mc_free(*s);
   if (n == NULL) {
-    *s = mc_strdup("");
-  } else {
-    *s = mc_strdup(n);
+    n = "";
+  }
+  if (*s != NULL && strcmp(*s, n) == 0) {
+    return 0;
   }
+  mc_free(*s);
+  *s = mc_strdup(n);
+  return 1;
 }
 
 /**********************************************************************/
 
 static void mp3splt_writer(const void* ptr, size_t size, size_t nmemb, void* cb_data)
 {
-  memblock_t* f = (memblock_t* ) cb_data;
-  memblock_write(f, ptr, size * nmemb);
+  segmenter_t* S = (segmenter_t* ) cb_data;
+  memblock_write(S->pending, ptr, size * nmemb);
+  // Every now and then ask whether anybody still wants this split
+  if (S->cancel != NULL && (++S->writes % 64) == 0) {
+    if (S->cancel(S->cancel_data)) {
+      log_debug("segmenter: cancelling split");
+      S->cancelled = 1;
+      mp3splt_stop_split((splt_state* ) S->state);
+    }
+  }
 }
 
 /**********************************************************************/
 
 static int mp3splt_err(splt_state* state, splt_code error) {
   if (state == NULL) {
-    return log_error2("segmenter: error %d", error);
+    log_error2("segmenter: error %d", error);
   } else {
     log_error3("segmenter: error %d (%s)", error, mp3splt_get_strerror(state, error));
     error = mp3splt_free_state(state);
     if (error < 0) {
-      return log_error2("segmenter: free_state: error %d", error);
+      log_error2("segmenter: free_state: error %d", error);
     }
   }
   return SEGMENTER_ERR_CREATE;
 }
 
-static int mp3splt(segmenter_t* S)
+// Splits seg into S->pending
+static int mp3splt(segmenter_t* S, segment_t* seg)
 {
-  memblock_clear(S->blk);
+  S->writes = 0;
+  S->cancelled = 0;
+  if (S->cancel != NULL && S->cancel(S->cancel_data)) {
+    return SEGMENTER_ERR_CANCELLED;
+  }
 
-  int begin_offset_in_hs = S->segment.begin_offset_in_ms / 10;
+  int begin_offset_in_hs = seg->begin_offset_in_ms / 10;
   int end_offset_in_hs = -1;
-  if (S->segment.end_offset_in_ms >= 0) {
-    end_offset_in_hs = S->segment.end_offset_in_ms / 10;
+  if (seg->end_offset_in_ms >= 0) {
+    end_offset_in_hs = seg->end_offset_in_ms / 10;
   }
   
   splt_code error = SPLT_OK;
@@ -107,11 +127,11 @@ static int mp3splt(segmenter_t* S)
   if (error<0) return mp3splt_err(state,error);
 
   // Set filename to split and pretend mode, for memory based splitting
-  error = mp3splt_set_filename_to_split(state, S->segment.filename);
+  error = mp3splt_set_filename_to_split(state, seg->filename);
   if (error<0) return mp3splt_err(state,error);
   error = mp3splt_set_int_option(state, SPLT_OPT_PRETEND_TO_SPLIT, SPLT_TRUE);
   if (error<0) return mp3splt_err(state,error);
-  error = mp3splt_set_pretend_to_split_write_function(state, mp3splt_writer, (void* ) S->blk);
+  error = mp3splt_set_pretend_to_split_write_function(state, mp3splt_writer, (void* ) S);
   if (error<0) return mp3splt_err(state,error);
 
   // Create splitpoints
@@ -133,16 +153,16 @@ static int mp3splt(segmenter_t* S)
   {
     splt_tags *tags = mp3splt_tags_new(NULL);
 
-    const char* title = S->segment.title;
-    const char* artist = S->segment.artist;
-    const char* album = S->segment.album;
-    const char* performer = S->segment.album_artist;
+    const char* title = seg->title;
+    const char* artist = seg->artist;
+    const char* album = seg->album;
+    const char* performer = seg->album_artist;
     char year[20];
-    snprintf(year, 20, "%d", S->segment.year);
-    const char* comment = S->segment.comment;
-    const char* genre = S->segment.genre;
+    snprintf(year, 20, "%d", seg->year);
+    const char* comment = seg->comment;
+    const char* genre = seg->genre;
     char track[20];
-    snprintf(track, 20, "%d", S->segment.track);
+    snprintf(track, 20, "%d", seg->track);
 
     error = mp3splt_read_original_tags(state);
     if (error<0) return mp3splt_err(state,error);
@@ -167,13 +187,17 @@ static int mp3splt(segmenter_t* S)
   }
 
   // split the stuff
-  error = mp3splt_split(state);
-  if (error<0) return mp3splt_err(state,error);
+  S->state = (void* ) state;
+  splt_code result = mp3splt_split(state);
+  S->state = NULL;
+  if (result<0) return mp3splt_err(state,result);
 
   error = mp3splt_free_state(state);
-  if (error<0) return mp3splt_err(state,error);
+  if (error<0) return mp3splt_err(NULL,error);
 
-  if (error == SPLT_OK_SPLIT || error == SPLT_OK_SPLIT_EOF) {
+  if (S->cancelled) {
+    return SEGMENTER_ERR_CANCELLED;
+  } else if (result == SPLT_OK_SPLIT || result == SPLT_OK_SPLIT_EOF) {
     return SEGMENTER_OK;
   } else {
     return SEGMENTER_ERR_CREATE;
@@ -181,41 +205,217 @@ static int mp3splt(segmenter_t* S)
 }
 
 /**********************************************************************/
-static int split_mp3(segmenter_t* S)
+
+static void segment_copy(segment_t* dst, const segment_t* src);
+static void segment_free(segment_t* seg);
+
+// Replaces all frames with the given id by a text frame
+static void id3_set_text(struct id3_tag* tag, const char* id, const char* value)
+{
+  struct id3_frame* f;
+  while ((f = id3_tag_findframe(tag, id, 0)) != NULL) {
+    id3_tag_detachframe(tag, f);
+    id3_frame_delete(f);
+  }
+  if (value == NULL || value[0] == '\0') {
+    return;
+  }
+  id3_ucs4_t* u = id3_utf8_ucs4duplicate((const id3_utf8_t* ) value);
+  if (u == NULL) {
+    return;
+  }
+  f = id3_frame_new(id);
+  if (strcmp(id, "COMM") == 0) {
+    id3_field_settextencoding(id3_frame_field(f, 0), ID3_FIELD_TEXTENCODING_UTF_8);
+    id3_field_setlanguage(id3_frame_field(f, 1), "eng");
+    id3_field_setstring(id3_frame_field(f, 2), id3_ucs4_empty);
+    id3_field_setfullstring(id3_frame_field(f, 3), u);
+  } else {
+    id3_field_settextencoding(id3_frame_field(f, 0), ID3_FIELD_TEXTENCODING_UTF_8);
+    id3_field_setstrings(id3_frame_field(f, 1), 1, &u);
+  }
+  free(u);
+  id3_tag_attachframe(tag, f);
+}
+
+static void v1_field(char* dst, const char* value, int len)
+{
+  memset(dst, 0, len);
+  strncpy(dst, value, len);
+}
+
+// Rewrites the fields of a 128 byte ID3v1.1 tag
+static void id3v1_retag(segment_t* seg, char* v1)
+{
+  char year[5];
+  snprintf(year, 5, "%04d", seg->year);
+  v1_field(&v1[3], seg->title, 30);
+  v1_field(&v1[33], seg->artist, 30);
+  v1_field(&v1[63], seg->album, 30);
+  memcpy(&v1[93], year, 4);
+  v1_field(&v1[97], seg->comment, 28);
+  v1[125] = '\0';
+  v1[126] = (seg->track > 0 && seg->track < 256) ? (char) seg->track : 0;
+}
+
+// Puts the tags of S around the audio frames of an mp3 segment in buf.
+// The ID3v2 tag at the start is parsed, so frames that came from the
+// original file stay; the tag fields we set are replaced. The result
+// becomes the segment of S.
+static int retag_mp3(segmenter_t* S, id3_byte_t* buf, size_t size)
+{
+  if (size == 0) {
+    return SEGMENTER_ERR_NOSEGMENT;
+  }
+
+  size_t v2_len = 0;
+  if (size >= 10 && memcmp(buf, "ID3", 3) == 0) {
+    signed long l = id3_tag_query(buf, size);
+    if (l > 0 && (size_t) l <= size) {
+      v2_len = l;
+    }
+  }
+  size_t audio_end = size;
+  char* v1 = NULL;
+  if (size - v2_len >= 128 && memcmp(&buf[size - 128], "TAG", 3) == 0) {
+    audio_end = size - 128;
+    v1 = (char* ) &buf[audio_end];
+  }
+
+  struct id3_tag* tag = (v2_len > 0) ? id3_tag_parse(buf, v2_len) : NULL;
+  if (tag == NULL) {
+    tag = id3_tag_new();
+  }
+  pthread_mutex_lock(&S->lock);
+  segment_t seg;
+  segment_copy(&seg, &S->segment);
+  pthread_mutex_unlock(&S->lock);
+  char year[20], track[20];
+  snprintf(year, 20, "%d", seg.year);
+  snprintf(track, 20, "%d", seg.track);
+  id3_set_text(tag, "TIT2", seg.title);
+  id3_set_text(tag, "TPE1", seg.artist);
+  id3_set_text(tag, "TALB", seg.album);
+  id3_set_text(tag, "TPE2", seg.album_artist);
+  id3_set_text(tag, "TDRC", year);
+  id3_set_text(tag, "COMM", seg.comment);
+  id3_set_text(tag, "TCON", seg.genre);
+  id3_set_text(tag, "TRCK", track);
+  id3_tag_options(tag, ID3_TAG_OPTION_COMPRESSION | ID3_TAG_OPTION_CRC |
+                       ID3_TAG_OPTION_UNSYNCHRONISATION | ID3_TAG_OPTION_ID3V1, 0);
+
+  id3_length_t tag_len = id3_tag_render(tag, NULL);
+  id3_byte_t* rendered = (id3_byte_t* ) mc_malloc(tag_len);
+  tag_len = id3_tag_render(tag, rendered);
+  id3_tag_delete(tag);
+
+  memblock_t* blk = memblock_new();
+  memblock_write(blk, rendered, tag_len);
+  memblock_write(blk, &buf[v2_len], audio_end - v2_len);
+  if (v1 != NULL) {
+    id3v1_retag(&seg, v1);
+    memblock_write(blk, v1, 128);
+  }
+  memblock_seek(blk, 0);
+  segment_free(&seg);
+  mc_free(rendered);
+
+  pthread_mutex_lock(&S->lock);
+  memblock_t* old = S->blk;
+  S->blk = blk;
+  S->last_result = SEGMENTER_OK;
+  pthread_mutex_unlock(&S->lock);
+  memblock_destroy(old);
+  return SEGMENTER_OK;
+}
+
+/**********************************************************************/
+
+static void segment_copy(segment_t* dst, const segment_t* src)
+{
+  *dst = *src;
+  dst->title = mc_strdup(src->title);
+  dst->artist = mc_strdup(src->artist);
+  dst->album = mc_strdup(src->album);
+  dst->album_artist = mc_strdup(src->album_artist);
+  dst->composer = mc_strdup(src->composer);
+  dst->comment = mc_strdup(src->comment);
+  dst->genre = mc_strdup(src->genre);
+  dst->filename = mc_strdup(src->filename);
+}
+
+static void segment_free(segment_t* seg)
+{
+  mc_free(seg->title);
+  mc_free(seg->artist);
+  mc_free(seg->album);
+  mc_free(seg->album_artist);
+  mc_free(seg->composer);
+  mc_free(seg->comment);
+  mc_free(seg->genre);
+  mc_free(seg->filename);
+}
+
+// Splits a copy of the segment, readers of S may look at it meanwhile
+static int split(segmenter_t* S)
 {
+  segment_t seg;
+  pthread_mutex_lock(&S->lock);
+  segment_copy(&seg, &S->segment);
+  pthread_mutex_unlock(&S->lock);
+
   int result;
   log_debug("split begin");
+  S->pending = memblock_new();
+  unsigned long long t0 = latency_start();
 #ifdef GARD_WITH_MUTEX
   pthread_mutex_lock(&mutex);
 #endif
-  result = mp3splt(S);
+  latency_phase(LAT_SPLIT_LOCK, t0);
+  t0 = latency_start();
+  result = mp3splt(S, &seg);
+  latency_phase(LAT_SPLIT, t0);
 #ifdef GARD_WITH_MUTEX
   pthread_mutex_unlock(&mutex);
 #endif 
   log_debug("split done");
+  segment_free(&seg);
+
+  memblock_t* old = S->pending;
+  pthread_mutex_lock(&S->lock);
+  if (result == SEGMENTER_OK) {
+    old = S->blk;
+    S->blk = S->pending;
+  }
+  S->last_result = result;
+  pthread_mutex_unlock(&S->lock);
+  S->pending = NULL;
+  memblock_destroy(old);
   return result;
 }
 
-static int split_ogg(segmenter_t* S)
+/**********************************************************************/
+
+// With GARD_WITH_MUTEX all libmp3splt calls are serialised. More workers
+// would only queue on the mutex, in no particular order, past the
+// priorities of the scheduler.
+int segmenter_max_parallel(void)
 {
-  int result;
 #ifdef GARD_WITH_MUTEX
-  pthread_mutex_lock(&mutex);
-#endif
-  result = mp3splt(S);
-#ifdef GARD_WITH_MUTEX
-  pthread_mutex_unlock(&mutex);
+  return 1;
+#else
+  return 64;
 #endif
-  return result;
 }
 
-/**********************************************************************/
-
 segmenter_t* segmenter_new()
 {
   segmenter_t* s = (segmenter_t* ) mc_malloc(sizeof(segmenter_t));
+  pthread_mutex_init(&s->lock, NULL);
   s->blk = memblock_new();
+  s->pending = NULL;
   s->stream = 0;
+  s->busy = 0;
   s->last_result = SEGMENTER_NONE;
   s->segment.filename = mc_strdup("");
   s->segment.artist = mc_strdup("");
@@ -226,12 +426,23 @@ segmenter_t* segmenter_new()
   s->segment.comment = mc_strdup("");
   s->segment.genre = mc_strdup("");
   s->segment.track = -1;
+  s->segment.year = 0;
+  s->segment.begin_offset_in_ms = 0;
+  s->segment.end_offset_in_ms = -1;
+  s->cancel = NULL;
+  s->cancel_data = NULL;
+  s->state = NULL;
+  s->writes = 0;
+  s->cancelled = 0;
   return s;
 }
 
 int segmenter_last_result(segmenter_t* S)
 {
-  return S->last_result;
+  pthread_mutex_lock(&S->lock);
+  int result = S->last_result;
+  pthread_mutex_unlock(&S->lock);
+  return result;
 }
 
 int segmenter_can_segment(segmenter_t* S, const char* filename)
@@ -246,79 +457,120 @@ void segmenter_destroy(segmenter_t* S)
 {
   memblock_destroy(S->blk);
   S->stream = 0;
-  mc_free(S->segment.title);
-  mc_free(S->segment.artist);
-  mc_free(S->segment.album);
-  mc_free(S->segment.album_artist);
-  mc_free(S->segment.comment);
-  mc_free(S->segment.composer);
-  mc_free(S->segment.filename);
-  mc_free(S->segment.genre);
+  segment_free(&S->segment);
+  pthread_mutex_destroy(&S->lock);
   mc_free(S);
 }
 
+void segmenter_set_cancel(segmenter_t* S, segmenter_cancel_t cancel, void* data)
+{
+  S->cancel = cancel;
+  S->cancel_data = data;
+}
+
+// Open streams stay open, readers get the new segment. When the split
+// fails or is cancelled they keep the old one.
 int segmenter_create(segmenter_t* S)
 {
-  // assert that this segment isn't opened.
-  int reopen=0;
-  if (segmenter_stream(S)) {
-    reopen=1;
-    segmenter_close(S);
+  pthread_mutex_lock(&S->lock);
+  char* ext = getExt(S->segment.filename);
+  pthread_mutex_unlock(&S->lock);
+  int result;
+  if (strcasecmp(ext, "mp3") == 0 || strcasecmp(ext, "ogg") == 0) {
+    result = split(S);
+  } else {
+    result = SEGMENTER_ERR_FILETYPE;
+    pthread_mutex_lock(&S->lock);
+    S->last_result = result;
+    pthread_mutex_unlock(&S->lock);
   }
+  mc_free(ext);
+  return result;
+}
 
-  char* filename = S->segment.filename;
-  char* ext = getExt(filename);
-  if (ext == NULL) {
-    S->last_result = SEGMENTER_ERR_FILETYPE;
-    return S->last_result;
-  } else if (strcasecmp(ext, "mp3") == 0) {
-    mc_free(ext);
-    return split_mp3(S);
-  } else if (strcasecmp(ext, "ogg") == 0) {
-    mc_free(ext);
-    return split_ogg(S);
-  } else {
-    mc_free(ext);
-    S->last_result = SEGMENTER_ERR_FILETYPE;
-    return S->last_result;
+// Makes the segment of S, which must not be shared yet, from the segment
+// of from, with the tags of S, without splitting again. Only mp3 can be
+// retagged; for other formats this returns SEGMENTER_ERR_FILETYPE and S
+// must be created. from isn't changed, its readers go on undisturbed.
+int segmenter_retag_from(segmenter_t* S, segmenter_t* from)
+{
+  pthread_mutex_lock(&from->lock);
+  char* ext = getExt(from->segment.filename);
+  size_t size = (strcasecmp(ext, "mp3") == 0) ? memblock_size(from->blk) : 0;
+  id3_byte_t* buf = NULL;
+  if (size > 0) {
+    buf = (id3_byte_t* ) mc_malloc(size);
+    memblock_seek(from->blk, 0);
+    memblock_read(from->blk, buf, size);
   }
+  pthread_mutex_unlock(&from->lock);
 
-  if (reopen) {
-    segmenter_open(S);
+  int result;
+  if (strcasecmp(ext, "mp3") != 0) {
+    result = SEGMENTER_ERR_FILETYPE;
+  } else if (buf == NULL) {
+    result = SEGMENTER_ERR_NOSEGMENT;
+  } else {
+    result = retag_mp3(S, buf, size);
   }
+  mc_free(buf);
+  mc_free(ext);
+  return result;
 }
 
+// Opens are counted, a segment can be shared by several open tracks
 int segmenter_open(segmenter_t* S)
 {
+  pthread_mutex_lock(&S->lock);
   if (memblock_size(S->blk) == 0) {
     S->last_result = SEGMENTER_ERR_NOSEGMENT;
-    S->stream = 0;
-    return S->last_result;
   } else {
-    S->stream = 1;
-    if (S->stream) {
-      S->last_result = SEGMENTER_OK;
-    } else {
-      S->last_result = SEGMENTER_ERR_FILEOPEN;
-    }
-    return S->last_result;
+    S->stream += 1;
+    S->last_result = SEGMENTER_OK;
   }
+  int result = S->last_result;
+  pthread_mutex_unlock(&S->lock);
+  return result;
 }
 
 int segmenter_close(segmenter_t* S)
 {
-  if (S->stream) {
-    S->stream = 0;
+  pthread_mutex_lock(&S->lock);
+  if (S->stream > 0) {
+    S->stream -= 1;
     S->last_result = SEGMENTER_OK;
   } else {
     S->last_result = SEGMENTER_ERR_NOSTREAM;
   }
-  return S->last_result;
+  int result = S->last_result;
+  pthread_mutex_unlock(&S->lock);
+  return result;
 }
 
 int segmenter_stream(segmenter_t* S)
 {
-  return S->stream;
+  pthread_mutex_lock(&S->lock);
+  int stream = S->stream;
+  pthread_mutex_unlock(&S->lock);
+  return stream;
+}
+
+// Set by the owner of a split of a segment that others may find, for
+// as long as it works on it without other locks, and until the ones that
+// waited for the split have it. Counted, every set is undone once.
+void segmenter_set_busy(segmenter_t* S, int busy)
+{
+  pthread_mutex_lock(&S->lock);
+  S->busy += busy ? 1 : -1;
+  pthread_mutex_unlock(&S->lock);
+}
+
+int segmenter_busy(segmenter_t* S)
+{
+  pthread_mutex_lock(&S->lock);
+  int busy = S->busy;
+  pthread_mutex_unlock(&S->lock);
+  return busy;
 }
 
 void segmenter_prepare(segmenter_t* S,
@@ -331,6 +583,7 @@ void segmenter_prepare(segmenter_t* S,
            const char* composer,
            const char* genre, int year, const char* comment, int begin_offset_in_ms, int end_offset_in_ms)
 {
+  pthread_mutex_lock(&S->lock);
   segment_t* seg = &S->segment;
   replace(&seg->filename, filename);
   replace(&seg->title, title);
@@ -344,24 +597,43 @@ void segmenter_prepare(segmenter_t* S,
   seg->begin_offset_in_ms = begin_offset_in_ms;
   seg->end_offset_in_ms = end_offset_in_ms;
   seg->track = track;
+  pthread_mutex_unlock(&S->lock);
 }
 
 size_t segmenter_size(segmenter_t* S)
 {
-  return memblock_size(S->blk);
+  pthread_mutex_lock(&S->lock);
+  size_t size = memblock_size(S->blk);
+  pthread_mutex_unlock(&S->lock);
+  return size;
 }
 
 int segmenter_retcode(segmenter_t* S)
 {
-  return S->last_result;
+  return segmenter_last_result(S);
 }
 
 int segmenter_read(segmenter_t* S, void* mem, size_t size) {
-  return (int) memblock_read(S->blk, mem, size);
+  pthread_mutex_lock(&S->lock);
+  int n = (int) memblock_read(S->blk, mem, size);
+  pthread_mutex_unlock(&S->lock);
+  return n;
 }
 
 void segmenter_seek(segmenter_t* S, off_t pos) {
+  pthread_mutex_lock(&S->lock);
+  memblock_seek(S->blk, pos);
+  pthread_mutex_unlock(&S->lock);
+}
+
+// The cursor is shared by all readers of S; concurrent readers must
+// use this instead of a seek followed by a read.
+int segmenter_read_at(segmenter_t* S, void* mem, size_t size, off_t pos) {
+  pthread_mutex_lock(&S->lock);
   memblock_seek(S->blk, pos);
+  int n = (int) memblock_read(S->blk, mem, size);
+  pthread_mutex_unlock(&S->lock);
+  return n;
 }
 
 const char* segmenter_title(segmenter_t* s) {
@@ -21,6 +21,7 @@
 #define __SEGMENTER__HOD
 
 #include <stdio.h>
+#include <pthread.h>
 #include <elementals/memblock.h>
 
 typedef struct {
@@ -29,11 +30,28 @@ typedef struct {
   char *filename;
 } segment_t;
 
+typedef int (*segmenter_cancel_t)(void *data);
+
+/*
+ * A segmenter may be shared by several open tracks and threads. lock
+ * guards blk with its cursor, segment, stream, busy and last_result. A split is made in pending and replaces blk when it is
+ * done, so readers see the old segment or the new one, never a part.
+ * pending, cancel, state, writes and cancelled belong to the thread
+ * doing the split.
+ */
 typedef struct {
+  pthread_mutex_t lock;
   memblock_t *blk;
+  memblock_t *pending;
   int last_result;
   segment_t segment;
   int stream;
+  int busy;           // split again or handed over, must not be destroyed
+  segmenter_cancel_t cancel;
+  void *cancel_data;
+  void *state;
+  int writes;
+  int cancelled;
 } segmenter_t;
 
 #define SEGMENTER_OK        0
@@ -46,6 +64,9 @@ typedef struct {
 #define SEGMENTER_ERR_NOSEGMENT -31
 #define SEGMENTER_ERR_NOMEM     -40
 #define SEGMENTER_ERR_NOSTREAM  -29
+#define SEGMENTER_ERR_CANCELLED -50
+
+int segmenter_max_parallel(void);
 
 segmenter_t *segmenter_new();
 void segmenter_destroy(segmenter_t * S);
@@ -61,14 +82,19 @@ void segmenter_prepare(segmenter_t * S,
            const char *composer,
            const char *genre, int year, const char *comment, int begin_offset_in_ms, int end_offset_in_ms);
 
+void segmenter_set_cancel(segmenter_t * S, segmenter_cancel_t cancel, void *data);
 int segmenter_create(segmenter_t * S);
+int segmenter_retag_from(segmenter_t * S, segmenter_t * from);
 int segmenter_open(segmenter_t * S);
 size_t segmenter_size(segmenter_t * S);
 int segmenter_close(segmenter_t * S);
 int segmenter_stream(segmenter_t * S);
+void segmenter_set_busy(segmenter_t * S, int busy);
+int segmenter_busy(segmenter_t * S);
 int segmenter_retcode(segmenter_t * S);
 int segmenter_read(segmenter_t * S, void *mem, size_t size);
 void segmenter_seek(segmenter_t * S, off_t pos);
+int segmenter_read_at(segmenter_t * S, void *mem, size_t size, off_t pos);
 const char *segmenter_title(segmenter_t *S);
 
 #endif
@@ -0,0 +1,163 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+typedef struct stats_block_s {
+  unsigned long v[STAT_COUNTERS];
+  struct stats_block_s *next;
+} stats_block_t;
+
+static pthread_key_t KEY;
+static int KEY_CREATED = 0;
+static pthread_mutex_t STATS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static stats_block_t *BLOCKS = NULL;
+static unsigned long RETIRED[STAT_COUNTERS];
+
+static const char *NAMES[STAT_COUNTERS] = {
+  "getattr",
+  "open",
+  "release",
+  "read",
+  "read_bytes",
+  "read_errors",
+  "segment_hits",
+  "segment_misses",
+  "splits",
+  "split_failures",
+  "split_cancelled",
+  "split_busy",
+  "split_joined",
+  "split_backed_off",
+  "retags",
+  "evictions",
+  "evicted_bytes",
+  "size_hits",
+  "size_misses",
+  "control_reads"
+};
+
+/**********************************************************************/
+
+// Thread exit: keep what the thread counted
+static void retire(void *_b)
+{
+  stats_block_t *b = (stats_block_t *) _b;
+  int i;
+  pthread_mutex_lock(&STATS_MUTEX);
+  stats_block_t **p = &BLOCKS;
+  while (*p != NULL && *p != b) {
+    p = &(*p)->next;
+  }
+  if (*p == b) {
+    *p = b->next;
+  }
+  for (i = 0; i < STAT_COUNTERS; i++) {
+    RETIRED[i] += b->v[i];
+  }
+  pthread_mutex_unlock(&STATS_MUTEX);
+  mc_free(b);
+}
+
+static stats_block_t *block(void)
+{
+  stats_block_t *b = (stats_block_t *) pthread_getspecific(KEY);
+  if (b == NULL) {
+    b = (stats_block_t *) mc_malloc(sizeof(stats_block_t));
+    memset(b, 0, sizeof(stats_block_t));
+    pthread_setspecific(KEY, b);
+    pthread_mutex_lock(&STATS_MUTEX);
+    b->next = BLOCKS;
+    BLOCKS = b;
+    pthread_mutex_unlock(&STATS_MUTEX);
+  }
+  return b;
+}
+
+/**********************************************************************/
+
+void stats_init(void)
+{
+  if (!KEY_CREATED) {
+    pthread_key_create(&KEY, retire);
+    KEY_CREATED = 1;
+  }
+}
+
+void stats_destroy(void)
+{
+  if (!KEY_CREATED) {
+    return;
+  }
+  pthread_mutex_lock(&STATS_MUTEX);
+  while (BLOCKS != NULL) {
+    stats_block_t *b = BLOCKS;
+    BLOCKS = b->next;
+    mc_free(b);
+  }
+  pthread_mutex_unlock(&STATS_MUTEX);
+  pthread_setspecific(KEY, NULL);
+  pthread_key_delete(KEY);
+  KEY_CREATED = 0;
+}
+
+// Only the owning thread writes its block. The atomic load and store
+// keep readers from seeing a torn value; no read-modify-write is
+// needed.
+void stats_add(int counter, unsigned long n)
+{
+  if (!KEY_CREATED) {
+    return;
+  }
+  unsigned long *v = &block()->v[counter];
+  __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void stats_get_all(unsigned long *values)
+{
+  int i;
+  pthread_mutex_lock(&STATS_MUTEX);
+  memcpy(values, RETIRED, sizeof(RETIRED));
+  stats_block_t *b;
+  for (b = BLOCKS; b != NULL; b = b->next) {
+    for (i = 0; i < STAT_COUNTERS; i++) {
+      values[i] += __atomic_load_n(&b->v[i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&STATS_MUTEX);
+}
+
+unsigned long stats_get(int counter)
+{
+  unsigned long values[STAT_COUNTERS];
+  stats_get_all(values);
+  return values[counter];
+}
+
+const char *stats_name(int counter)
+{
+  return NAMES[counter];
+}
@@ -0,0 +1,64 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __STATS__HOD
+#define __STATS__HOD
+
+/*
+ * Event counters. Every thread counts in a block of its own, so the
+ * hot paths never share a cache line or take a lock; stats_get() adds
+ * up the blocks when somebody asks. Blocks of threads that exit are
+ * folded into a total kept for them.
+ */
+
+enum {
+  STAT_GETATTR = 0,
+  STAT_OPEN,
+  STAT_RELEASE,
+  STAT_READ,
+  STAT_READ_BYTES,
+  STAT_READ_ERRORS,
+  STAT_SEGMENT_HITS,      // segment found in the segment list
+  STAT_SEGMENT_MISSES,
+  STAT_SPLITS,
+  STAT_SPLIT_FAILURES,
+  STAT_SPLIT_CANCELLED,
+  STAT_SPLIT_BUSY,        // refused by the scheduler
+  STAT_SPLIT_JOINED,      // waited for a split somebody else ran
+  STAT_SPLIT_BACKED_OFF,  // refused by the fail cache
+  STAT_RETAGS,
+  STAT_EVICTIONS,
+  STAT_EVICTED_BYTES,
+  STAT_SIZE_HITS,         // sizes from the data entry or the size cache
+  STAT_SIZE_MISSES,
+  STAT_CONTROL_READS,
+  STAT_COUNTERS
+};
+
+void stats_init(void);
+void stats_destroy(void);
+
+void stats_add(int counter, unsigned long n);
+#define stats_inc(counter) stats_add(counter, 1)
+
+unsigned long stats_get(int counter);
+void stats_get_all(unsigned long *values);    // STAT_COUNTERS values
+const char *stats_name(int counter);
+
+#endif
@@ -0,0 +1,522 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+/*
+ * Drives the file system operations from many threads at once over a
+ * shared synthetic library and checks every byte that comes back.
+ *
+ *   stress [-d dir] [-j threads,...] [-s seconds] [-m MB] [-e] [-k]
+ *
+ * Threads mix random reads, whole-track reads, getattrs and readdirs
+ * of cue directories. With -e another thread keeps editing the
+ * library: it adds REM lines to cue sheets, changes the album TITLE
+ * or the track PERFORMERs, so segments are retagged, and touches the
+ * audio, so they are split again. -m sets the memory budget, which is
+ * small by default so segments get evicted under the readers.
+ *
+ * The references for every track, one per combination of edited tags,
+ * are made up front by segmenters of their own; a read must match one
+ * of them. One line is printed per number of threads; the exit code
+ * is 1 when anything didn't match. Build stress_tsan to run it under
+ * ThreadSanitizer.
+ */
+
+#define MP3CUEFUSE_NO_MAIN
+#include "mp3cuefuse.c"
+#include "synth.h"
+#include <sys/time.h>
+
+// The album TITLE and the track PERFORMERs are edited or not
+#define VARIANTS 4
+#define EDITED " (edited)"
+
+typedef struct {
+  char *path;
+  char *dir;          // the cue directory
+  char *cue;          // the cue sheet on disk
+  int nr;
+  char *ref[VARIANTS];
+  size_t size[VARIANTS];
+} track_t;
+
+typedef struct {
+  unsigned int seed;
+  unsigned long ops;
+  unsigned long long bytes;
+  unsigned long busy;
+  unsigned long errors;
+  unsigned long mismatches;
+} worker_t;
+
+static track_t *TRACKS = NULL;
+static int N_TRACKS = 0;
+static int STOP = 0;
+static char *LIBRARY = NULL;
+
+static double now_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int stopped(void)
+{
+  return __atomic_load_n(&STOP, __ATOMIC_ACQUIRE);
+}
+
+static int count_filler(void *buf, const char* name, const struct stat *st, off_t off)
+{
+  *(int *) buf += 1;
+  return 0;
+}
+
+/**********************************************************************/
+
+static int add_track(void *buf, const char* name, const struct stat *st, off_t off)
+{
+  const char* dir = (const char*) buf;
+  if (name[0] == '.') {
+    return 0;
+  }
+  TRACKS = (track_t *) realloc(TRACKS, sizeof(track_t) * (N_TRACKS + 1));
+  track_t *t = &TRACKS[N_TRACKS++];
+  t->path = (char*) malloc(strlen(dir) + strlen(name) + 2);
+  sprintf(t->path, "%s/%s", dir, name);
+  t->dir = strdup(dir);
+  t->cue = NULL;
+  t->nr = 0;
+  memset(t->ref, 0, sizeof(t->ref));
+  memset(t->size, 0, sizeof(t->size));
+  return 0;
+}
+
+// Tracks of Artist NN/Album NN/album.cue, as made by synth_library();
+// the cue sheet shows up as the directory album.
+static int find_tracks(const synth_config_t *cfg)
+{
+  int a, b;
+  for (a = 1; a <= cfg->artists; a++) {
+    for (b = 1; b <= cfg->albums; b++) {
+      char dir[256];
+      snprintf(dir, sizeof(dir), "/Artist %02d/Album %02d/album", a, b);
+      int i = N_TRACKS;
+      if (mp3cue_oper.readdir(dir, dir, add_track, 0, NULL) != 0) {
+        return -1;
+      }
+      for (; i < N_TRACKS; i++) {
+        TRACKS[i].cue = (char*) malloc(strlen(LIBRARY) + strlen(dir) + 8);
+        sprintf(TRACKS[i].cue, "%s%s.cue", LIBRARY, dir);
+      }
+    }
+  }
+  return N_TRACKS;
+}
+
+// Puts EDITED at the end of the quoted value in line, or takes it off
+static void mark(char *line, size_t len, int edited)
+{
+  char *q = strrchr(line, '"');
+  size_t n = strlen(EDITED);
+  if (q == NULL || q == strchr(line, '"')) {
+    return;
+  }
+  if ((size_t) (q - line) >= n && strncmp(q - n, EDITED, n) == 0) {
+    memmove(q - n, q, strlen(q) + 1);
+    q -= n;
+  }
+  if (edited && strlen(line) + n < len) {
+    memmove(q + n, q, strlen(q) + 1);
+    memcpy(q, EDITED, n);
+  }
+}
+
+// Copies cue sheet from to to as the given variant, with a REM line
+// on top when round isn't 0
+static int write_variant(const char* from, const char* to, int variant, int round)
+{
+  char line[1024];
+  FILE *in = fopen(from, "rt");
+  if (in == NULL) {
+    return -1;
+  }
+  FILE *out = fopen(to, "wt");
+  if (out == NULL) {
+    fclose(in);
+    return -1;
+  }
+  if (round != 0) {
+    fprintf(out, "REM STRESS %d\r\n", round);
+  }
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if (strncmp(line, "REM STRESS", 10) == 0) {
+      continue;
+    } else if (strncmp(line, "TITLE ", 6) == 0) {
+      mark(line, sizeof(line), variant & 1);
+    } else if (strncmp(line, "    PERFORMER ", 14) == 0) {
+      mark(line, sizeof(line), variant & 2);
+    }
+    fputs(line, out);
+  }
+  fclose(in);
+  return fclose(out);
+}
+
+// Splits track t as it is in variant v of its sheet, with a segmenter
+// that isn't shared with anything
+static int make_reference(track_t *t, cue_t *sheet, int v)
+{
+  int i;
+  for (i = 0; i < cue_entries(sheet); i++) {
+    cue_entry_t *e = cue_entry(sheet, i);
+    if (cue_entry_tracknr(e) == t->nr) {
+      segmenter_t *s = segmenter_new();
+      prepare_segment(s, e);
+      if (segmenter_create(s) != SEGMENTER_OK) {
+        segmenter_destroy(s);
+        return -1;
+      }
+      t->size[v] = segmenter_size(s);
+      t->ref[v] = (char*) malloc(t->size[v]);
+      segmenter_read_at(s, t->ref[v], t->size[v], 0);
+      segmenter_destroy(s);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int make_references(void)
+{
+  int i, v;
+  for (i = 0; i < N_TRACKS; i++) {
+    struct stat st;
+    mp3cue_oper.getattr(TRACKS[i].path, &st);
+    data_entry_t *d = (data_entry_t *) strtable_get(DATA, TRACKS[i].path);
+    if (d == NULL) {
+      return -1;
+    }
+    TRACKS[i].nr = cue_entry_tracknr(d->entry);
+  }
+  for (v = 0; v < VARIANTS; v++) {
+    cue_t *sheet = NULL;
+    const char* of = NULL;
+    for (i = 0; i < N_TRACKS; i++) {
+      track_t *t = &TRACKS[i];
+      if (of == NULL || strcmp(of, t->cue) != 0) {
+        // the variant is parsed next to the sheet, for its FILE
+        char tmp[4096 + 8];
+        snprintf(tmp, sizeof(tmp), "%s.ref", t->cue);
+        if (sheet != NULL) {
+          cue_destroy(sheet);
+        }
+        sheet = (write_variant(t->cue, tmp, v, 0) == 0) ? cue_new(tmp) : NULL;
+        of = t->cue;
+        unlink(tmp);
+        if (sheet == NULL || !cue_valid(sheet)) {
+          return -1;
+        }
+      }
+      if (make_reference(t, sheet, v) != 0) {
+        cue_destroy(sheet);
+        return -1;
+      }
+    }
+    if (sheet != NULL) {
+      cue_destroy(sheet);
+    }
+  }
+  return 0;
+}
+
+/**********************************************************************/
+
+// Counts r, returns 0 if it is an error
+static int result(worker_t *w, const char* op, track_t *t, int r)
+{
+  w->ops += 1;
+  // getattr waits for room in the size queue, it never gives way
+  if (r == -EAGAIN && strcmp(op, "getattr") != 0) {
+    w->busy += 1;
+  } else if (r < 0) {
+    if (w->errors++ == 0) {
+      fprintf(stderr, "stress: %s %s: %s\n", op, t->path, strerror(-r));
+    }
+  }
+  return r >= 0;
+}
+
+static void check(worker_t *w, track_t *t, int r, const char* buf, off_t offset, size_t size)
+{
+  if (!result(w, "read", t, r)) {
+    return;
+  }
+  int v;
+  size_t expect = 0;
+  for (v = 0; v < VARIANTS; v++) {
+    expect = (offset >= (off_t) t->size[v]) ? 0 : t->size[v] - offset;
+    expect = (expect > size) ? size : expect;
+    if ((size_t) r == expect && memcmp(buf, t->ref[v] + offset, r) == 0) {
+      w->bytes += r;
+      return;
+    }
+  }
+  if (w->mismatches++ == 0) {
+    fprintf(stderr, "stress: %s: %d bytes at %ld differ (expected %lu)\n",
+            t->path, r, (long) offset, (unsigned long) expect);
+  }
+}
+
+static int known_size(track_t *t, size_t size)
+{
+  int v;
+  for (v = 0; v < VARIANTS; v++) {
+    if (t->size[v] == size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int track_open(worker_t *w, track_t *t, struct fuse_file_info *fi)
+{
+  memset(fi, 0, sizeof(*fi));
+  fi->flags = O_RDONLY;
+  int r = mp3cue_oper.open(t->path, fi);
+  result(w, "open", t, r);
+  return r;
+}
+
+static void track_release(worker_t *w, track_t *t, struct fuse_file_info *fi)
+{
+  result(w, "release", t, mp3cue_oper.release(t->path, fi));
+}
+
+static void random_reads(worker_t *w, track_t *t)
+{
+  static __thread char buf[64 * 1024];
+  struct fuse_file_info fi;
+  int i, n = 1 + rand_r(&w->seed) % 16;
+  if (track_open(w, t, &fi) != 0) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    off_t offset = rand_r(&w->seed) % (t->size[0] + 1024);
+    size_t size = 1 + rand_r(&w->seed) % sizeof(buf);
+    check(w, t, mp3cue_oper.read(t->path, buf, size, offset, &fi), buf, offset, size);
+  }
+  track_release(w, t, &fi);
+}
+
+static void whole_track(worker_t *w, track_t *t)
+{
+  static __thread char buf[32 * 1024];
+  struct fuse_file_info fi;
+  off_t offset = 0;
+  int r;
+  if (track_open(w, t, &fi) != 0) {
+    return;
+  }
+  do {
+    r = mp3cue_oper.read(t->path, buf, sizeof(buf), offset, &fi);
+    check(w, t, r, buf, offset, sizeof(buf));
+    offset += (r > 0) ? r : 0;
+  } while (r > 0 && !stopped());
+  track_release(w, t, &fi);
+}
+
+static void *worker(void *data)
+{
+  worker_t *w = (worker_t *) data;
+  while (!stopped()) {
+    track_t *t = &TRACKS[rand_r(&w->seed) % N_TRACKS];
+    int what = rand_r(&w->seed) % 10;
+    if (what < 4) {
+      random_reads(w, t);
+    } else if (what < 6) {
+      whole_track(w, t);
+    } else if (what < 9) {
+      struct stat st;
+      int r = mp3cue_oper.getattr(t->path, &st);
+      if (result(w, "getattr", t, r) && !known_size(t, st.st_size)) {
+        if (w->mismatches++ == 0) {
+          fprintf(stderr, "stress: %s: size %ld, expected %lu\n",
+                  t->path, (long) st.st_size, (unsigned long) t->size[0]);
+        }
+      }
+    } else {
+      int n = 0;
+      int r = mp3cue_oper.readdir(t->dir, &n, count_filler, 0, NULL);
+      result(w, "readdir", t, (r == 0 && n == 0) ? -ENOENT : r);
+    }
+  }
+  return NULL;
+}
+
+// Edits the library in turns: a REM line, the album TITLE, the track
+// PERFORMERs, and the mtime of the audio.
+static void *editor(void *data)
+{
+  const synth_config_t *cfg = (const synth_config_t *) data;
+  unsigned int seed = 7;
+  int round = 0;
+  int variant[cfg->artists * cfg->albums];
+  memset(variant, 0, sizeof(variant));
+  while (!stopped()) {
+    char dir[4096], file[4096 + 16], tmp[4096 + 16];
+    int a = rand_r(&seed) % cfg->artists, b = rand_r(&seed) % cfg->albums;
+    int *v = &variant[a * cfg->albums + b];
+    snprintf(dir, sizeof(dir), "%s/Artist %02d/Album %02d", LIBRARY, a + 1, b + 1);
+    round += 1;
+    if (round % 4 == 0) {
+      snprintf(file, sizeof(file), "%s/album.%s", dir, cfg->ogg ? "ogg" : "mp3");
+      utimes(file, NULL);
+    } else {
+      *v ^= round % 4 - 1;  // 0: REM only, 1: TITLE, 2: PERFORMER
+      snprintf(file, sizeof(file), "%s/album.cue", dir);
+      snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+      if (write_variant(file, tmp, *v, round) == 0) {
+        rename(tmp, file);
+      }
+    }
+    usleep(20 * 1000);
+  }
+  return NULL;
+}
+
+/**********************************************************************/
+
+static int run(int threads, int secs, int edits, synth_config_t *cfg, double *base)
+{
+  worker_t w[threads];
+  pthread_t tid[threads], ed;
+  int i;
+
+  __atomic_store_n(&STOP, 0, __ATOMIC_RELEASE);
+  memset(w, 0, sizeof(w));
+  double t0 = now_s();
+  for (i = 0; i < threads; i++) {
+    w[i].seed = 1 + i;
+    pthread_create(&tid[i], NULL, worker, &w[i]);
+  }
+  if (edits) {
+    pthread_create(&ed, NULL, editor, cfg);
+  }
+  sleep(secs);
+  __atomic_store_n(&STOP, 1, __ATOMIC_RELEASE);
+  worker_t total;
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < threads; i++) {
+    pthread_join(tid[i], NULL);
+    total.ops += w[i].ops;
+    total.bytes += w[i].bytes;
+    total.busy += w[i].busy;
+    total.errors += w[i].errors;
+    total.mismatches += w[i].mismatches;
+  }
+  if (edits) {
+    pthread_join(ed, NULL);
+  }
+  double elapsed = now_s() - t0;
+  double ops_s = total.ops / elapsed;
+  if (*base == 0.0) {
+    *base = ops_s;
+  }
+  printf("threads=%d ops=%lu ops/s=%.0f speedup=%.2f MB/s=%.1f busy=%lu errors=%lu mismatches=%lu\n",
+         threads, total.ops, ops_s, (*base > 0.0) ? ops_s / *base : 0.0,
+         total.bytes / (1024.0 * 1024.0) / elapsed, total.busy, total.errors, total.mismatches);
+  fflush(stdout);
+  return (total.errors == 0 && total.mismatches == 0) ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+  synth_config_t cfg;
+  const char* dir = "/tmp/mp3cue_stress";
+  const char* list = "1,2,4,8";
+  int secs = 5, edits = false, keep = false, c;
+
+  synth_defaults(&cfg);
+  cfg.artists = 2;
+  cfg.albums = 2;
+  cfg.tracks = 6;
+  cfg.track_s = 20;
+  MAX_MEM_USAGE_IN_MB = 2;
+  WORKERS = 2;
+  while ((c = getopt(argc, argv, "d:j:s:m:ek")) != -1) {
+    switch (c) {
+      case 'd': dir = optarg; break;
+      case 'j': list = optarg; break;
+      case 's': secs = atoi(optarg); break;
+      case 'm': MAX_MEM_USAGE_IN_MB = atoi(optarg); break;
+      case 'e': edits = true; break;
+      case 'k': keep = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-d dir] [-j threads,...] [-s seconds] [-m MB] [-e] [-k]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  struct stat st;
+  if ((!keep || stat(dir, &st) != 0) && synth_library(dir, &cfg) < 0) {
+    fprintf(stderr, "stress: cannot make a library in %s\n", dir);
+    return 1;
+  }
+  LIBRARY = strdup(dir);
+
+  mc_init();
+  LOG_FILE = "/tmp/stress_mp3cue.log";
+  mp3cue_setup();
+  mp3cue_configure(NULL);
+  mp3cue_set_basedir(dir);
+  mp3cue_oper.init(NULL);
+
+  int failed = 0;
+  if (find_tracks(&cfg) <= 0 || make_references() != 0) {
+    fprintf(stderr, "stress: cannot read the library in %s\n", dir);
+    failed = 1;
+  } else {
+    double base = 0.0;
+    const char* p = list;
+    while (p != NULL && *p) {
+      int threads = atoi(p);
+      if (threads > 0) {
+        failed |= run(threads, secs, edits, &cfg, &base);
+      }
+      p = strchr(p, ',');
+      p = (p == NULL) ? NULL : p + 1;
+    }
+  }
+
+  mp3cue_oper.destroy(NULL);
+  mp3cue_teardown();
+  int i;
+  for (i = 0; i < N_TRACKS; i++) {
+    free(TRACKS[i].path);
+    free(TRACKS[i].dir);
+    free(TRACKS[i].cue);
+    int v;
+    for (v = 0; v < VARIANTS; v++) {
+      free(TRACKS[i].ref[v]);
+    }
+  }
+  free(TRACKS);
+  free(LIBRARY);
+  return failed;
+}
@@ -0,0 +1,251 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "strtable.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#define ALLOC_TAG ALLOC_DATA
+#include "allocprof.h"
+
+// Buckets moved to the new table per put. The new table is twice the
+// size and fills up after old->slots * 3/4 more puts, so anything
+// above 4/3 per put is done in time.
+#define MIGRATE_STEP 16
+
+typedef struct {
+  unsigned int tag;
+  void *item;
+} bucket_t;
+
+typedef struct {
+  bucket_t *buckets;
+  int slots;    // power of 2
+} slots_t;
+
+struct strtable_s {
+  pthread_rwlock_t lock;
+  slots_t cur;
+  slots_t old;          // being moved into cur, buckets == NULL if not
+  int moved;            // buckets of old before this index are in cur
+  int count;
+  strtable_key_fn key;
+  strtable_destroy_fn destroy;
+};
+
+/**********************************************************************/
+
+#define TAG(h)  ((unsigned int) ((h) >> 32))
+
+static void slots_init(slots_t * s, int slots)
+{
+  s->slots = slots;
+  s->buckets = (bucket_t *) mc_malloc(sizeof(bucket_t) * slots);
+  memset(s->buckets, 0, sizeof(bucket_t) * slots);
+}
+
+// Bucket of the item with key s in table sl, or the empty bucket where
+// it would go.
+static bucket_t *probe(strtable_t * t, slots_t * sl, const char *s, int len, unsigned long long h)
+{
+  int mask = sl->slots - 1;
+  int i = (int)(h & mask);
+  unsigned int tag = TAG(h);
+  bucket_t *b;
+  while ((b = &sl->buckets[i])->item != NULL) {
+    if (b->tag == tag) {
+      const intern_t *k = t->key(b->item);
+      if (k->len == len && memcmp(k->str, s, len) == 0) {
+        return b;
+      }
+    }
+    i = (i + 1) & mask;
+  }
+  return b;
+}
+
+// Same, for a key that is interned: no need to look at the characters
+static bucket_t *probe_interned(strtable_t * t, slots_t * sl, const intern_t * k)
+{
+  int mask = sl->slots - 1;
+  int i = (int)(k->hash & mask);
+  unsigned int tag = TAG(k->hash);
+  bucket_t *b;
+  while ((b = &sl->buckets[i])->item != NULL) {
+    if (b->tag == tag && t->key(b->item) == k) {
+      return b;
+    }
+    i = (i + 1) & mask;
+  }
+  return b;
+}
+
+// Must be called with the lock held for writing
+static void migrate(strtable_t * t, int n)
+{
+  slots_t *old = &t->old;
+  for (; n > 0 && t->moved < old->slots; n--, t->moved++) {
+    bucket_t *b = &old->buckets[t->moved];
+    if (b->item != NULL) {
+      bucket_t *nb = probe_interned(t, &t->cur, t->key(b->item));
+      nb->tag = b->tag;
+      nb->item = b->item;
+    }
+  }
+  if (t->moved == old->slots) {
+    log_debug3("strtable: resized to %d slots, %d items", t->cur.slots, t->count);
+    mc_free(old->buckets);
+    old->buckets = NULL;
+    old->slots = 0;
+  }
+}
+
+// Must be called with the lock held for writing
+static void start_resize(strtable_t * t)
+{
+  if (t->old.buckets != NULL) {
+    // Can't happen with the MIGRATE_STEP above, but be safe
+    migrate(t, t->old.slots);
+  }
+  t->old = t->cur;
+  t->moved = 0;
+  slots_init(&t->cur, t->old.slots * 2);
+}
+
+/**********************************************************************/
+
+strtable_t *strtable_new(int initial, strtable_key_fn key, strtable_destroy_fn destroy)
+{
+  strtable_t *t = (strtable_t *) mc_malloc(sizeof(strtable_t));
+  pthread_rwlock_init(&t->lock, NULL);
+  int n = 16;
+  while (n < initial) {
+    n *= 2;
+  }
+  slots_init(&t->cur, n);
+  t->old.buckets = NULL;
+  t->old.slots = 0;
+  t->moved = 0;
+  t->count = 0;
+  t->key = key;
+  t->destroy = destroy;
+  return t;
+}
+
+static void destroy_item(void *item, void *data)
+{
+  strtable_t *t = (strtable_t *) data;
+  t->destroy(item);
+}
+
+void strtable_destroy(strtable_t * t)
+{
+  if (t->destroy != NULL) {
+    strtable_foreach(t, destroy_item, t);
+  }
+  mc_free(t->cur.buckets);
+  mc_free(t->old.buckets);
+  pthread_rwlock_destroy(&t->lock);
+  mc_free(t);
+}
+
+void *strtable_get(strtable_t * t, const char *key)
+{
+  int len = strlen(key);
+  unsigned long long h = intern_hash(key, len);
+  pthread_rwlock_rdlock(&t->lock);
+  void *item = probe(t, &t->cur, key, len, h)->item;
+  if (item == NULL && t->old.buckets != NULL) {
+    item = probe(t, &t->old, key, len, h)->item;
+  }
+  pthread_rwlock_unlock(&t->lock);
+  return item;
+}
+
+void *strtable_put(strtable_t * t, void *item)
+{
+  const intern_t *k = t->key(item);
+  void *replaced = NULL;
+  pthread_rwlock_wrlock(&t->lock);
+
+  bucket_t *b = probe_interned(t, &t->cur, k);
+  if (b->item == NULL && t->old.buckets != NULL) {
+    // Not moved yet? Then it's replaced where it is.
+    bucket_t *ob = probe_interned(t, &t->old, k);
+    if (ob->item != NULL) {
+      b = ob;
+    }
+  }
+
+  if (b->item != NULL) {
+    replaced = b->item;
+    b->item = item;
+  } else {
+    if ((t->count + 1) * 4 > t->cur.slots * 3) {
+      start_resize(t);
+      b = probe_interned(t, &t->cur, k);
+    }
+    b->tag = TAG(k->hash);
+    b->item = item;
+    t->count += 1;
+  }
+
+  if (t->old.buckets != NULL) {
+    migrate(t, MIGRATE_STEP);
+  }
+  pthread_rwlock_unlock(&t->lock);
+  return replaced;
+}
+
+// Calls fn for every item, with the read lock held. fn must not put.
+void strtable_foreach(strtable_t * t, strtable_iter_fn fn, void *data)
+{
+  int i;
+  pthread_rwlock_rdlock(&t->lock);
+  for (i = 0; i < t->cur.slots; i++) {
+    if (t->cur.buckets[i].item != NULL) {
+      fn(t->cur.buckets[i].item, data);
+    }
+  }
+  // the rest of old hasn't been moved yet
+  for (i = t->moved; t->old.buckets != NULL && i < t->old.slots; i++) {
+    if (t->old.buckets[i].item != NULL) {
+      fn(t->old.buckets[i].item, data);
+    }
+  }
+  pthread_rwlock_unlock(&t->lock);
+}
+
+int strtable_count(strtable_t * t)
+{
+  return t->count;
+}
+
+int strtable_slots(strtable_t * t)
+{
+  return t->cur.slots;
+}
+
+int strtable_resizing(strtable_t * t)
+{
+  return t->old.buckets != NULL;
+}
@@ -0,0 +1,55 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __STRTABLE__HOD
+#define __STRTABLE__HOD
+
+#include "intern.h"
+
+/*
+ * Table of items keyed by an interned string, for the maps that grow
+ * with the library (DATA, SIZE_HASH). Open addressing with linear
+ * probing; a bucket holds 32 bits of the key's hash as a tag and the
+ * item pointer, four buckets to a cache line. When the table fills up
+ * a table twice the size is started and every put moves a few buckets
+ * over, so no single put pays for the whole resize.
+ *
+ * Readers share a read lock, puts take it for writing. Items are never
+ * removed before strtable_destroy(), so an item returned by a get
+ * stays valid after the lock is dropped.
+ */
+
+typedef const intern_t *(*strtable_key_fn) (const void *item);
+typedef void (*strtable_destroy_fn) (void *item);
+typedef void (*strtable_iter_fn) (void *item, void *data);
+
+typedef struct strtable_s strtable_t;
+
+strtable_t *strtable_new(int initial, strtable_key_fn key, strtable_destroy_fn destroy);
+void strtable_destroy(strtable_t * t);
+
+void *strtable_get(strtable_t * t, const char *key);
+void *strtable_put(strtable_t * t, void *item);   // returns the item it replaced
+void strtable_foreach(strtable_t * t, strtable_iter_fn fn, void *data);
+
+int strtable_count(strtable_t * t);
+int strtable_slots(strtable_t * t);
+int strtable_resizing(strtable_t * t);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "synth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**********************************************************************/
+
+// MPEG-1 layer III, 128kbit/s, 44.1kHz, mono. Zero side info and main
+// data decode to silence.
+#define MP3_BITRATE     128000
+#define MP3_RATE        44100
+#define MP3_SAMPLES     1152
+
+int synth_mp3(const char *file, int ms)
+{
+  FILE *f = fopen(file, "wb");
+  if (f == NULL) {
+    return -1;
+  }
+  unsigned char frame[1024];
+  long frames = (long)ms * MP3_RATE / MP3_SAMPLES / 1000;
+  int size = 144 * MP3_BITRATE / MP3_RATE;
+  int rest = 144 * MP3_BITRATE % MP3_RATE;
+  int acc = 0;
+  long i;
+  memset(frame, 0, sizeof(frame));
+  for (i = 0; i < frames; i++) {
+    int pad = 0;
+    acc += rest;
+    if (acc >= MP3_RATE) {
+      acc -= MP3_RATE;
+      pad = 1;
+    }
+    frame[0] = 0xff;
+    frame[1] = 0xfb;
+    frame[2] = 0x90 | (pad << 1);
+    frame[3] = 0xc4;
+    if (fwrite(frame, size + pad, 1, f) != 1) {
+      fclose(f);
+      return -1;
+    }
+  }
+  return fclose(f);
+}
+
+static void put_le(FILE * f, unsigned long v, int bytes)
+{
+  int i;
+  for (i = 0; i < bytes; i++) {
+    fputc((v >> (8 * i)) & 0xff, f);
+  }
+}
+
+int synth_have_ogg(void)
+{
+  return system("command -v oggenc >/dev/null 2>&1") == 0;
+}
+
+int synth_ogg(const char *file, int ms)
+{
+  char wav[4096];
+  snprintf(wav, sizeof(wav), "%s.wav", file);
+  FILE *f = fopen(wav, "wb");
+  if (f == NULL) {
+    return -1;
+  }
+  unsigned long samples = (unsigned long)ms * 22050 / 1000;
+  fputs("RIFF", f);
+  put_le(f, 36 + samples * 2, 4);
+  fputs("WAVEfmt ", f);
+  put_le(f, 16, 4);
+  put_le(f, 1, 2);          // PCM
+  put_le(f, 1, 2);          // mono
+  put_le(f, 22050, 4);
+  put_le(f, 22050 * 2, 4);
+  put_le(f, 2, 2);
+  put_le(f, 16, 2);
+  fputs("data", f);
+  put_le(f, samples * 2, 4);
+  static const char zeros[4096];
+  unsigned long n = samples * 2;
+  while (n > 0) {
+    unsigned long k = (n > sizeof(zeros)) ? sizeof(zeros) : n;
+    fwrite(zeros, k, 1, f);
+    n -= k;
+  }
+  fclose(f);
+
+  char cmd[8192 + 64];
+  snprintf(cmd, sizeof(cmd), "oggenc -Q -q 0 -o '%s' '%s'", file, wav);
+  int r = system(cmd);
+  unlink(wav);
+  return (r == 0) ? 0 : -1;
+}
+
+/**********************************************************************/
+
+void synth_defaults(synth_config_t * c)
+{
+  c->artists = 10;
+  c->albums = 2;
+  c->tracks = 12;
+  c->track_s = 240;
+  c->ogg = 0;
+  c->seed = 1;
+}
+
+static int mkdir_p(const char *dir)
+{
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return -1;
+  }
+  return 0;
+}
+
+// ms in cue sheet time: mm:ss:ff, the engine reads ff as 1/100s
+static void cue_time(FILE * f, int ms)
+{
+  fprintf(f, "%02d:%02d:%02d", ms / 60000, (ms / 1000) % 60, (ms % 1000) / 10);
+}
+
+static int album(const char *dir, const synth_config_t * c, int artist, int alb, unsigned int *seed)
+{
+  char path[4096];
+  const char *ext = c->ogg ? "ogg" : "mp3";
+  int *starts = (int *)malloc(sizeof(int) * (c->tracks + 1));
+  int t;
+
+  starts[0] = 0;
+  for (t = 0; t < c->tracks; t++) {
+    // average +- 25%
+    int ms = c->track_s * 1000;
+    ms += (int)((rand_r(seed) % 501 - 250) / 1000.0 * ms);
+    starts[t + 1] = starts[t] + ms;
+  }
+
+  snprintf(path, sizeof(path), "%s/album.%s", dir, ext);
+  int r = c->ogg ? synth_ogg(path, starts[c->tracks]) : synth_mp3(path, starts[c->tracks]);
+  if (r != 0) {
+    free(starts);
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "%s/album.cue", dir);
+  FILE *f = fopen(path, "wt");
+  if (f == NULL) {
+    free(starts);
+    return -1;
+  }
+  fprintf(f, "REM GENRE \"Synthetic\"\r\n");
+  fprintf(f, "REM DATE %d\r\n", 1960 + (artist * 7 + alb) % 60);
+  fprintf(f, "PERFORMER \"Artist %02d\"\r\n", artist);
+  fprintf(f, "TITLE \"Album %02d of Artist %02d\"\r\n", alb, artist);
+  fprintf(f, "FILE \"album.%s\" %s\r\n", ext, c->ogg ? "OGG" : "MP3");
+  for (t = 0; t < c->tracks; t++) {
+    fprintf(f, "  TRACK %02d AUDIO\r\n", t + 1);
+    fprintf(f, "    TITLE \"Track %d of album %d\"\r\n", t + 1, alb);
+    fprintf(f, "    PERFORMER \"Artist %02d\"\r\n", artist);
+    fprintf(f, "    INDEX 01 ");
+    cue_time(f, starts[t]);
+    fprintf(f, "\r\n");
+  }
+  fclose(f);
+  free(starts);
+
+  snprintf(path, sizeof(path), "%s/folder.jpg", dir);
+  f = fopen(path, "wb");
+  if (f != NULL) {
+    static const unsigned char jpg[] = { 0xff, 0xd8, 0xff, 0xe0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 0xff, 0xd9 };
+    fwrite(jpg, sizeof(jpg), 1, f);
+    fclose(f);
+  }
+  return c->tracks;
+}
+
+int synth_library(const char *dir, const synth_config_t * c)
+{
+  char path[4096];
+  unsigned int seed = c->seed;
+  int a, b, total = 0;
+
+  if (c->ogg && !synth_have_ogg()) {
+    fprintf(stderr, "synth: oggenc is needed for Ogg Vorbis\n");
+    return -1;
+  }
+  if (mkdir_p(dir) != 0) {
+    return -1;
+  }
+  for (a = 1; a <= c->artists; a++) {
+    snprintf(path, sizeof(path), "%s/Artist %02d", dir, a);
+    if (mkdir_p(path) != 0) {
+      return -1;
+    }
+    for (b = 1; b <= c->albums; b++) {
+      snprintf(path, sizeof(path), "%s/Artist %02d/Album %02d", dir, a, b);
+      if (mkdir_p(path) != 0) {
+        return -1;
+      }
+      int n = album(path, c, a, b, &seed);
+      if (n < 0) {
+        return -1;
+      }
+      total += n;
+    }
+  }
+  return total;
+}
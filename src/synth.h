@@ -0,0 +1,54 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __SYNTH__HOD
+#define __SYNTH__HOD
+
+/*
+ * Synthetic music library for the benchmarks. Audio is silence: MP3
+ * is built from empty MPEG-1 layer III frames, Ogg Vorbis is made by
+ * running oggenc on a silent WAV when it is installed. Every album is
+ * one audio file with a cue sheet next to it:
+ *
+ *   dir/Artist NN/Album NN/album.{mp3,ogg}
+ *   dir/Artist NN/Album NN/album.cue
+ *   dir/Artist NN/Album NN/folder.jpg
+ *
+ * Track lengths vary around the average, deterministically for a seed.
+ */
+
+typedef struct {
+  int artists;
+  int albums;         // per artist
+  int tracks;         // per album
+  int track_s;        // average track length
+  int ogg;
+  unsigned int seed;
+} synth_config_t;
+
+void synth_defaults(synth_config_t * c);
+
+int synth_mp3(const char *file, int ms);
+int synth_ogg(const char *file, int ms);
+int synth_have_ogg(void);
+
+// Returns the number of tracks, -1 on errors
+int synth_library(const char *dir, const synth_config_t * c);
+
+#endif
@@ -0,0 +1,289 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "trace.h"
+#include "intern.h"
+#include "strtable.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#define ALLOC_TAG ALLOC_LOG
+#include "allocprof.h"
+
+#define MAGIC           "MP3CUETR"
+#define OP_RECORD_SIZE  44
+
+typedef struct {
+  const intern_t *key;
+  unsigned int id;
+} trace_path_t;
+
+static char *FILE_NAME = NULL;
+static FILE *OUT = NULL;
+static strtable_t *PATHS = NULL;
+static unsigned int N_PATHS = 0;
+static int ENABLED = 0;
+static unsigned long long T0 = 0;
+static int THREADS = 0;
+static pthread_mutex_t TRACE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static __thread int THREAD = 0;
+
+static const char *NAMES[TRACE_OPS] = { "getattr", "readdir", "open", "read", "release" };
+
+/**********************************************************************/
+
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned char *put(unsigned char *p, unsigned long long v, int bytes)
+{
+  int i;
+  for (i = 0; i < bytes; i++) {
+    *p++ = (v >> (8 * i)) & 0xff;
+  }
+  return p;
+}
+
+static unsigned long long get(const unsigned char *p, int bytes)
+{
+  unsigned long long v = 0;
+  int i;
+  for (i = bytes - 1; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+static const intern_t *path_key(const void *item)
+{
+  return ((const trace_path_t *) item)->key;
+}
+
+static void path_destroy(void *item)
+{
+  intern_release(((trace_path_t *) item)->key);
+  mc_free(item);
+}
+
+// Must be called with TRACE_MUTEX held
+static unsigned int path_id(const char *path)
+{
+  trace_path_t *p = (trace_path_t *) strtable_get(PATHS, path);
+  if (p == NULL) {
+    unsigned char rec[7];
+    int len = strlen(path);
+    len = (len > 65535) ? 65535 : len;
+    p = (trace_path_t *) mc_malloc(sizeof(trace_path_t));
+    p->key = intern(path);
+    p->id = N_PATHS++;
+    strtable_put(PATHS, p);
+    put(put(put(rec, TRACE_REC_PATH, 1), p->id, 4), len, 2);
+    fwrite(rec, sizeof(rec), 1, OUT);
+    fwrite(path, len, 1, OUT);
+  }
+  return p->id;
+}
+
+/**********************************************************************/
+
+void trace_configure(const char *file)
+{
+  mc_free(FILE_NAME);
+  FILE_NAME = (file == NULL) ? NULL : mc_strdup(file);
+}
+
+int trace_start(void)
+{
+  if (FILE_NAME == NULL) {
+    return 0;
+  }
+  OUT = fopen(FILE_NAME, "wb");
+  if (OUT == NULL) {
+    log_error2("trace: cannot write %s", FILE_NAME);
+    return -1;
+  }
+  // Records are small, write them out in big blocks
+  setvbuf(OUT, NULL, _IOFBF, 1024 * 1024);
+  unsigned char hdr[20];
+  memcpy(hdr, MAGIC, 8);
+  put(put(hdr + 8, TRACE_VERSION, 4), (unsigned long long)time(NULL), 8);
+  fwrite(hdr, sizeof(hdr), 1, OUT);
+  PATHS = strtable_new(1024, path_key, path_destroy);
+  N_PATHS = 0;
+  THREADS = 0;
+  T0 = now_ns();
+  __atomic_store_n(&ENABLED, 1, __ATOMIC_RELEASE);
+  log_info2("trace: recording to %s", FILE_NAME);
+  return 0;
+}
+
+void trace_stop(void)
+{
+  pthread_mutex_lock(&TRACE_MUTEX);
+  if (OUT != NULL) {
+    __atomic_store_n(&ENABLED, 0, __ATOMIC_RELEASE);
+    fclose(OUT);
+    OUT = NULL;
+    strtable_destroy(PATHS);
+    PATHS = NULL;
+    log_info3("trace: %u paths, %d threads", N_PATHS, THREADS);
+  }
+  pthread_mutex_unlock(&TRACE_MUTEX);
+  mc_free(FILE_NAME);
+  FILE_NAME = NULL;
+}
+
+int trace_enabled(void)
+{
+  return __atomic_load_n(&ENABLED, __ATOMIC_ACQUIRE);
+}
+
+// Start time of an operation, 0 when not tracing
+unsigned long long trace_clock(void)
+{
+  return trace_enabled() ? now_ns() : 0;
+}
+
+void trace_op(int op, const char *path, unsigned long long handle,
+              long long offset, unsigned int size, int result, unsigned long long t0)
+{
+  if (t0 == 0) {
+    return;
+  }
+  unsigned long long dur = (now_ns() - t0) / 1000;
+  unsigned char rec[OP_RECORD_SIZE], *p = rec;
+
+  pthread_mutex_lock(&TRACE_MUTEX);
+  if (OUT != NULL) {
+    if (THREAD == 0) {
+      THREAD = ++THREADS;
+    }
+    p = put(p, TRACE_REC_OP, 1);
+    p = put(p, op, 1);
+    p = put(p, THREAD, 2);
+    p = put(p, path_id(path), 4);
+    p = put(p, handle, 8);
+    p = put(p, (unsigned long long)offset, 8);
+    p = put(p, size, 4);
+    p = put(p, (unsigned int)result, 4);
+    p = put(p, t0 - T0, 8);
+    p = put(p, (dur > 0xffffffffULL) ? 0xffffffffULL : dur, 4);
+    fwrite(rec, sizeof(rec), 1, OUT);
+  }
+  pthread_mutex_unlock(&TRACE_MUTEX);
+}
+
+/**********************************************************************/
+
+const char *trace_op_name(int op)
+{
+  return (op >= 0 && op < TRACE_OPS) ? NAMES[op] : "?";
+}
+
+void trace_free(trace_t * t)
+{
+  int i;
+  if (t == NULL) {
+    return;
+  }
+  for (i = 0; i < t->n_paths; i++) {
+    mc_free(t->paths[i]);
+  }
+  mc_free(t->paths);
+  mc_free(t->recs);
+  mc_free(t);
+}
+
+// Reads a whole trace; NULL when it can't be read or isn't a trace
+trace_t *trace_load(const char *file)
+{
+  FILE *f = fopen(file, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  unsigned char buf[OP_RECORD_SIZE + 65536];
+  if (fread(buf, 20, 1, f) != 1 || memcmp(buf, MAGIC, 8) != 0 || get(buf + 8, 4) != TRACE_VERSION) {
+    fclose(f);
+    return NULL;
+  }
+
+  trace_t *t = (trace_t *) mc_malloc(sizeof(trace_t));
+  memset(t, 0, sizeof(trace_t));
+  t->start = get(buf + 12, 8);
+  int paths_size = 0, recs_size = 0, ok = 1;
+  int kind;
+  while ((kind = fgetc(f)) != EOF && ok) {
+    if (kind == TRACE_REC_PATH) {
+      ok = (fread(buf, 6, 1, f) == 1);
+      unsigned int id = get(buf, 4);
+      int len = get(buf + 4, 2);
+      ok = ok && (id == (unsigned int)t->n_paths) && (len == 0 || fread(buf, len, 1, f) == 1);
+      if (ok) {
+        if (t->n_paths == paths_size) {
+          paths_size = (paths_size == 0) ? 256 : paths_size * 2;
+          t->paths = (char **)mc_realloc(t->paths, sizeof(char *) * paths_size);
+        }
+        char *p = (char *)mc_malloc(len + 1);
+        memcpy(p, buf, len);
+        p[len] = '\0';
+        t->paths[t->n_paths++] = p;
+      }
+    } else if (kind == TRACE_REC_OP) {
+      ok = (fread(buf, OP_RECORD_SIZE - 1, 1, f) == 1);
+      if (ok) {
+        if (t->n_recs == recs_size) {
+          recs_size = (recs_size == 0) ? 4096 : recs_size * 2;
+          t->recs = (trace_rec_t *) mc_realloc(t->recs, sizeof(trace_rec_t) * recs_size);
+        }
+        trace_rec_t *r = &t->recs[t->n_recs];
+        r->op = get(buf, 1);
+        r->thread = get(buf + 1, 2);
+        r->path = get(buf + 3, 4);
+        r->handle = get(buf + 7, 8);
+        r->offset = (long long)get(buf + 15, 8);
+        r->size = get(buf + 23, 4);
+        r->result = (int)(unsigned int)get(buf + 27, 4);
+        r->t_ns = get(buf + 31, 8);
+        r->dur_us = get(buf + 39, 4);
+        ok = (r->op < TRACE_OPS) && (r->path < (unsigned int)t->n_paths);
+        if (ok) {
+          t->n_recs += 1;
+          if (r->thread > t->threads) {
+            t->threads = r->thread;
+          }
+        }
+      }
+    } else {
+      ok = 0;
+    }
+  }
+  fclose(f);
+  if (!ok) {
+    log_error3("trace: %s is damaged after %d operations", file, t->n_recs);
+  }
+  return t;
+}
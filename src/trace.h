@@ -0,0 +1,86 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __TRACE__HOD
+#define __TRACE__HOD
+
+/*
+ * Trace of the file system operations, for replaying access patterns
+ * of players, importers and indexers. A trace is a binary file, little
+ * endian:
+ *
+ *   header   "MP3CUETR", u32 version, u64 start (unix time)
+ *   path     u8 TRACE_REC_PATH, u32 id, u16 length, the characters
+ *   op       u8 TRACE_REC_OP, u8 op, u16 thread, u32 path id,
+ *            u64 handle, u64 offset, u32 size, i32 result,
+ *            u64 time since start in ns, u32 duration in us
+ *
+ * A path record comes before the first op on that path. The handle is
+ * fi->fh after the operation: handles that are equal may be used for
+ * each other. Threads are numbered in the order they first show up.
+ */
+
+#define TRACE_VERSION   1
+
+#define TRACE_REC_PATH  1
+#define TRACE_REC_OP    2
+
+#define TRACE_GETATTR   0
+#define TRACE_READDIR   1
+#define TRACE_OPEN      2
+#define TRACE_READ      3
+#define TRACE_RELEASE   4
+#define TRACE_OPS       5
+
+typedef struct {
+  int op;
+  int thread;
+  unsigned int path;
+  unsigned long long handle;
+  long long offset;
+  unsigned int size;
+  int result;
+  unsigned long long t_ns;
+  unsigned int dur_us;
+} trace_rec_t;
+
+typedef struct {
+  unsigned long long start;
+  char **paths;
+  int n_paths;
+  trace_rec_t *recs;
+  int n_recs;
+  int threads;
+} trace_t;
+
+// Recording
+void trace_configure(const char *file);
+int trace_start(void);
+void trace_stop(void);
+int trace_enabled(void);
+unsigned long long trace_clock(void);
+void trace_op(int op, const char *path, unsigned long long handle,
+              long long offset, unsigned int size, int result, unsigned long long t0);
+
+// Reading
+trace_t *trace_load(const char *file);
+void trace_free(trace_t * t);
+const char *trace_op_name(int op);
+
+#endif
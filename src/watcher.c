@@ -0,0 +1,609 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+
+#include "watcher.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <elementals/hash.h>
+#include <elementals/log.h>
+#include <elementals/memcheck.h>
+#include "allocprof.h"
+
+/**********************************************************************/
+
+typedef struct {
+  unsigned long stamp;
+  time_t mtime;
+  off_t size;
+  ino_t ino;
+  int known;    // mtime/size/ino have been recorded (scan mode)
+} watch_stamp_t;
+
+static hash_data_t watch_stamp_copy(watch_stamp_t * e)
+{
+  watch_stamp_t *n = (watch_stamp_t *) mc_malloc(sizeof(watch_stamp_t));
+  memcpy(n, e, sizeof(watch_stamp_t));
+  return (hash_data_t) n;
+}
+
+static void watch_stamp_destroy(hash_data_t d)
+{
+  mc_free(d);
+}
+
+DECLARE_HASH(stamphash, watch_stamp_t);
+IMPLEMENT_HASH(stamphash, watch_stamp_t, watch_stamp_copy, watch_stamp_destroy);
+
+static stamphash *STAMPS = NULL;
+static pthread_mutex_t STAMP_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long COUNTER = 0;
+
+static int MODE = WATCHER_OFF;  // read by FUSE threads, changed by the watcher thread
+static int MAX_WATCHES = 8192;
+static int SCAN_INTERVAL = 10;
+static char *BASE = NULL;
+
+static pthread_t THREAD;
+static int RUNNING = 0;      // read by the watcher thread, atomically
+static int WANT_SCAN = 0;    // set by any thread, atomically
+
+/**********************************************************************/
+
+static int running(void)
+{
+  return __atomic_load_n(&RUNNING, __ATOMIC_ACQUIRE);
+}
+
+static int mode(void)
+{
+  return __atomic_load_n(&MODE, __ATOMIC_ACQUIRE);
+}
+
+static void set_mode(int m)
+{
+  __atomic_store_n(&MODE, m, __ATOMIC_RELEASE);
+}
+
+static void record(watch_stamp_t * e, const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    e->ino = st.st_ino;
+  } else {
+    e->mtime = 0;
+    e->size = -1;
+    e->ino = 0;
+  }
+  e->known = 1;
+}
+
+// Must be called with STAMP_MUTEX held.
+static watch_stamp_t *bump_locked(const char *path)
+{
+  watch_stamp_t *e = stamphash_get(STAMPS, path);
+  if (e == NULL) {
+    watch_stamp_t n = { ++COUNTER, 0, -1, 0, 0 };
+    stamphash_put(STAMPS, path, &n);
+    e = stamphash_get(STAMPS, path);
+  } else {
+    e->stamp = ++COUNTER;
+  }
+  return e;
+}
+
+static void bump(const char *path)
+{
+  pthread_mutex_lock(&STAMP_MUTEX);
+  bump_locked(path);
+  pthread_mutex_unlock(&STAMP_MUTEX);
+}
+
+// Bumps path only when it has been asked for; events for files nobody
+// looks at (downloads, temp files of taggers) leave no stamp behind
+static void bump_known(const char *path)
+{
+  pthread_mutex_lock(&STAMP_MUTEX);
+  watch_stamp_t *e = stamphash_get(STAMPS, path);
+  if (e != NULL) {
+    e->stamp = ++COUNTER;
+  }
+  pthread_mutex_unlock(&STAMP_MUTEX);
+}
+
+// Drops the stamp of a path that is gone. Asking for it again gets a new
+// stamp, which differs from every stamp handed out before.
+static void forget(const char *path)
+{
+  pthread_mutex_lock(&STAMP_MUTEX);
+  if (stamphash_get(STAMPS, path) != NULL) {
+    stamphash_del(STAMPS, path);
+  }
+  pthread_mutex_unlock(&STAMP_MUTEX);
+}
+
+static void bump_all(void)
+{
+  pthread_mutex_lock(&STAMP_MUTEX);
+  hash_iter_t it = stamphash_iter(STAMPS);
+  while (!stamphash_iter_end(it)) {
+    watch_stamp_t *e = stamphash_get(STAMPS, stamphash_iter_key(it));
+    e->stamp = ++COUNTER;
+    e->known = 0;
+    it = stamphash_iter_next(it);
+  }
+  pthread_mutex_unlock(&STAMP_MUTEX);
+}
+
+static char *dir_of(const char *path)
+{
+  char *d = mc_strdup(path);
+  int i;
+  for (i = strlen(d) - 1; i > 0 && d[i] != '/'; i--) ;
+  d[i] = '\0';
+  return d;
+}
+
+static char *join(const char *dir, const char *name)
+{
+  char *p = (char *)mc_malloc(strlen(dir) + strlen(name) + 2);
+  sprintf(p, "%s/%s", dir, name);
+  return p;
+}
+
+/**********************************************************************
+ * inotify
+ */
+
+#ifdef __linux__
+
+typedef struct {
+  int wd;
+} watch_dir_t;
+
+static hash_data_t watch_dir_copy(watch_dir_t * e)
+{
+  watch_dir_t *n = (watch_dir_t *) mc_malloc(sizeof(watch_dir_t));
+  n->wd = e->wd;
+  return (hash_data_t) n;
+}
+
+static void watch_dir_destroy(hash_data_t d)
+{
+  mc_free(d);
+}
+
+DECLARE_HASH(watchdirhash, watch_dir_t);
+IMPLEMENT_HASH(watchdirhash, watch_dir_t, watch_dir_copy, watch_dir_destroy);
+
+static pthread_mutex_t WD_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static watchdirhash *DIRS = NULL;
+static char **WDS = NULL;
+static int WDS_SIZE = 0;
+static int WATCHES = 0;
+static int IFD = -1;
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Must be called with WD_MUTEX held. Returns 0 when the watch limit is hit.
+static int add_watch_locked(const char *dir)
+{
+  watch_dir_t *w = watchdirhash_get(DIRS, dir);
+  if (w != NULL) {
+    return 1;
+  }
+  if (IFD < 0) {
+    // fell back to scanning
+    return 1;
+  }
+  if (WATCHES >= MAX_WATCHES) {
+    log_error2("watcher: watch limit of %d reached", MAX_WATCHES);
+    return 0;
+  }
+  int wd = inotify_add_watch(IFD, dir, WATCH_MASK);
+  if (wd < 0) {
+    if (errno == ENOSPC || errno == ENOMEM) {
+      log_error2("watcher: kernel watch limit reached at %d watches", WATCHES);
+      return 0;
+    }
+    // vanished or not accessible, nothing to watch
+    return 1;
+  }
+  if (wd >= WDS_SIZE) {
+    int n = WDS_SIZE * 2 + 1024;
+    while (wd >= n) {
+      n *= 2;
+    }
+    WDS = (char **)mc_realloc(WDS, sizeof(char *) * n);
+    memset(&WDS[WDS_SIZE], 0, sizeof(char *) * (n - WDS_SIZE));
+    WDS_SIZE = n;
+  }
+  if (WDS[wd] == NULL) {
+    WATCHES += 1;
+  } else {
+    mc_free(WDS[wd]);
+  }
+  WDS[wd] = mc_strdup(dir);
+  watch_dir_t nw = { wd };
+  watchdirhash_put(DIRS, dir, &nw);
+  return 1;
+}
+
+static int add_tree_locked(const char *dir)
+{
+  if (!add_watch_locked(dir)) {
+    return 0;
+  }
+  DIR *dh = opendir(dir);
+  if (dh == NULL) {
+    return 1;
+  }
+  int ok = 1;
+  struct dirent *de;
+  while (ok && (de = readdir(dh)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    int isdir = (de->d_type == DT_DIR);
+    char *p = NULL;
+    if (de->d_type == DT_UNKNOWN) {
+      struct stat st;
+      p = join(dir, de->d_name);
+      isdir = (lstat(p, &st) == 0 && S_ISDIR(st.st_mode));
+    }
+    if (isdir) {
+      if (p == NULL) {
+        p = join(dir, de->d_name);
+      }
+      ok = add_tree_locked(p);
+    }
+    mc_free(p);
+  }
+  closedir(dh);
+  return ok;
+}
+
+static void fall_back_to_scanning(void)
+{
+  log_error("watcher: falling back to periodic scanning");
+  // FUSE threads add watches under WD_MUTEX, they must not get hold of
+  // a closed (or reused) descriptor
+  pthread_mutex_lock(&WD_MUTEX);
+  close(IFD);
+  IFD = -1;
+  pthread_mutex_unlock(&WD_MUTEX);
+  set_mode((SCAN_INTERVAL > 0) ? WATCHER_SCAN : WATCHER_OFF);
+  // Anything may have changed while we're switching
+  bump_all();
+}
+
+static void inotify_step(void)
+{
+  struct pollfd pfd = { IFD, POLLIN, 0 };
+  if (poll(&pfd, 1, 1000) <= 0) {
+    return;
+  }
+
+  char buf[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len = read(IFD, buf, sizeof(buf));
+  if (len <= 0) {
+    return;
+  }
+
+  int overflow = 0, limit = 0;
+  char *ptr;
+  pthread_mutex_lock(&WD_MUTEX);
+  for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+    const struct inotify_event *ev = (const struct inotify_event *)ptr;
+    if (ev->mask & IN_Q_OVERFLOW) {
+      overflow = 1;
+      continue;
+    }
+    if (ev->wd < 0 || ev->wd >= WDS_SIZE || WDS[ev->wd] == NULL) {
+      continue;
+    }
+    const char *dir = WDS[ev->wd];
+    if (ev->mask & IN_IGNORED) {
+      // gone, a directory made again under this name gets a new watch
+      forget(dir);
+      watch_dir_t *w = watchdirhash_get(DIRS, dir);
+      if (w != NULL && w->wd == ev->wd) {
+        watchdirhash_del(DIRS, dir);
+      }
+      mc_free(WDS[ev->wd]);
+      WDS[ev->wd] = NULL;
+      WATCHES -= 1;
+      continue;
+    }
+    if (ev->len > 0) {
+      char *p = join(dir, ev->name);
+      log_debug3("watcher: %s changed (%x)", p, ev->mask);
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        forget(p);
+      } else {
+        bump_known(p);
+      }
+      if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        if (!add_tree_locked(p)) {
+          limit = 1;
+        }
+      }
+      mc_free(p);
+    }
+    bump(dir);
+  }
+  pthread_mutex_unlock(&WD_MUTEX);
+
+  if (limit) {
+    fall_back_to_scanning();
+  } else if (overflow) {
+    log_error("watcher: inotify queue overflow, invalidating everything");
+    bump_all();
+  }
+}
+
+static int start_inotify(const char *basedir)
+{
+  if (MAX_WATCHES <= 0) {
+    return 0;
+  }
+  IFD = inotify_init();
+  if (IFD < 0) {
+    log_error2("watcher: inotify_init failed, errno=%d", errno);
+    return 0;
+  }
+  DIRS = watchdirhash_new(1000, HASH_CASE_SENSITIVE);
+  pthread_mutex_lock(&WD_MUTEX);
+  int ok = add_tree_locked(basedir);
+  pthread_mutex_unlock(&WD_MUTEX);
+  if (!ok) {
+    close(IFD);
+    IFD = -1;
+    return 0;
+  }
+  log_info2("watcher: watching with %d inotify watches", WATCHES);
+  return 1;
+}
+
+// Files outside the base directory (absolute FILE entries in cue sheets)
+// get a watch on their directory when they're first asked for.
+static void watch_outside_base(const char *path)
+{
+  if (strncmp(path, BASE, strlen(BASE)) == 0) {
+    return;
+  }
+  char *dir = dir_of(path);
+  pthread_mutex_lock(&WD_MUTEX);
+  int ok = add_watch_locked(dir);
+  pthread_mutex_unlock(&WD_MUTEX);
+  mc_free(dir);
+  if (!ok) {
+    // the watcher thread owns the inotify descriptor
+    __atomic_store_n(&WANT_SCAN, 1, __ATOMIC_RELEASE);
+  }
+}
+
+static void stop_inotify(void)
+{
+  pthread_mutex_lock(&WD_MUTEX);
+  if (IFD >= 0) {
+    close(IFD);
+    IFD = -1;
+  }
+  pthread_mutex_unlock(&WD_MUTEX);
+  int i;
+  for (i = 0; i < WDS_SIZE; i++) {
+    mc_free(WDS[i]);
+  }
+  mc_free(WDS);
+  WDS = NULL;
+  WDS_SIZE = 0;
+  WATCHES = 0;
+  if (DIRS != NULL) {
+    watchdirhash_destroy(DIRS);
+    DIRS = NULL;
+  }
+}
+
+#endif
+
+/**********************************************************************
+ * Periodic scanning
+ */
+
+static void scan_step(void)
+{
+  // Copy the paths, so we don't stat() with the lock held
+  pthread_mutex_lock(&STAMP_MUTEX);
+  int n = stamphash_count(STAMPS), k = 0;
+  char **paths = (char **)mc_malloc(sizeof(char *) * (n + 1));
+  hash_iter_t it = stamphash_iter(STAMPS);
+  while (!stamphash_iter_end(it) && k < n) {
+    paths[k++] = mc_strdup(stamphash_iter_key(it));
+    it = stamphash_iter_next(it);
+  }
+  pthread_mutex_unlock(&STAMP_MUTEX);
+
+  int i;
+  for (i = 0; i < k && running(); i++) {
+    watch_stamp_t now;
+    record(&now, paths[i]);
+    pthread_mutex_lock(&STAMP_MUTEX);
+    watch_stamp_t *e = stamphash_get(STAMPS, paths[i]);
+    if (e != NULL) {
+      if (!e->known) {
+        e->mtime = now.mtime;
+        e->size = now.size;
+        e->ino = now.ino;
+        e->known = 1;
+      } else if (e->mtime != now.mtime || e->size != now.size || e->ino != now.ino) {
+        log_debug2("watcher: %s changed (scan)", paths[i]);
+        e->mtime = now.mtime;
+        e->size = now.size;
+        e->ino = now.ino;
+        e->stamp = ++COUNTER;
+      }
+    }
+    pthread_mutex_unlock(&STAMP_MUTEX);
+    mc_free(paths[i]);
+  }
+  for (; i < k; i++) {
+    mc_free(paths[i]);
+  }
+  mc_free(paths);
+
+  for (i = 0; i < SCAN_INTERVAL && running() && mode() == WATCHER_SCAN; i++) {
+    sleep(1);
+  }
+}
+
+static void *watcher_thread(void *arg)
+{
+  while (running() && mode() != WATCHER_OFF) {
+#ifdef __linux__
+    if (mode() == WATCHER_INOTIFY) {
+      if (__atomic_load_n(&WANT_SCAN, __ATOMIC_ACQUIRE)) {
+        fall_back_to_scanning();
+      } else {
+        inotify_step();
+      }
+      continue;
+    }
+#endif
+    scan_step();
+  }
+  return NULL;
+}
+
+/**********************************************************************/
+
+void watcher_configure(int max_watches, int scan_interval_in_s)
+{
+  MAX_WATCHES = max_watches;
+  SCAN_INTERVAL = scan_interval_in_s;
+}
+
+int watcher_start(const char *basedir)
+{
+  STAMPS = stamphash_new(1000, HASH_CASE_SENSITIVE);
+  BASE = mc_strdup(basedir);
+
+#ifdef __linux__
+  if (start_inotify(basedir)) {
+    set_mode(WATCHER_INOTIFY);
+  } else
+#endif
+  if (SCAN_INTERVAL > 0) {
+    log_info2("watcher: scanning every %d seconds", SCAN_INTERVAL);
+    set_mode(WATCHER_SCAN);
+  } else {
+    log_info("watcher: disabled");
+    set_mode(WATCHER_OFF);
+  }
+
+  if (mode() != WATCHER_OFF) {
+    RUNNING = 1;
+    if (pthread_create(&THREAD, NULL, watcher_thread, NULL) != 0) {
+      log_error("watcher: cannot create thread");
+      RUNNING = 0;
+      set_mode(WATCHER_OFF);
+    }
+  }
+  return mode();
+}
+
+void watcher_stop(void)
+{
+  if (running()) {
+    __atomic_store_n(&RUNNING, 0, __ATOMIC_RELEASE);
+    pthread_join(THREAD, NULL);
+  }
+  set_mode(WATCHER_OFF);
+#ifdef __linux__
+  stop_inotify();
+#endif
+  if (STAMPS != NULL) {
+    stamphash_destroy(STAMPS);
+    STAMPS = NULL;
+  }
+  mc_free(BASE);
+  BASE = NULL;
+}
+
+int watcher_active(void)
+{
+  return mode() != WATCHER_OFF;
+}
+
+int watcher_mode(void)
+{
+  return mode();
+}
+
+unsigned long watcher_stamp(const char *full_path)
+{
+  if (mode() == WATCHER_OFF) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&STAMP_MUTEX);
+  watch_stamp_t *e = stamphash_get(STAMPS, full_path);
+  if (e != NULL) {
+    unsigned long stamp = e->stamp;
+    pthread_mutex_unlock(&STAMP_MUTEX);
+    return stamp;
+  }
+  // First time we see this path; stamps are never 0, so callers can
+  // use 0 for "never looked at".
+  e = bump_locked(full_path);
+  if (mode() == WATCHER_SCAN) {
+    record(e, full_path);
+  }
+  unsigned long stamp = e->stamp;
+  pthread_mutex_unlock(&STAMP_MUTEX);
+
+#ifdef __linux__
+  if (mode() == WATCHER_INOTIFY) {
+    watch_outside_base(full_path);
+  }
+#endif
+
+  return stamp;
+}
+
+void watcher_touch(const char *full_path)
+{
+  if (mode() != WATCHER_OFF) {
+    bump(full_path);
+  }
+}
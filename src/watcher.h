@@ -0,0 +1,48 @@
+/*
+   This file is part of mp3cuefuse.
+   Copyright 2013, Hans Oesterholt <debian@oesterholt.net>
+
+   mp3cuefuse is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   mp3cuefuse is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with elementals.  If not, see <http://www.gnu.org/licenses/>.
+
+   ********************************************************************
+*/
+#ifndef __WATCHER__HOD
+#define __WATCHER__HOD
+
+/*
+ * The watcher keeps a change stamp per path. A stamp changes whenever
+ * the file (or, for a directory, one of its entries) changes. Callers
+ * remember the stamp they have seen and only need to stat() a file
+ * again when the stamp differs. Only paths that have been asked for
+ * get a stamp, and it is dropped when the path is deleted or moved away.
+ *
+ * On Linux inotify watches the whole base directory tree. When inotify
+ * is not available or the watch limit is reached, the watcher falls
+ * back to stat()ing all known paths every scan interval.
+ */
+
+#define WATCHER_OFF      0
+#define WATCHER_INOTIFY  1
+#define WATCHER_SCAN     2
+
+void watcher_configure(int max_watches, int scan_interval_in_s);
+int watcher_start(const char *basedir);
+void watcher_stop(void);
+
+int watcher_active(void);
+int watcher_mode(void);
+unsigned long watcher_stamp(const char *full_path);
+void watcher_touch(const char *full_path);
+
+#endif